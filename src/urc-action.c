@@ -0,0 +1,137 @@
+/* urc-action.c
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "config.h"
+
+#include <glib.h>
+#include <libgupnp/gupnp.h>
+
+#include "urc-action.h"
+#include "urc-health.h"
+#include "urc-metrics.h"
+
+extern gboolean opt_debug;
+
+typedef struct
+{
+    UrcActionInfo info;
+
+    GUPnPServiceProxyAction *action;
+    GCancellable *cancellable;
+
+    UrcActionCallback callback;
+    gpointer user_data;
+
+} UrcActionCall;
+
+static void
+urc_action_call_free (UrcActionCall *call)
+{
+    gupnp_service_proxy_action_unref (call->action);
+    g_clear_object (&call->cancellable);
+    g_free ((gchar *) call->info.name);
+    g_free (call);
+}
+
+static void
+urc_action_call_ready_cb (GObject      *source,
+                          GAsyncResult *result,
+                          gpointer      user_data)
+{
+    UrcActionCall *call = (UrcActionCall *) user_data;
+    UrcHealth *health;
+    GError *error = NULL;
+
+    gupnp_service_proxy_call_action_finish (GUPNP_SERVICE_PROXY (source),
+                                            result,
+                                            &error);
+
+    call->info.response_time = g_get_monotonic_time ();
+
+    /* The owner of the request may be gone (e.g. the router disappeared),
+     * report a plain cancellation whatever the transport said. */
+    if (call->cancellable != NULL && g_cancellable_is_cancelled (call->cancellable)) {
+
+        if (error != NULL)
+            g_error_free (error);
+
+        error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_CANCELLED, "Operation was cancelled");
+    }
+    else {
+        urc_metrics_observe_action (&call->info, error != NULL);
+
+        /* a SOAP fault is still an answer, only the transport counts */
+        health = urc_health_for_proxy (GUPNP_SERVICE_PROXY (source));
+
+        if (health != NULL && error != NULL)
+            urc_health_failure (health);
+        else if (health != NULL)
+            urc_health_success (health);
+
+        if (opt_debug)
+            g_print ("\e[34m%s() duration: %fs\e[0m\n", call->info.name,
+                     ((double) call->info.response_time - call->info.request_time) / G_USEC_PER_SEC);
+    }
+
+    call->callback (call->action, error, &call->info, call->user_data);
+
+    urc_action_call_free (call);
+}
+
+/* Returns TRUE, freeing it, if "error" is a cancellation: the callback
+ * must return without touching the data of the canceller. */
+gboolean
+urc_action_cancelled (GError *error)
+{
+    if (error == NULL || !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return FALSE;
+
+    g_error_free (error);
+    return TRUE;
+}
+
+/* Send a SOAP action without blocking the main loop, the action
+ * reference is taken over by this function. */
+void
+urc_action_call (GUPnPServiceProxy       *proxy,
+                 const gchar             *name,
+                 GUPnPServiceProxyAction *action,
+                 GCancellable            *cancellable,
+                 UrcActionCallback        callback,
+                 gpointer                 user_data)
+{
+    UrcActionCall *call;
+
+    call = g_malloc (sizeof (UrcActionCall));
+
+    call->info.name = g_strdup (name);
+    call->info.request_time = g_get_monotonic_time ();
+    call->info.response_time = 0;
+    call->action = action;
+    call->cancellable = cancellable != NULL ? g_object_ref (cancellable) : NULL;
+    call->callback = callback;
+    call->user_data = user_data;
+
+    gupnp_service_proxy_call_action_async (proxy,
+                                           action,
+                                           cancellable,
+                                           urc_action_call_ready_cb,
+                                           call);
+}
@@ -0,0 +1,64 @@
+/* urc-action.h
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __URC_ACTION_H__
+#define __URC_ACTION_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <libgupnp/gupnp.h>
+
+typedef struct
+{
+    const gchar *name;
+
+    /* monotonic times, in microseconds */
+    gint64 request_time;
+    gint64 response_time;
+
+} UrcActionInfo;
+
+/* Completion callback of an asynchronous SOAP action.
+ *
+ * "error" is the transport error, if any, and is owned by the callback.
+ * When it's NULL the OUT arguments (or the SOAP fault) can be read with
+ * gupnp_service_proxy_action_get_result(). The action is released after
+ * the callback returns.
+ *
+ * If the request was cancelled the callback still runs, with a
+ * G_IO_ERROR_CANCELLED error: check it with urc_action_cancelled()
+ * before touching any data owned by the canceller. */
+typedef void (*UrcActionCallback) (GUPnPServiceProxyAction *action,
+                                   GError                  *error,
+                                   const UrcActionInfo     *info,
+                                   gpointer                 user_data);
+
+void
+urc_action_call (GUPnPServiceProxy       *proxy,
+                 const gchar             *name,
+                 GUPnPServiceProxyAction *action,
+                 GCancellable            *cancellable,
+                 UrcActionCallback        callback,
+                 gpointer                 user_data);
+
+gboolean
+urc_action_cancelled (GError *error);
+
+#endif /* __URC_ACTION_H__ */
@@ -0,0 +1,87 @@
+/* urc-counter.c
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+#include "urc-counter.h"
+
+extern gboolean opt_debug;
+
+void
+urc_counter_init (UrcCounter *counter,
+                  guint       bits)
+{
+    counter->total = 0;
+    counter->last_raw = 0;
+    counter->bits = bits;
+    counter->valid = FALSE;
+}
+
+/* Add a reading of the router counter.
+ *
+ * A 32 bit counter wraps every ~35 s at 1 Gbit/s. A reading lower than
+ * the previous one is a wrap when the increase it implies is less than
+ * half of the counter range, otherwise the counter was reset (router
+ * reboot, link reconnection) and the reading becomes the new base.
+ *
+ * Returns TRUE and the increase in "delta" when there was a previous
+ * reading to compare with. */
+gboolean
+urc_counter_update (UrcCounter *counter,
+                    guint64     raw,
+                    guint64    *delta)
+{
+    guint64 range_mask;
+    guint64 increase;
+
+    range_mask = counter->bits >= 64 ? G_MAXUINT64 : (G_GUINT64_CONSTANT (1) << counter->bits) - 1;
+    raw &= range_mask;
+
+    if (!counter->valid) {
+        counter->total = raw;
+        counter->last_raw = raw;
+        counter->valid = TRUE;
+        return FALSE;
+    }
+
+    /* modular difference, right for both the plain and the wrapped case */
+    increase = (raw - counter->last_raw) & range_mask;
+
+    if (raw < counter->last_raw && increase > (range_mask >> 1)) {
+        if (opt_debug)
+            g_print ("\e[33m[WW]\e[0m Counter reset: %" G_GUINT64_FORMAT " -> %" G_GUINT64_FORMAT "\n",
+                     counter->last_raw, raw);
+
+        counter->last_raw = raw;
+        return FALSE;
+    }
+
+    if (raw < counter->last_raw && opt_debug)
+        g_print ("\e[34mCounter wrap: %" G_GUINT64_FORMAT " -> %" G_GUINT64_FORMAT "\e[0m\n",
+                 counter->last_raw, raw);
+
+    counter->total += increase;
+    counter->last_raw = raw;
+    *delta = increase;
+
+    return TRUE;
+}
@@ -0,0 +1,44 @@
+/* urc-counter.h
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __URC_COUNTER_H__
+#define __URC_COUNTER_H__
+
+#include <glib.h>
+
+/* 64 bit accumulator over a router byte counter of "bits" width */
+typedef struct
+{
+    guint64  total;
+    guint64  last_raw;
+    guint    bits;
+    gboolean valid;
+} UrcCounter;
+
+void
+urc_counter_init (UrcCounter *counter,
+                  guint       bits);
+
+gboolean
+urc_counter_update (UrcCounter *counter,
+                    guint64     raw,
+                    guint64    *delta);
+
+#endif /* __URC_COUNTER_H__ */
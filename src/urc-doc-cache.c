@@ -0,0 +1,270 @@
+/* urc-doc-cache.c
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <glib.h>
+
+#include "urc-doc-cache.h"
+
+extern gboolean opt_debug;
+
+/* The last root device announcement heard from a host:port */
+typedef struct
+{
+    gchar  *udn;
+    gint64  boot_id;    /* -1 when not announced */
+    gint64  config_id;
+} Announcement;
+
+/* host:port -> Announcement */
+static GHashTable *announcements = NULL;
+
+/* document URL -> Udn, BootId, ConfigId, Time */
+static GKeyFile *doc_index = NULL;
+static gchar *cache_dir = NULL;
+
+static guint64 hits = 0;
+
+static void
+announcement_free (Announcement *announcement)
+{
+    g_free (announcement->udn);
+    g_free (announcement);
+}
+
+static gchar*
+uri_host_port (SoupURI *uri)
+{
+    return g_strdup_printf ("%s:%u", uri->host, uri->port);
+}
+
+static gint64
+header_get_id (SoupMessageHeaders *headers, const gchar *name)
+{
+    const gchar *value;
+
+    value = soup_message_headers_get_one (headers, name);
+    if (value == NULL)
+        return -1;
+
+    return g_ascii_strtoll (value, NULL, 10);
+}
+
+static gchar*
+doc_cache_file (const gchar *url)
+{
+    gchar *name, *path;
+
+    name = g_compute_checksum_for_string (G_CHECKSUM_SHA1, url, -1);
+    path = g_build_filename (cache_dir, name, NULL);
+    g_free (name);
+
+    return path;
+}
+
+static void
+doc_cache_init (void)
+{
+    gchar *path;
+
+    if (doc_index != NULL)
+        return;
+
+    announcements = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) announcement_free);
+
+    cache_dir = g_build_filename (g_get_user_cache_dir (), "upnp-router-control", "documents", NULL);
+    g_mkdir_with_parents (cache_dir, 0700);
+
+    doc_index = g_key_file_new ();
+
+    path = g_build_filename (cache_dir, "doc_index", NULL);
+    g_key_file_load_from_file (doc_index, path, G_KEY_FILE_NONE, NULL);
+    g_free (path);
+}
+
+/* Keep track of the root device announcements (ssdp:alive and M-SEARCH
+ * responses), that carry the boot and configuration numbers */
+static void
+client_message_received_cb (GSSDPClient        *client,
+                            const gchar        *from_ip,
+                            gushort             from_port,
+                            gint                type,
+                            SoupMessageHeaders *headers,
+                            gpointer            user_data)
+{
+    Announcement *announcement;
+    const gchar *location, *usn, *sep;
+    SoupURI *uri;
+
+    location = soup_message_headers_get_one (headers, "Location");
+    usn = soup_message_headers_get_one (headers, "USN");
+
+    if (location == NULL || usn == NULL || !g_str_has_suffix (usn, "::upnp:rootdevice"))
+        return;
+
+    uri = soup_uri_new (location);
+    if (uri == NULL)
+        return;
+
+    sep = strstr (usn, "::");
+
+    announcement = g_new0 (Announcement, 1);
+    announcement->udn = g_strndup (usn, sep - usn);
+    announcement->boot_id = header_get_id (headers, "BOOTID.UPNP.ORG");
+    announcement->config_id = header_get_id (headers, "CONFIGID.UPNP.ORG");
+
+    g_hash_table_replace (announcements, uri_host_port (uri), announcement);
+
+    soup_uri_free (uri);
+}
+
+/* Listen to the announcements on a network, before the control point
+ * of the network so they are known when it fetches the documents */
+void
+urc_doc_cache_watch (GSSDPClient *client)
+{
+    doc_cache_init ();
+
+    g_signal_connect (client, "message-received", G_CALLBACK (client_message_received_cb), NULL);
+}
+
+/* The announcement of the device at the address of "uri", if it is "udn" */
+static Announcement*
+doc_cache_announcement (SoupURI *uri, const gchar *udn, gboolean *other)
+{
+    Announcement *announcement;
+    gchar *host_port;
+
+    host_port = uri_host_port (uri);
+    announcement = g_hash_table_lookup (announcements, host_port);
+    g_free (host_port);
+
+    *other = announcement != NULL && g_strcmp0 (announcement->udn, udn) != 0;
+
+    return *other ? NULL : announcement;
+}
+
+/* The cached document of "uri" of the root device "udn", if still valid */
+gboolean
+urc_doc_cache_lookup (SoupURI      *uri,
+                      const gchar  *udn,
+                      gchar       **data,
+                      gsize        *length)
+{
+    Announcement *announcement;
+    gchar *url, *stored_udn = NULL, *path = NULL;
+    gboolean other, valid = FALSE;
+
+    if (doc_index == NULL)
+        return FALSE;
+
+    announcement = doc_cache_announcement (uri, udn, &other);
+
+    /* another device took the address */
+    if (other)
+        return FALSE;
+
+    url = soup_uri_to_string (uri, FALSE);
+
+    stored_udn = g_key_file_get_string (doc_index, url, "Udn", NULL);
+    if (g_strcmp0 (stored_udn, udn) != 0)
+        goto out;
+
+    if (announcement != NULL && (announcement->boot_id >= 0 || announcement->config_id >= 0)) {
+        if (g_key_file_get_int64 (doc_index, url, "BootId", NULL) != announcement->boot_id ||
+            g_key_file_get_int64 (doc_index, url, "ConfigId", NULL) != announcement->config_id)
+            goto out;
+    }
+    else if (g_get_real_time () / G_USEC_PER_SEC - g_key_file_get_int64 (doc_index, url, "Time", NULL) > URC_DOC_CACHE_MAX_AGE)
+        goto out;
+
+    path = doc_cache_file (url);
+    valid = g_file_get_contents (path, data, length, NULL);
+
+    if (valid) {
+        hits++;
+
+        if (opt_debug)
+            g_print ("\e[34mDocument %s from the cache\e[0m\n", url);
+    }
+
+out:
+    g_free (path);
+    g_free (stored_udn);
+    g_free (url);
+
+    return valid;
+}
+
+/* Keep a document of the root device "udn", the callers only store the
+ * descriptions and SCPDs of the routers */
+void
+urc_doc_cache_store (SoupURI     *uri,
+                     const gchar *udn,
+                     const gchar *data,
+                     gsize        length)
+{
+    Announcement *announcement;
+    GError *error = NULL;
+    gchar *url, *path;
+    gboolean other;
+
+    if (doc_index == NULL)
+        return;
+
+    announcement = doc_cache_announcement (uri, udn, &other);
+
+    if (other)
+        return;
+
+    url = soup_uri_to_string (uri, FALSE);
+    path = doc_cache_file (url);
+
+    if (!g_file_set_contents (path, data, length, &error)) {
+        g_printerr ("\e[31m[EE]\e[0m Document cache %s: %s\n", path, error->message);
+        g_error_free (error);
+        goto out;
+    }
+
+    g_key_file_set_string (doc_index, url, "Udn", udn);
+    g_key_file_set_int64 (doc_index, url, "BootId", announcement != NULL ? announcement->boot_id : -1);
+    g_key_file_set_int64 (doc_index, url, "ConfigId", announcement != NULL ? announcement->config_id : -1);
+    g_key_file_set_int64 (doc_index, url, "Time", g_get_real_time () / G_USEC_PER_SEC);
+
+    g_free (path);
+    path = g_build_filename (cache_dir, "doc_index", NULL);
+
+    if (!g_key_file_save_to_file (doc_index, path, &error)) {
+        g_printerr ("\e[31m[EE]\e[0m Document cache %s: %s\n", path, error->message);
+        g_error_free (error);
+    }
+
+out:
+    g_free (path);
+    g_free (url);
+}
+
+guint64
+urc_doc_cache_get_hits (void)
+{
+    return hits;
+}
@@ -0,0 +1,54 @@
+/* urc-doc-cache.h
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __URC_DOC_CACHE_H__
+#define __URC_DOC_CACHE_H__
+
+#include <glib.h>
+#include <libgssdp/gssdp.h>
+#include <libsoup/soup.h>
+
+/* Description and SCPD documents of the routers, kept on disk across
+ * runs, under the UDN of their root device. A document is reused while
+ * its device announces the same BOOTID.UPNP.ORG and CONFIGID.UPNP.ORG
+ * it had when it was fetched; devices announcing neither, or not heard
+ * yet in this run, get URC_DOC_CACHE_MAX_AGE. */
+#define URC_DOC_CACHE_MAX_AGE  (24 * 60 * 60)
+
+void
+urc_doc_cache_watch (GSSDPClient *client);
+
+gboolean
+urc_doc_cache_lookup (SoupURI      *uri,
+                      const gchar  *udn,
+                      gchar       **data,
+                      gsize        *length);
+
+void
+urc_doc_cache_store (SoupURI     *uri,
+                     const gchar *udn,
+                     const gchar *data,
+                     gsize        length);
+
+/* documents taken from the cache so far */
+guint64
+urc_doc_cache_get_hits (void);
+
+#endif /* __URC_DOC_CACHE_H__ */
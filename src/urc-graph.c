@@ -25,8 +25,9 @@
 #include <glib/gi18n-lib.h>
 
 #include "urc-graph.h"
+#include "urc-worker.h"
 
-#define GRAPH_POINTS 90
+#define GRAPH_POINTS (URC_HISTORY_POINTS - 1)
 #define FRAME_WIDTH 4
 
 gboolean graph_enabled = FALSE;
@@ -34,8 +35,22 @@ gboolean graph_enabled = FALSE;
 cairo_surface_t *background = NULL;
 cairo_surface_t *graph = NULL;
 
-static GList *downspeed_values = NULL;
-static GList *upspeed_values = NULL;
+/* the data surface is scrolled into this one, then they swap */
+static cairo_surface_t *graph_back = NULL;
+
+/* sample steps scrolled so far, modulo GRAPH_POINTS */
+static guint graph_scroll_count = 0;
+
+/* Series shown, owned by the router */
+static UrcHistory *downspeed_values = NULL;
+static UrcHistory *upspeed_values = NULL;
+
+/* urc_history_get_seq() of the series when last drawn */
+static guint64 downspeed_drawn = 0;
+static guint64 upspeed_drawn = 0;
+
+/* history tier shown */
+static UrcHistoryTier graph_window = URC_HISTORY_SECONDS;
 
 // graph fullscale default value
 static guint net_max = 2;
@@ -54,6 +69,24 @@ urc_graph_set_sending_color(GdkRGBA color) {
     urc_sending_color = color;
 }
 
+/* Highest value of the points shown */
+static gdouble
+graph_series_max (const UrcHistory *history)
+{
+    const UrcHistoryPoint *point;
+    gdouble max = 0.0;
+    guint age;
+
+    for(age = 0; age <= GRAPH_POINTS; age++) {
+        point = urc_history_get(history, graph_window, age);
+
+        if(point != NULL && point->max > max)
+            max = point->max;
+    }
+
+    return max;
+}
+
 static void
 clear_graph_background()
 {
@@ -63,6 +96,7 @@ clear_graph_background()
     }
 }
 
+/* Drop the data surface, the next draw redraws all the samples */
 static void
 clear_graph_data()
 {
@@ -70,6 +104,10 @@ clear_graph_data()
         cairo_surface_destroy(graph);
         graph = NULL;
     }
+    if (graph_back) {
+        cairo_surface_destroy(graph_back);
+        graph_back = NULL;
+    }
 }
 
 static void
@@ -167,8 +205,21 @@ graph_draw_background (GtkWidget *widget)
 
         x = (x_frame_size * i) + indent;
 
-        if (i == 0)
-            label = g_strdup_printf(_("%u seconds"), GRAPH_POINTS - (GRAPH_POINTS / x_frame_count) * i);
+        if (i == 0) {
+            switch (graph_window) {
+                case URC_HISTORY_MINUTES:
+                    label = g_strdup_printf(_("%u minutes"), GRAPH_POINTS);
+                    break;
+                case URC_HISTORY_HOURS:
+                    label = g_strdup_printf(_("%u hours"), GRAPH_POINTS);
+                    break;
+                case URC_HISTORY_DAYS:
+                    label = g_strdup_printf(_("%u days"), GRAPH_POINTS);
+                    break;
+                default:
+                    label = g_strdup_printf(_("%u seconds"), GRAPH_POINTS);
+            }
+        }
         else
             label = g_strdup_printf("%u", GRAPH_POINTS - (GRAPH_POINTS / x_frame_count) * i);
 
@@ -238,7 +289,7 @@ graph_set_fullscale (double tmp_net_max)
     // workaround for values <= 10
     if(tmp_net_max != net_max && tmp_net_max <= 10) {
 
-        static unsigned cur_fullscale = 2;
+        guint cur_fullscale = net_max;
 
         if(tmp_net_max <= 2)
             net_max = 2;
@@ -250,9 +301,9 @@ graph_set_fullscale (double tmp_net_max)
         if(net_max == cur_fullscale)
             return;
 
-        cur_fullscale = net_max;
         //g_debug("Updated full scale: to %d\n", net_max);
         clear_graph_background();
+        clear_graph_data();
         return;
     }
 
@@ -267,186 +318,302 @@ graph_set_fullscale (double tmp_net_max)
 
         //g_debug("Updated full scale: to %d\n", net_max);
         clear_graph_background();
+        clear_graph_data();
     }
 }
 
+#define GRAPH_Y(value) (draw_height - 15 - 2 - (value) * (draw_height - 15 - 2) / net_max)
+#define GRAPH_X(age) (indent + ((draw_width - rmargin - indent) / GRAPH_POINTS) * (GRAPH_POINTS - (age)))
+
+/* Draw a series line from the point "from_age" old to the newest */
 static void
-graph_draw_data (GtkWidget *widget)
+graph_draw_series (cairo_t          *cr,
+                   const UrcHistory *history,
+                   guint             from_age,
+                   double            draw_width,
+                   double            draw_height,
+                   double            rmargin,
+                   guint             indent)
 {
-    cairo_t *cr;
-    GtkAllocation allocation;
-    double draw_width, draw_height;
-    const double fontsize = 6.4;
-    const double rmargin = 8 * fontsize;
-      const guint indent = 22;
-    double x, y;
-    gint i;
-    GList *list;
-    SpeedValue *speed_value;
-    guint tmp_net_max = 0;
-    
-    gtk_widget_get_allocation (widget, &allocation);
+    const UrcHistoryPoint *point;
+    gint age;
+    gboolean drawing = FALSE;
 
-    graph = gdk_window_create_similar_surface (gtk_widget_get_window (GTK_WIDGET (widget)),
-                                                  CAIRO_CONTENT_COLOR_ALPHA,
-                                                  allocation.width,
-                                                  allocation.height);
-      cr = cairo_create(graph);
+    for(age = from_age; age >= 0; age--) {
 
-    draw_width = allocation.width - 2 * FRAME_WIDTH;
-    draw_height = allocation.height - 2 * FRAME_WIDTH;
-
-    cairo_translate (cr, FRAME_WIDTH, FRAME_WIDTH);
+        point = urc_history_get(history, graph_window, age);
 
-    /* draw load lines */
-    cairo_set_antialias(cr, CAIRO_ANTIALIAS_DEFAULT);
-    cairo_set_dash (cr, NULL, 0, 0);
-    cairo_set_line_width (cr, 1.50);
-
-    /* upload speed */
-    list = upspeed_values;
-    speed_value = list->data;
+        // break the line on missing samples
+        if(point == NULL) {
+            drawing = FALSE;
+            continue;
+        }
 
-    // first point
-    if(speed_value->valid == TRUE) {
         // 2 is: FRAME_WIDTH / 2
-        y = draw_height - 15 - 2 - speed_value->speed * (draw_height - 15 - 2) / net_max;
-        x = draw_width - rmargin;
-        cairo_move_to (cr, x, y + 0.5);
+        // 15 is: bottom space
+        if(drawing)
+            cairo_line_to (cr, GRAPH_X(age), GRAPH_Y(point->avg) + 0.5);
+        else
+            cairo_move_to (cr, GRAPH_X(age), GRAPH_Y(point->avg) + 0.5);
+
+        drawing = TRUE;
     }
+}
+
+/* Min/max band of the rolled up tiers, one polygon per run of points */
+static void
+graph_draw_series_band (cairo_t          *cr,
+                        const UrcHistory *history,
+                        double            draw_width,
+                        double            draw_height,
+                        double            rmargin,
+                        guint             indent)
+{
+    const UrcHistoryPoint *point;
+    gint age, start, end;
 
-    for(i = GRAPH_POINTS; i >= 0; i--) {
+    for(start = GRAPH_POINTS; start >= 0; start = end - 1) {
 
-        speed_value = list->data;
+        // skip the missing points
+        if(urc_history_get(history, graph_window, start) == NULL) {
+            end = start;
+            continue;
+        }
 
-        if(speed_value->valid == TRUE) {
-            // 2 is: FRAME_WIDTH / 2
-            y = draw_height - 15 - 2 - speed_value->speed * (draw_height - 15 - 2) / net_max;
-            x = indent + ((draw_width - rmargin - indent) / GRAPH_POINTS) * i;
+        for(end = start; end > 0 && urc_history_get(history, graph_window, end - 1) != NULL; end--)
+            ;
 
-            cairo_line_to (cr, x, y + 0.5);
+        for(age = start; age >= end; age--) {
+            point = urc_history_get(history, graph_window, age);
 
-            if(tmp_net_max < speed_value->speed)
-                tmp_net_max = ceil(speed_value->speed);
+            if(age == start)
+                cairo_move_to (cr, GRAPH_X(age), GRAPH_Y(point->max));
+            else
+                cairo_line_to (cr, GRAPH_X(age), GRAPH_Y(point->max));
+        }
 
+        for(age = end; age <= start; age++) {
+            point = urc_history_get(history, graph_window, age);
+            cairo_line_to (cr, GRAPH_X(age), GRAPH_Y(point->min));
         }
 
-        list = list->next;
+        cairo_close_path (cr);
+    }
+}
+
+static void
+graph_stroke_series (cairo_t *cr,
+                     guint    from_age,
+                     double   draw_width,
+                     double   draw_height,
+                     double   rmargin,
+                     guint    indent)
+{
+    if(upspeed_values == NULL || downspeed_values == NULL)
+        return;
+
+    /* draw load lines */
+    cairo_set_antialias(cr, CAIRO_ANTIALIAS_DEFAULT);
+    cairo_set_dash (cr, NULL, 0, 0);
+    cairo_set_line_width (cr, 1.50);
+
+    // raw samples have no spread
+    if(graph_window != URC_HISTORY_SECONDS) {
+        graph_draw_series_band (cr, upspeed_values, draw_width, draw_height, rmargin, indent);
+        cairo_set_source_rgba (cr, urc_sending_color.red, urc_sending_color.green, urc_sending_color.blue, 0.25);
+        cairo_fill (cr);
+
+        graph_draw_series_band (cr, downspeed_values, draw_width, draw_height, rmargin, indent);
+        cairo_set_source_rgba (cr, urc_receiving_color.red, urc_receiving_color.green, urc_receiving_color.blue, 0.25);
+        cairo_fill (cr);
     }
 
+    /* upload speed */
+    graph_draw_series (cr, upspeed_values, from_age, draw_width, draw_height, rmargin, indent);
+
     // upload line color
     gdk_cairo_set_source_rgba(cr, &urc_sending_color);
     cairo_stroke(cr);
 
     /* download speed */
-    list = downspeed_values;
-    speed_value = list->data;
+    graph_draw_series (cr, downspeed_values, from_age, draw_width, draw_height, rmargin, indent);
 
-    if(speed_value->valid == TRUE) {
-        // 2 is: FRAME_WIDTH / 2
-        y = draw_height - 15 - 2 - speed_value->speed * (draw_height - 15 - 2) / net_max;
-        x = draw_width - rmargin;
-        cairo_move_to (cr, x, y + 0.5);
-    }
+    // download line color
+    gdk_cairo_set_source_rgba(cr, &urc_receiving_color);
+    cairo_stroke(cr);
+}
+
+/* Full redraw of the data surface */
+static void
+graph_draw_data (GtkWidget *widget)
+{
+    cairo_t *cr;
+    GtkAllocation allocation;
+    double draw_width, draw_height;
+    const double fontsize = 6.4;
+    const double rmargin = 8 * fontsize;
+    const guint indent = 22;
 
-    for(i = GRAPH_POINTS; i >= 0; i--) {
+    gtk_widget_get_allocation (widget, &allocation);
 
-        speed_value = list->data;
+    clear_graph_data();
 
-        if(speed_value->valid == TRUE) {
-            // 2 is: FRAME_WIDTH / 2
-            // 15 is: bottom space
-            y = draw_height - 15 - 2 - speed_value->speed * (draw_height - 15 - 2) / net_max;
-            x = indent + ((draw_width - rmargin - indent) / GRAPH_POINTS) * i;
+    graph = gdk_window_create_similar_surface (gtk_widget_get_window (GTK_WIDGET (widget)),
+                                                  CAIRO_CONTENT_COLOR_ALPHA,
+                                                  allocation.width,
+                                                  allocation.height);
+    cr = cairo_create(graph);
 
-            cairo_line_to (cr, x, y + 0.5);
+    draw_width = allocation.width - 2 * FRAME_WIDTH;
+    draw_height = allocation.height - 2 * FRAME_WIDTH;
 
-            if(tmp_net_max < speed_value->speed)
-                tmp_net_max = ceil(speed_value->speed);
-        }
+    cairo_translate (cr, FRAME_WIDTH, FRAME_WIDTH);
 
-        list = list->next;
-    }
-    // download line color
-    gdk_cairo_set_source_rgba(cr, &urc_receiving_color);
-    cairo_stroke(cr);
+    graph_stroke_series (cr, GRAPH_POINTS, draw_width, draw_height, rmargin, indent);
 
     cairo_destroy (cr);
 
-    graph_set_fullscale(tmp_net_max);
+    graph_scroll_count = 0;
 }
 
-void
-update_download_graph_data(SpeedValue *speed)
+/* Scroll the data surface by "ticks" samples and draw only the new
+ * segments. The step is not a whole number of pixels, the integer
+ * shifts add up to the exact width every GRAPH_POINTS samples. */
+static void
+graph_scroll_data (GtkWidget *widget,
+                   guint      ticks)
 {
-    GList *tmp_elem;
+    cairo_t *cr;
+    cairo_surface_t *tmp;
+    GtkAllocation allocation;
+    double draw_width, draw_height, step;
+    const double fontsize = 6.4;
+    const double rmargin = 8 * fontsize;
+    const guint indent = 22;
+    gint shift = 0;
+    guint i;
 
-    downspeed_values = g_list_prepend(downspeed_values, speed);
+    gtk_widget_get_allocation (widget, &allocation);
 
-    tmp_elem = g_list_nth(downspeed_values, GRAPH_POINTS+1);
-    if(tmp_elem) {
-        g_free(tmp_elem->data);
-        downspeed_values = g_list_delete_link(downspeed_values, tmp_elem);
+    draw_width = allocation.width - 2 * FRAME_WIDTH;
+    draw_height = allocation.height - 2 * FRAME_WIDTH;
+    step = (draw_width - rmargin - indent) / GRAPH_POINTS;
+
+    for(i = 0; i < ticks; i++) {
+        graph_scroll_count = graph_scroll_count % GRAPH_POINTS + 1;
+        shift += (gint) (round(graph_scroll_count * step) - round((graph_scroll_count - 1) * step));
     }
 
-    if(speed->speed > net_max)
-        graph_set_fullscale(speed->speed);
+    if(graph_back == NULL)
+        graph_back = cairo_surface_create_similar (graph,
+                                                   CAIRO_CONTENT_COLOR_ALPHA,
+                                                   allocation.width,
+                                                   allocation.height);
 
-    clear_graph_data();
-}
+    cr = cairo_create(graph_back);
 
-void
-update_upload_graph_data(SpeedValue *speed)
-{
-    GList *tmp_elem;
+    cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint (cr);
+    cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+
+    cairo_translate (cr, FRAME_WIDTH, FRAME_WIDTH);
+
+    // keep the lines inside the plot area, leave room for the line width
+    cairo_rectangle (cr, indent, -FRAME_WIDTH, draw_width - rmargin - indent + 2, allocation.height);
+    cairo_clip (cr);
+
+    cairo_set_source_surface (cr, graph, -FRAME_WIDTH - shift, -FRAME_WIDTH);
+    cairo_paint (cr);
+
+    graph_stroke_series (cr, ticks, draw_width, draw_height, rmargin, indent);
+
+    cairo_destroy (cr);
 
-    upspeed_values = g_list_prepend(upspeed_values, speed);
+    tmp = graph;
+    graph = graph_back;
+    graph_back = tmp;
+}
 
-    tmp_elem = g_list_nth(upspeed_values, GRAPH_POINTS+1);
-    if(tmp_elem) {
-        g_free(tmp_elem->data);
-        upspeed_values = g_list_delete_link(upspeed_values, tmp_elem);
+/* Bring the data surface up to date with the samples, with the worker
+ * lock held: the histories move on the UPnP thread */
+static void
+graph_render_data (GtkWidget *widget)
+{
+    guint64 down_seq = urc_history_get_seq (downspeed_values);
+    guint64 up_seq = urc_history_get_seq (upspeed_values);
+    guint64 ticks = up_seq - upspeed_drawn;
+
+    // only the raw tier moves by one point per sample
+    if(graph != NULL && graph_window == URC_HISTORY_SECONDS &&
+       ticks == down_seq - downspeed_drawn && ticks <= GRAPH_POINTS / 2) {
+        if(ticks > 0)
+            graph_scroll_data (widget, (guint) ticks);
     }
+    else if(graph == NULL || ticks > 0 || down_seq != downspeed_drawn)
+        graph_draw_data (widget);
 
-    if(speed->speed > net_max)
-        graph_set_fullscale(speed->speed);
+    upspeed_drawn = up_seq;
+    downspeed_drawn = down_seq;
 
-    clear_graph_data();
+    // the full scale follows the visible samples, a change redraws all
+    graph_set_fullscale (ceil (MAX (graph_series_max (upspeed_values),
+                                    graph_series_max (downspeed_values))));
+
+    if(graph == NULL)
+        graph_draw_data (widget);
 }
 
+/* A sample was added to the download history */
 void
-urc_disable_graph()
+update_download_graph_data(gdouble speed)
 {
-    GList *elem;
-
-    if(upspeed_values == NULL || downspeed_values == NULL)
-        return;
+    if(speed > net_max)
+        graph_set_fullscale(speed);
+}
 
-    elem = upspeed_values;
-    do {
-        ((SpeedValue *)elem->data)->valid = FALSE;
-        ((SpeedValue *)elem->data)->speed = 0.0;
-        elem = elem->next;
-    } while(elem);
+/* A sample was added to the upload history */
+void
+update_upload_graph_data(gdouble speed)
+{
+    if(speed > net_max)
+        graph_set_fullscale(speed);
+}
 
-    elem = downspeed_values;
-    do {
-        ((SpeedValue *)elem->data)->valid = FALSE;
-        ((SpeedValue *)elem->data)->speed = 0.0;
-        elem = elem->next;
-    } while(elem);
+void
+urc_disable_graph()
+{
+    downspeed_values = NULL;
+    upspeed_values = NULL;
 
     graph_enabled = FALSE;
     clear_graph_data ();
 }
 
+/* Show the series of a router */
 void
-urc_enable_graph()
+urc_enable_graph(UrcHistory *down_history,
+                 UrcHistory *up_history)
 {
+    downspeed_values = down_history;
+    upspeed_values = up_history;
+
     graph_enabled = TRUE;
     clear_graph_data ();
 }
 
+/* Select the history tier shown */
+void
+urc_graph_set_window(UrcHistoryTier window)
+{
+    if(window == graph_window)
+        return;
+
+    graph_window = window;
+
+    clear_graph_background();
+    clear_graph_data();
+}
+
 gboolean
 on_drawing_area_configure_event (GtkWidget         *widget,
                                  GdkEventConfigure *event,
@@ -473,8 +640,10 @@ on_drawing_area_draw (GtkWidget      *widget,
                               gpointer        user_data)
 {
 
-    if(graph == NULL)
-        graph_draw_data (widget);
+    // the histories are filled on the UPnP thread
+    urc_worker_lock ();
+    graph_render_data (widget);
+    urc_worker_unlock ();
 
     if(background == NULL)
         graph_draw_background (widget);
@@ -493,24 +662,6 @@ on_drawing_area_draw (GtkWidget      *widget,
 void
 urc_init_network_graph(GtkWidget *drawing_area)
 {
-    SpeedValue *speed;
-    gint i;
-
-    // fill speed graph lists
-    for(i = 0; i <= GRAPH_POINTS; i++) {
-        speed = g_malloc(sizeof(SpeedValue));
-        speed->speed = 0;
-        speed->valid = FALSE;
-        upspeed_values = g_list_prepend(upspeed_values, speed);
-    }
-
-    for(i = 0; i <= GRAPH_POINTS; i++) {
-        speed = g_malloc(sizeof(SpeedValue));
-        speed->speed = 0;
-        speed->valid = FALSE;
-        downspeed_values = g_list_prepend(downspeed_values, speed);
-    }
-
     // Connect signals.
     g_signal_connect(G_OBJECT(drawing_area), "draw",
                         G_CALLBACK(on_drawing_area_draw), NULL);
@@ -23,26 +23,25 @@
 
 #include <gtk/gtk.h>
 
-typedef struct
-{
-    gdouble  speed;
-    gboolean valid;
-} SpeedValue;
+#include "urc-history.h"
 
 void
 urc_init_network_graph(GtkWidget *drawing_area);
 
 void
-update_download_graph_data(SpeedValue *speed);
+update_download_graph_data(gdouble speed);
 
 void
-update_upload_graph_data(SpeedValue *speed);
+update_upload_graph_data(gdouble speed);
 
 void
 urc_disable_graph();
 
 void
-urc_enable_graph();
+urc_enable_graph(UrcHistory *down_history, UrcHistory *up_history);
+
+void
+urc_graph_set_window(UrcHistoryTier window);
 
 void
 urc_graph_set_receiving_color(GdkRGBA color);
@@ -27,6 +27,9 @@
 
 #include "urc-graph.h"
 #include "urc-upnp.h"
+#include "urc-mapping.h"
+#include "urc-mapping-store.h"
+#include "urc-worker.h"
 #include "urc-gui.h"
 
 #define URC_RESOURCE_BASE "/org/upnp-router-control/"
@@ -76,6 +79,7 @@ typedef struct
               *button_remove,
               *button_add,
               *headerbar,
+              *router_combo,
               *refresh_button,
               *network_drawing_area,
               *receiving_color,
@@ -89,25 +93,105 @@ typedef struct
 
     GActionGroup *actions;
 
+    /* router shown, NULL if none */
     RouterInfo *router;
 
+    /* treeview rows, mapping key -> GtkTreeRowReference */
+    GHashTable *port_rows;
+
 } GuiContext;
 
 static GuiContext* gui;
 
+/* A request of the window to a router. It is sent from the UPnP thread,
+ * where the router is looked up again, the reply comes back here. */
+typedef struct
+{
+    gchar *root_udn;
+
+    PortForwardInfo *port_info;
+    GPtrArray *entries;
+    gpointer user_data;
+
+    /* the reply */
+    GError *error;
+    UrcMappingResult *results;
+    guint n_results;
+
+} GuiRequest;
+
+static GuiRequest*
+gui_request_new (RouterInfo *router, gpointer user_data)
+{
+    GuiRequest *request;
+
+    request = g_new0 (GuiRequest, 1);
+    request->root_udn = g_strdup (router->root_udn);
+    request->user_data = user_data;
+
+    return request;
+}
+
+static void
+gui_request_free (GuiRequest *request)
+{
+    guint i;
+
+    g_free (request->root_udn);
+
+    if (request->port_info != NULL)
+        port_forward_info_free (request->port_info);
+
+    if (request->entries != NULL)
+        g_ptr_array_unref (request->entries);
+
+    g_clear_error (&request->error);
+
+    for (i = 0; i < request->n_results; i++) {
+        port_forward_info_free (request->results[i].port_info);
+        g_clear_error (&request->results[i].error);
+    }
+    g_free (request->results);
+
+    g_free (request);
+}
+
 void
 gui_reset_add_port_window ()
 {
 
     gtk_entry_set_text (GTK_ENTRY(gui->add_port_window->add_desc), "");
     gtk_spin_button_set_value (GTK_SPIN_BUTTON(gui->add_port_window->add_ext_port), 0);
+    urc_worker_lock ();
     gtk_entry_set_text (GTK_ENTRY(gui->add_port_window->add_local_ip), get_client_ip());
+    urc_worker_unlock ();
     gtk_spin_button_set_value (GTK_SPIN_BUTTON(gui->add_port_window->add_local_port), 0);
 
     gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (gui->add_port_window->add_proto_udp), FALSE);
     gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (gui->add_port_window->add_proto_tcp), TRUE);
 }
 
+/* Put back the label of the apply button, if a request left the
+ * spinner on it */
+static void
+gui_add_port_window_reset_apply ()
+{
+    GtkWidget *image;
+    const gchar *btn_label;
+
+    image = gtk_button_get_image (GTK_BUTTON(gui->add_port_window->button_apply));
+
+    if (image != NULL) {
+        /* the reply still takes it when it comes */
+        btn_label = g_object_get_data (G_OBJECT (image), "button-label");
+
+        gtk_button_set_label (GTK_BUTTON(gui->add_port_window->button_apply), btn_label);
+        gtk_button_set_image (GTK_BUTTON(gui->add_port_window->button_apply), NULL);
+    }
+
+    gtk_widget_set_sensitive(gui->add_port_window->button_apply, TRUE);
+}
+
 static void
 gui_add_port_window_close (GtkWidget *button,
                            gpointer   user_data)
@@ -117,14 +201,101 @@ gui_add_port_window_close (GtkWidget *button,
     gui_reset_add_port_window();
 }
 
+/* Restore the apply button once the router replied */
+static void
+gui_add_port_window_apply_done (PortForwardInfo *port_info,
+                                const GError    *error,
+                                gpointer         user_data)
+{
+    GtkWidget* spinner = GTK_WIDGET (user_data);
+    gchar *btn_label;
+
+    // Stop the spinner and restore the button label
+    btn_label = g_object_steal_data (G_OBJECT (spinner), "button-label");
+
+    gtk_spinner_stop(GTK_SPINNER(spinner));
+    gtk_button_set_label(GTK_BUTTON(gui->add_port_window->button_apply), btn_label);
+    gtk_button_set_image (GTK_BUTTON(gui->add_port_window->button_apply), NULL);
+    gtk_widget_set_sensitive(gui->add_port_window->button_apply, TRUE);
+
+    g_free(btn_label);
+
+    if (error == NULL) {
+        // No errors, close the dialog.
+        gtk_widget_hide (gui->add_port_window->window);
+        gui_reset_add_port_window();
+    }
+    else {
+        // We have errors.
+        GtkWidget* dialog;
+        dialog = gtk_message_dialog_new(GTK_WINDOW(gui->add_port_window->window),
+                                        GTK_DIALOG_MODAL,
+                                        GTK_MESSAGE_ERROR,
+                                        GTK_BUTTONS_OK,
+                                        _("Unable to set this port forward"));
+
+        gtk_message_dialog_format_secondary_text (GTK_MESSAGE_DIALOG(dialog),
+                                                "%d: %s", error->code, error->message);
+        gtk_dialog_run(GTK_DIALOG(dialog));
+        gtk_widget_destroy(dialog);
+    }
+}
+
+static gboolean
+gui_add_port_window_reply_cb (gpointer data)
+{
+    GuiRequest *request = (GuiRequest *) data;
+
+    gui_add_port_window_apply_done (request->port_info, request->error, request->user_data);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* UPnP thread */
+static void
+gui_add_port_window_request_done (PortForwardInfo *port_info,
+                                  const GError    *error,
+                                  gpointer         user_data)
+{
+    GuiRequest *request = (GuiRequest *) user_data;
+
+    if (error != NULL)
+        request->error = g_error_copy (error);
+
+    urc_worker_invoke_ui (gui_add_port_window_reply_cb, request, (GDestroyNotify) gui_request_free);
+}
+
+/* UPnP thread */
+static gboolean
+gui_add_port_window_request_cb (gpointer data)
+{
+    GuiRequest *request = (GuiRequest *) data;
+    RouterInfo *router;
+
+    router = urc_upnp_lookup_router (request->root_udn);
+
+    if (router != NULL) {
+        add_port_mapping(router, request->port_info, gui_add_port_window_request_done, request);
+    }
+    else {
+        request->error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_NOT_FOUND, _("The router is no longer available"));
+        urc_worker_invoke_ui (gui_add_port_window_reply_cb, request, (GDestroyNotify) gui_request_free);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
 static void
 gui_add_port_window_apply (GtkWidget *button,
                            gpointer   user_data)
 {
     PortForwardInfo* port_info;
-    GError* error = NULL;
     GtkWidget* spinner;
-    gchar const *btn_label;
+    GuiRequest *request;
+
+    /* the router went away with the dialog open */
+    if (gui->router == NULL)
+        return;
 
     // Creating the PortForwardInfo structure
     port_info = g_malloc( sizeof(PortForwardInfo) );
@@ -134,53 +305,25 @@ gui_add_port_window_apply (GtkWidget *button,
     port_info->internal_port = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON (gui->add_port_window->add_local_port) );
     port_info->external_port = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON (gui->add_port_window->add_ext_port) );
     port_info->internal_host = g_strdup( gtk_entry_get_text(GTK_ENTRY(gui->add_port_window->add_local_ip)) );
-    port_info->remote_host = "";
+    port_info->remote_host = g_strdup("");
     port_info->lease_time = 0;
     port_info->enabled = TRUE;
 
     // Set spinner on on the apply button and remove temporarily the label
     spinner = gtk_spinner_new();
-    btn_label = g_strdup(gtk_button_get_label (GTK_BUTTON(gui->add_port_window->button_apply)));
+    g_object_set_data (G_OBJECT (spinner), "button-label",
+                       g_strdup(gtk_button_get_label (GTK_BUTTON(gui->add_port_window->button_apply))));
     gtk_button_set_label (GTK_BUTTON(gui->add_port_window->button_apply), NULL);
     gtk_button_set_image (GTK_BUTTON(gui->add_port_window->button_apply), spinner);
     gtk_button_set_always_show_image (GTK_BUTTON(gui->add_port_window->button_apply), TRUE);
+    gtk_widget_set_sensitive(gui->add_port_window->button_apply, FALSE);
     gtk_spinner_start (GTK_SPINNER(spinner));
 
-    // Try to add the new port mapping.
-    if(add_port_mapping(user_data, port_info, &error) != TRUE)
-    {
-        // We have errors.
-        GtkWidget* dialog;
-        dialog = gtk_message_dialog_new(GTK_WINDOW(gui->add_port_window->window),
-                                        GTK_DIALOG_MODAL,
-                                        GTK_MESSAGE_ERROR,
-                                        GTK_BUTTONS_OK,
-                                        _("Unable to set this port forward"));
+    // Try to add the new port mapping, the reply restores the button.
+    request = gui_request_new (gui->router, spinner);
+    request->port_info = port_info;
 
-        gtk_message_dialog_format_secondary_text (GTK_MESSAGE_DIALOG(dialog),
-                                                "%d: %s", error->code, error->message);
-        gtk_dialog_run(GTK_DIALOG(dialog));
-        gtk_widget_destroy(dialog);
-    }
-
-    // Stop the spinner and restore the button label
-    gtk_spinner_stop(GTK_SPINNER(spinner));
-    gtk_button_set_label(GTK_BUTTON(gui->add_port_window->button_apply), btn_label);
-    gtk_button_set_image (GTK_BUTTON(gui->add_port_window->button_apply), NULL);
-
-    g_free(port_info->description);
-    g_free(port_info->protocol);
-    g_free(port_info->internal_host);
-    g_free(port_info);
-
-    if (error == NULL) {
-        // No errors, close the dialog.
-        gtk_widget_hide (gui->add_port_window->window);
-        gui_reset_add_port_window();
-    }
-    else {
-        g_error_free (error);
-    }
+    urc_worker_invoke (gui_add_port_window_request_cb, request, NULL);
 }
 
 static void
@@ -201,19 +344,6 @@ static void
 gui_run_add_port_window (GtkWidget *button,
                          gpointer   user_data)
 {
-    /* Disconnect previous signals */
-    g_signal_handlers_disconnect_matched(gui->add_port_window->button_apply,
-                                         G_SIGNAL_MATCH_FUNC,
-                                         0,
-                                         0,
-                                         NULL,
-                                         G_CALLBACK(gui_add_port_window_apply),
-                                         NULL);
-
-    /* Connect new signal with new data */
-    g_signal_connect(gui->add_port_window->button_apply, "clicked",
-                         G_CALLBACK(gui_add_port_window_apply), user_data);
-
     gtk_widget_show_all (gui->add_port_window->window);
 }
 
@@ -242,6 +372,9 @@ gui_create_add_port_window (GtkBuilder* builder)
     g_signal_connect(add_port_window->add_ext_port, "value-changed",
                          G_CALLBACK(gui_add_port_window_on_port_change), NULL);
 
+    g_signal_connect(add_port_window->button_apply, "clicked",
+                         G_CALLBACK(gui_add_port_window_apply), NULL);
+
     g_signal_connect(add_port_window->button_cancel, "clicked",
                          G_CALLBACK(gui_add_port_window_close), NULL);
 
@@ -262,6 +395,8 @@ gui_clear_ports_list_treeview (void)
     if(gui->treeview == NULL)
         return;
 
+    g_hash_table_remove_all (gui->port_rows);
+
     model = gtk_tree_view_get_model (GTK_TREE_VIEW (gui->treeview));
     more = gtk_tree_model_get_iter_first (model, &iter);
 
@@ -269,38 +404,210 @@ gui_clear_ports_list_treeview (void)
         more = gtk_list_store_remove (GTK_LIST_STORE (model), &iter);
 }
 
+static void
+gui_set_mapped_port_row (GtkTreeModel          *model,
+                         GtkTreeIter           *iter,
+                         const PortForwardInfo *port_info)
+{
+    gtk_list_store_set (GTK_LIST_STORE (model),
+                        iter,
+                        UPNP_COLUMN_DESC, port_info->description,
+                        UPNP_COLUMN_PROTOCOL, port_info->protocol,
+                        UPNP_COLUMN_INT_PORT, port_info->internal_port,
+                        UPNP_COLUMN_EXT_PORT, port_info->external_port,
+                        UPNP_COLUMN_LOCAL_IP, port_info->internal_host,
+                        UPNP_COLUMN_REM_IP, port_info->remote_host,
+                        -1);
+}
+
+/* Find the treeview row of a mapping */
+static gboolean
+gui_get_mapped_port_iter (const PortForwardInfo *port_info,
+                          GtkTreeIter           *iter)
+{
+    GtkTreeRowReference *row;
+    GtkTreePath *path;
+    gchar *key;
+    gboolean found = FALSE;
+
+    key = urc_mapping_key (port_info->remote_host, port_info->external_port, port_info->protocol);
+    row = g_hash_table_lookup (gui->port_rows, key);
+    g_free (key);
+
+    if(row == NULL || !gtk_tree_row_reference_valid (row))
+        return FALSE;
+
+    path = gtk_tree_row_reference_get_path (row);
+    found = gtk_tree_model_get_iter (gtk_tree_row_reference_get_model (row), iter, path);
+    gtk_tree_path_free (path);
+
+    return found;
+}
+
 /* Add a port mapped in the treeview list */
 void
-gui_add_mapped_ports (const GSList *port_list)
+gui_add_mapped_port (const PortForwardInfo *port_info)
 {
     GtkTreeModel *model;
     GtkTreeIter   iter;
-    const GSList *port_iter = port_list;
-    PortForwardInfo *port_info;
+    GtkTreePath  *path;
 
     if(gui->treeview == NULL)
         return;
 
     model = gtk_tree_view_get_model (GTK_TREE_VIEW (gui->treeview));
 
-    while(port_iter)
+    if(gui_get_mapped_port_iter (port_info, &iter)) {
+        gui_set_mapped_port_row (model, &iter, port_info);
+        return;
+    }
+
+    gtk_list_store_append (GTK_LIST_STORE (model), &iter);
+    gui_set_mapped_port_row (model, &iter, port_info);
+
+    path = gtk_tree_model_get_path (model, &iter);
+    g_hash_table_replace (gui->port_rows,
+                          urc_mapping_key (port_info->remote_host, port_info->external_port, port_info->protocol),
+                          gtk_tree_row_reference_new (model, path));
+    gtk_tree_path_free (path);
+}
+
+/* Refresh the columns of a mapping already listed */
+void
+gui_update_mapped_port (const PortForwardInfo *port_info)
+{
+    GtkTreeIter iter;
+
+    if(gui->treeview == NULL)
+        return;
+
+    if(gui_get_mapped_port_iter (port_info, &iter))
+        gui_set_mapped_port_row (gtk_tree_view_get_model (GTK_TREE_VIEW (gui->treeview)), &iter, port_info);
+    else
+        gui_add_mapped_port (port_info);
+}
+
+/* Remove a mapping from the treeview list */
+void
+gui_remove_mapped_port (const PortForwardInfo *port_info)
+{
+    GtkTreeIter iter;
+    gchar *key;
+
+    if(gui->treeview == NULL)
+        return;
+
+    if(gui_get_mapped_port_iter (port_info, &iter))
+        gtk_list_store_remove (GTK_LIST_STORE (gtk_tree_view_get_model (GTK_TREE_VIEW (gui->treeview))), &iter);
+
+    key = urc_mapping_key (port_info->remote_host, port_info->external_port, port_info->protocol);
+    g_hash_table_remove (gui->port_rows, key);
+    g_free (key);
+}
+
+/* Reply of the remove requests */
+static void
+on_button_remove_done (const UrcMappingResult *results,
+                       guint                   n_results,
+                       gpointer                user_data)
+{
+    GString *details;
+    guint i, failed = 0;
+
+    details = g_string_new (NULL);
+
+    for (i = 0; i < n_results; i++)
     {
-        port_info = (PortForwardInfo*) port_iter->data;
-
-        gtk_list_store_prepend (GTK_LIST_STORE (model), &iter);
-        gtk_list_store_set (GTK_LIST_STORE (model),
-                            &iter,
-                            UPNP_COLUMN_DESC, port_info->description,
-                            UPNP_COLUMN_PROTOCOL, port_info->protocol,
-                            UPNP_COLUMN_INT_PORT, port_info->internal_port,
-                            UPNP_COLUMN_EXT_PORT, port_info->external_port,
-                            UPNP_COLUMN_LOCAL_IP, port_info->internal_host,
-                            UPNP_COLUMN_REM_IP, port_info->remote_host,
-                            -1);
+        if(results[i].error == NULL)
+            continue;
+
+        failed++;
+        g_string_append_printf (details, "%s%u/%s: %d: %s",
+                                details->len > 0 ? "\n" : "",
+                                results[i].port_info->external_port,
+                                results[i].port_info->protocol,
+                                results[i].error->code,
+                                results[i].error->message);
+    }
+
+    if(failed > 0)
+    {
+        // We have errors.
+        GtkWidget* dialog;
+
+        if(n_results == 1)
+            dialog = gtk_message_dialog_new(GTK_WINDOW(gui->main_window),
+                                            GTK_DIALOG_MODAL,
+                                            GTK_MESSAGE_ERROR,
+                                            GTK_BUTTONS_OK,
+                                            _("Unable to remove this port forward"));
+        else
+            dialog = gtk_message_dialog_new(GTK_WINDOW(gui->main_window),
+                                            GTK_DIALOG_MODAL,
+                                            GTK_MESSAGE_ERROR,
+                                            GTK_BUTTONS_OK,
+                                            _("Unable to remove %u of %u port forwards"),
+                                            failed, n_results);
+
+        gtk_message_dialog_format_secondary_text (GTK_MESSAGE_DIALOG(dialog),
+                                                  "%s", details->str);
+        gtk_dialog_run(GTK_DIALOG(dialog));
+        gtk_widget_destroy(dialog);
+    }
+
+    g_string_free (details, TRUE);
+}
+
+static gboolean
+on_button_remove_reply_cb (gpointer data)
+{
+    GuiRequest *request = (GuiRequest *) data;
+
+    on_button_remove_done (request->results, request->n_results, NULL);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* UPnP thread, the results are freed on return */
+static void
+on_button_remove_request_done (const UrcMappingResult *results,
+                               guint                   n_results,
+                               gpointer                user_data)
+{
+    GuiRequest *request = (GuiRequest *) user_data;
+    guint i;
+
+    request->results = g_new0 (UrcMappingResult, n_results);
+    request->n_results = n_results;
+
+    for (i = 0; i < n_results; i++) {
+        request->results[i].port_info = port_forward_info_copy (results[i].port_info);
 
-        port_iter = g_slist_next (port_iter);
+        if (results[i].error != NULL)
+            request->results[i].error = g_error_copy (results[i].error);
     }
 
+    urc_worker_invoke_ui (on_button_remove_reply_cb, request, (GDestroyNotify) gui_request_free);
+}
+
+/* UPnP thread */
+static gboolean
+on_button_remove_request_cb (gpointer data)
+{
+    GuiRequest *request = (GuiRequest *) data;
+    RouterInfo *router;
+
+    router = urc_upnp_lookup_router (request->root_udn);
+
+    /* gone, and its mappings with it */
+    if (router == NULL) {
+        gui_request_free (request);
+        return G_SOURCE_REMOVE;
+    }
+
+    urc_mapping_delete_batch (router, request->entries, URC_MAPPING_BATCH_CONCURRENCY, on_button_remove_request_done, request);
+
+    return G_SOURCE_REMOVE;
 }
 
 /* Button remove callback */
@@ -311,67 +618,54 @@ on_button_remove_clicked (GtkWidget *button,
     GtkTreeModel *model;
     GtkTreeIter   iter;
     GtkTreeSelection *selection;
-    GError *error;
-
-    gchar* remote_host;
-    guint external_port;
-    gchar* protocol;
+    GList *rows, *row_iter;
+    GPtrArray *entries;
+    PortForwardInfo *port_info;
+    GuiRequest *request;
 
-    model = gtk_tree_view_get_model (GTK_TREE_VIEW (gui->treeview));
     selection = gtk_tree_view_get_selection (GTK_TREE_VIEW (gui->treeview));
+    rows = gtk_tree_selection_get_selected_rows (selection, &model);
 
-    if(!gtk_tree_selection_get_selected(selection, NULL, &iter))
+    if(rows == NULL)
     {
         /* no selection */
         gtk_widget_set_sensitive(button, FALSE);
         return;
     }
 
-    gtk_tree_model_get(model, &iter,
-                       UPNP_COLUMN_PROTOCOL, &protocol,
-                       UPNP_COLUMN_EXT_PORT, &external_port,
-                       UPNP_COLUMN_REM_IP, &remote_host,
-                       -1);
+    entries = g_ptr_array_new_with_free_func ((GDestroyNotify) port_forward_info_free);
 
-    if(delete_port_mapped (user_data, protocol, external_port, remote_host, &error) != TRUE)
+    for (row_iter = rows; row_iter != NULL; row_iter = row_iter->next)
     {
-        // We have errors.
-        GtkWidget* dialog;
+        if(!gtk_tree_model_get_iter (model, &iter, row_iter->data))
+            continue;
 
-        dialog = gtk_message_dialog_new(GTK_WINDOW(gui->main_window),
-                                        GTK_DIALOG_MODAL,
-                                        GTK_MESSAGE_ERROR,
-                                        GTK_BUTTONS_OK,
-                                        _("Unable to remove this port forward"));
+        // only the mapping key is needed
+        port_info = g_malloc0 (sizeof (PortForwardInfo));
 
-        gtk_message_dialog_format_secondary_text (GTK_MESSAGE_DIALOG(dialog),
-                                                "%d: %s", error->code, error->message);
-        gtk_dialog_run(GTK_DIALOG(dialog));
-        gtk_widget_destroy(dialog);
-        g_error_free (error);
-    }
-    else {
-        // delete row from the local list
-        gtk_list_store_remove(GTK_LIST_STORE(model), &iter);
-    }
-}
+        gtk_tree_model_get(model, &iter,
+                           UPNP_COLUMN_PROTOCOL, &port_info->protocol,
+                           UPNP_COLUMN_EXT_PORT, &port_info->external_port,
+                           UPNP_COLUMN_REM_IP, &port_info->remote_host,
+                           -1);
 
-static gboolean
-gui_on_treeview_selection (GtkTreeSelection *selection,
-                           GtkTreeModel     *model,
-                           GtkTreePath      *path,
-                           gboolean          path_currently_selected,
-                           gpointer          userdata)
-{
+        g_ptr_array_add (entries, port_info);
+    }
 
-    if (!path_currently_selected)
-        gtk_widget_set_sensitive(gui->button_remove, TRUE);
+    g_list_free_full (rows, (GDestroyNotify) gtk_tree_path_free);
 
-    else
-        gtk_widget_set_sensitive(gui->button_remove, FALSE);
+    request = gui_request_new (gui->router, NULL);
+    request->entries = entries;
 
+    urc_worker_invoke (on_button_remove_request_cb, request, NULL);
+}
 
-    return TRUE; /* allow selection state to change */
+static void
+gui_on_treeview_selection_changed (GtkTreeSelection *selection,
+                                   gpointer          userdata)
+{
+    gtk_widget_set_sensitive(gui->button_remove,
+                             gtk_tree_selection_count_selected_rows (selection) > 0);
 }
 
 
@@ -436,9 +730,10 @@ gui_init_treeview()
 
     gtk_tree_view_set_model (GTK_TREE_VIEW (gui->treeview),
                              model);
-    gtk_tree_selection_set_mode (selection, GTK_SELECTION_SINGLE);
+    gtk_tree_selection_set_mode (selection, GTK_SELECTION_MULTIPLE);
 
-    gtk_tree_selection_set_select_function(selection, gui_on_treeview_selection, NULL, NULL);
+    g_signal_connect (selection, "changed",
+                      G_CALLBACK (gui_on_treeview_selection_changed), NULL);
 
 }
 
@@ -452,7 +747,7 @@ gui_disable_total_received()
 }
 
 void
-gui_set_total_received (const unsigned int total_received)
+gui_set_total_received (const guint64 total_received)
 {
     gchar *str;
     str = g_format_size_full(total_received, G_FORMAT_SIZE_IEC_UNITS);
@@ -476,7 +771,7 @@ gui_disable_total_sent()
 }
 
 void
-gui_set_total_sent (const unsigned int total_sent)
+gui_set_total_sent (const guint64 total_sent)
 {
     gchar *str;
     str = g_format_size_full(total_sent, G_FORMAT_SIZE_IEC_UNITS);
@@ -505,13 +800,8 @@ void
 gui_set_download_speed(const gdouble down_speed)
 {
     gchar *bytes, *str;
-    SpeedValue *speed;
-
-    speed = g_malloc (sizeof(SpeedValue));
-    speed->speed = down_speed;
-    speed->valid = TRUE;
 
-    update_download_graph_data(speed);
+    update_download_graph_data(down_speed);
 
     bytes = g_format_size_full(down_speed * 1024, G_FORMAT_SIZE_IEC_UNITS);
     str = g_strdup_printf("%s/s", bytes);
@@ -537,19 +827,48 @@ gui_disable_upload_speed()
     gtk_label_set_text (GTK_LABEL(gui->up_rate_label), "—" );
 }
 
+/* Packet rate and average packet size, in the rate label tooltip.
+ * A negative rate removes it. */
+static void
+gui_set_packets_tooltip (GtkWidget *label, const gdouble packet_rate, const gdouble avg_packet_size)
+{
+    gchar *bytes, *str;
+
+    if(label == NULL)
+        return;
+
+    if(packet_rate < 0) {
+        gtk_widget_set_tooltip_text (label, NULL);
+        return;
+    }
+
+    bytes = g_format_size_full(avg_packet_size, G_FORMAT_SIZE_IEC_UNITS);
+    str = g_strdup_printf(_("%.0f packets/s, %s per packet"), packet_rate, bytes);
+    g_free(bytes);
+
+    gtk_widget_set_tooltip_text (label, str);
+    g_free(str);
+}
+
+void
+gui_set_download_packets(const gdouble packet_rate, const gdouble avg_packet_size)
+{
+    gui_set_packets_tooltip (gui->down_rate_label, packet_rate, avg_packet_size);
+}
+
+void
+gui_set_upload_packets(const gdouble packet_rate, const gdouble avg_packet_size)
+{
+    gui_set_packets_tooltip (gui->up_rate_label, packet_rate, avg_packet_size);
+}
+
 /* Update router speeds, values in KiB/sec */
 void
 gui_set_upload_speed(const gdouble up_speed)
 {
     gchar *bytes, *str;
-    SpeedValue *speed;
 
-    speed = g_malloc (sizeof(SpeedValue));
-
-    speed->speed = up_speed;
-    speed->valid = TRUE;
-
-    update_upload_graph_data(speed);
+    update_upload_graph_data(up_speed);
 
     bytes = g_format_size_full(up_speed * 1024, G_FORMAT_SIZE_IEC_UNITS);
     str = g_strdup_printf("%s/s", bytes);
@@ -654,6 +973,28 @@ gui_disable_ext_ip()
     g_free(str);
 }
 
+/* Whether the router answers, in the header bar subtitle */
+static void
+gui_set_health (RouterInfo *router)
+{
+    gchar* str;
+
+    switch (urc_health_get_state (router->health)) {
+        case URC_HEALTH_BACKOFF:
+            str = g_strdup_printf (_("%s not answering, retrying in %u s"), router->device_ip,
+                                   urc_health_get_backoff (router->health));
+            break;
+        case URC_HEALTH_PROBING:
+            str = g_strdup_printf (_("Checking %s…"), router->device_ip);
+            break;
+        default:
+            str = g_strdup_printf (_("Connected to %s"), router->device_ip);
+    }
+
+    gtk_header_bar_set_subtitle(GTK_HEADER_BAR(gui->headerbar), str);
+    g_free(str);
+}
+
 /* Set router informations */
 void
 gui_set_router_info (RouterInfo *router)
@@ -666,9 +1007,7 @@ gui_set_router_info (RouterInfo *router)
 
     gui->router = router;
 
-    str = g_strdup_printf (_("Connected to %s"), router->device_ip);
-    gtk_header_bar_set_subtitle(GTK_HEADER_BAR(gui->headerbar), str);
-    g_free(str);
+    gui_set_health (router);
 
     gtk_label_set_text (GTK_LABEL(gui->router_name_label), router->friendly_name);
 
@@ -713,26 +1052,32 @@ gui_set_router_info (RouterInfo *router)
 
 }
 
+/* UPnP thread */
+static gboolean
+gui_request_refresh_cb (gpointer data)
+{
+    GuiRequest *request = (GuiRequest *) data;
+    RouterInfo *router;
+
+    router = urc_upnp_lookup_router (request->root_udn);
+
+    if (router != NULL)
+        urc_upnp_refresh_data (router);
+
+    return G_SOURCE_REMOVE;
+}
+
 /* updates all values */
 static void
 on_refresh_activate_cb (GtkMenuItem *menuitem,
                         gpointer     user_data)
 {
-    urc_upnp_refresh_data ((RouterInfo *) user_data);
+    if (gui->router != NULL)
+        urc_worker_invoke (gui_request_refresh_cb, gui_request_new (gui->router, NULL), (GDestroyNotify) gui_request_free);
 }
 
 void
 gui_activate_buttons() {
-    // Refresh button
-    g_signal_connect(gui->refresh_button, "clicked",
-                     G_CALLBACK(on_refresh_activate_cb), gui->router);
-
-    // Add/remove buttons
-    g_signal_connect(gui->button_add, "clicked",
-                     G_CALLBACK(gui_run_add_port_window), gui->router->wan_conn_service);
-    g_signal_connect(gui->button_remove, "clicked",
-                     G_CALLBACK(on_button_remove_clicked), gui->router->wan_conn_service);
-
     gtk_widget_set_sensitive(gui->refresh_button, TRUE);
     gtk_widget_set_sensitive(gui->button_add, TRUE);
 }
@@ -748,6 +1093,14 @@ gui_disable()
 
     gui_clear_ports_list_treeview();
 
+    gui->router = NULL;
+
+    /* nothing to add a port to anymore */
+    if (gui->add_port_window != NULL) {
+        gtk_widget_hide (gui->add_port_window->window);
+        gui_add_port_window_reset_apply ();
+    }
+
     gtk_label_set_text (GTK_LABEL(gui->router_name_label), _("not available"));
     gtk_widget_set_sensitive(gui->router_name_hbox, FALSE);
 
@@ -786,11 +1139,144 @@ gui_disable()
     gui_update_graph();
 }
 
+static void
+gui_add_stored_mapped_port (gpointer data, gpointer user_data)
+{
+    gui_add_mapped_port ((const PortForwardInfo *) data);
+}
+
+/* Fill the window with what is known of "router" */
+static void
+gui_show_router (RouterInfo *router)
+{
+    gui_disable();
+
+    gtk_widget_hide (gui->add_port_window->window);
+
+    if(router == NULL)
+        return;
+
+    gui_set_router_info(router);
+
+    if(router->wan_conn_service != NULL) {
+        gui_activate_buttons();
+
+        if(router->external_ip != NULL)
+            gui_set_ext_ip(router->external_ip);
+
+        if(router->conn_status != NULL)
+            gui_set_conn_status(router->conn_status);
+
+        urc_mapping_store_foreach(router->port_mappings, gui_add_stored_mapped_port, NULL);
+    }
+
+    if(router->wan_common_ifc != NULL) {
+        urc_enable_graph(router->down_history, router->up_history);
+
+        if(router->received_counter.valid)
+            gui_set_total_received(router->received_counter.total);
+
+        if(router->sent_counter.valid)
+            gui_set_total_sent(router->sent_counter.total);
+
+        gui_update_graph();
+    }
+}
+
+static void
+gui_on_router_combo_changed (GtkComboBox *combo, gpointer user_data)
+{
+    RouterInfo *router;
+    const gchar *root_udn;
+
+    root_udn = gtk_combo_box_get_active_id (combo);
+    if(root_udn == NULL)
+        return;
+
+    urc_worker_lock ();
+
+    router = urc_upnp_lookup_router (root_udn);
+
+    if(router != NULL && router != gui->router)
+        gui_show_router (router);
+
+    urc_worker_unlock ();
+}
+
+/* Position of a router in the switcher, -1 if missing */
+static gint
+gui_router_combo_find (RouterInfo *router)
+{
+    GtkTreeModel *model;
+    GtkTreeIter iter;
+    gchar *id;
+    gint position = 0;
+    gboolean more;
+
+    model = gtk_combo_box_get_model (GTK_COMBO_BOX (gui->router_combo));
+    more = gtk_tree_model_get_iter_first (model, &iter);
+
+    while (more) {
+        gtk_tree_model_get (model, &iter,
+                            gtk_combo_box_get_id_column (GTK_COMBO_BOX (gui->router_combo)), &id,
+                            -1);
+
+        if (g_strcmp0 (id, router->root_udn) == 0) {
+            g_free (id);
+            return position;
+        }
+
+        g_free (id);
+        position++;
+        more = gtk_tree_model_iter_next (model, &iter);
+    }
+
+    return -1;
+}
+
+static void
+gui_router_combo_update_visibility (void)
+{
+    GtkTreeModel *model;
+
+    model = gtk_combo_box_get_model (GTK_COMBO_BOX (gui->router_combo));
+    gtk_widget_set_visible (gui->router_combo, gtk_tree_model_iter_n_children (model, NULL) > 1);
+}
+
+/* Menu graph window change */
+static void
+on_graph_window_change_state_cb (GSimpleAction *simple, GVariant *value, gpointer user_data)
+{
+    const gchar *window = g_variant_get_string (value, NULL);
+
+    if(g_strcmp0 (window, "minutes") == 0)
+        urc_graph_set_window (URC_HISTORY_MINUTES);
+    else if(g_strcmp0 (window, "hours") == 0)
+        urc_graph_set_window (URC_HISTORY_HOURS);
+    else if(g_strcmp0 (window, "days") == 0)
+        urc_graph_set_window (URC_HISTORY_DAYS);
+    else
+        urc_graph_set_window (URC_HISTORY_SECONDS);
+
+    g_simple_action_set_state (simple, value);
+    gui_update_graph();
+}
+
 /* Menu About activate callback */
 static void
 on_open_xml_descriptor_activate_cb (GSimpleAction *simple, GVariant *parameter, gpointer user_data)
 {
-    gtk_show_uri_on_window(NULL, gui->router->device_descriptor, GDK_CURRENT_TIME, NULL);
+    gchar *uri;
+
+    if (gui->router == NULL)
+        return;
+
+    urc_worker_lock ();
+    uri = g_strdup (gui->router->device_descriptor);
+    urc_worker_unlock ();
+
+    gtk_show_uri_on_window(NULL, uri, GDK_CURRENT_TIME, NULL);
+    g_free (uri);
 }
 
 
@@ -849,7 +1335,9 @@ gui_destroy()
 
     gui->main_window = NULL;
 
+    g_hash_table_unref(gui->port_rows);
     g_free(gui);
+    gui = NULL;
 
     gtk_main_quit();
 }
@@ -888,6 +1376,8 @@ urc_gui_init(GApplication *app)
     g_assert (gui->main_window != NULL);
 
     gui->treeview = GTK_WIDGET (gtk_builder_get_object (gui->builder, "treeview1"));
+    gui->port_rows = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, (GDestroyNotify) gtk_tree_row_reference_free);
 
     gui->router_name_label = GTK_WIDGET (gtk_builder_get_object (gui->builder, "router_name_label"));
     gui->router_name_hbox = GTK_WIDGET (gtk_builder_get_object (gui->builder, "hbox_name"));
@@ -915,6 +1405,23 @@ urc_gui_init(GApplication *app)
 
     gui->headerbar = GTK_WIDGET (gtk_builder_get_object (gui->builder, "headerbar"));
     gui->refresh_button = GTK_WIDGET (gtk_builder_get_object (gui->builder, "refresh_button"));
+
+    // Router switcher, shown when more than one router is found.
+    gui->router_combo = gtk_combo_box_text_new ();
+    gtk_widget_set_no_show_all (gui->router_combo, TRUE);
+    gtk_widget_set_tooltip_text (gui->router_combo, _("Router shown"));
+    gtk_header_bar_pack_start (GTK_HEADER_BAR (gui->headerbar), gui->router_combo);
+
+    g_signal_connect (gui->router_combo, "changed",
+                      G_CALLBACK (gui_on_router_combo_changed), NULL);
+
+    // Refresh and add/remove buttons act on the router shown.
+    g_signal_connect(gui->refresh_button, "clicked",
+                     G_CALLBACK(on_refresh_activate_cb), NULL);
+    g_signal_connect(gui->button_add, "clicked",
+                     G_CALLBACK(gui_run_add_port_window), NULL);
+    g_signal_connect(gui->button_remove, "clicked",
+                     G_CALLBACK(on_button_remove_clicked), NULL);
     gui->menu_button = GTK_MENU_BUTTON (gtk_builder_get_object (gui->builder, "menu_button"));
 
     // Sets the graph color default values
@@ -946,7 +1453,8 @@ urc_gui_init(GApplication *app)
     // Menu actions.
     const GActionEntry entries[] = {
         { "about", on_about_activate_cb },
-        { "open-xml-descriptor", on_open_xml_descriptor_activate_cb }
+        { "open-xml-descriptor", on_open_xml_descriptor_activate_cb },
+        { "graph-window", NULL, "s", "'seconds'", on_graph_window_change_state_cb }
     };
 
     gui->actions = G_ACTION_GROUP( g_simple_action_group_new () );
@@ -968,3 +1476,225 @@ urc_gui_init(GApplication *app)
     gtk_widget_show_all(gui->main_window);
 }
 
+
+/* Sink of the main window: only the router shown reaches the widgets */
+
+static gboolean
+gui_sink_shown (RouterInfo *router)
+{
+    return gui != NULL && gui->main_window != NULL && router == gui->router;
+}
+
+static void
+gui_sink_add_router (RouterInfo *router)
+{
+    if(gui == NULL || gui->main_window == NULL)
+        return;
+
+    /* the first router found is shown */
+    if(gui->router == NULL)
+        gui_show_router(router);
+
+    gtk_combo_box_text_append (GTK_COMBO_BOX_TEXT (gui->router_combo), router->root_udn, router->friendly_name);
+
+    if(gui->router == router)
+        gtk_combo_box_set_active_id (GTK_COMBO_BOX (gui->router_combo), router->root_udn);
+
+    gui_router_combo_update_visibility ();
+}
+
+static void
+gui_sink_remove_router (RouterInfo *router)
+{
+    gint position;
+
+    if(gui == NULL || gui->main_window == NULL)
+        return;
+
+    position = gui_router_combo_find (router);
+    if(position >= 0)
+        gtk_combo_box_text_remove (GTK_COMBO_BOX_TEXT (gui->router_combo), position);
+
+    gui_router_combo_update_visibility ();
+
+    if(router != gui->router)
+        return;
+
+    /* show another router, if any; the one removed is no longer registered */
+    gui_disable();
+    gtk_combo_box_set_active (GTK_COMBO_BOX (gui->router_combo), 0);
+}
+
+static void
+gui_sink_set_health (RouterInfo *router)
+{
+    if(gui_sink_shown(router))
+        gui_set_health(router);
+}
+
+static void
+gui_sink_enable_port_mapping (RouterInfo *router)
+{
+    if(gui_sink_shown(router))
+        gui_activate_buttons();
+}
+
+static void
+gui_sink_set_ext_ip (RouterInfo *router, const gchar *ip)
+{
+    if(gui_sink_shown(router))
+        gui_set_ext_ip(ip);
+}
+
+static void
+gui_sink_disable_ext_ip (RouterInfo *router)
+{
+    if(gui_sink_shown(router))
+        gui_disable_ext_ip();
+}
+
+static void
+gui_sink_set_conn_status (RouterInfo *router, const gchar *state)
+{
+    if(gui_sink_shown(router))
+        gui_set_conn_status(state);
+}
+
+static void
+gui_sink_disable_conn_status (RouterInfo *router)
+{
+    if(gui_sink_shown(router))
+        gui_disable_conn_status();
+}
+
+static void
+gui_sink_set_total_received (RouterInfo *router, guint64 total_received)
+{
+    if(gui_sink_shown(router))
+        gui_set_total_received(total_received);
+}
+
+static void
+gui_sink_disable_total_received (RouterInfo *router)
+{
+    if(gui_sink_shown(router))
+        gui_disable_total_received();
+}
+
+static void
+gui_sink_set_total_sent (RouterInfo *router, guint64 total_sent)
+{
+    if(gui_sink_shown(router))
+        gui_set_total_sent(total_sent);
+}
+
+static void
+gui_sink_disable_total_sent (RouterInfo *router)
+{
+    if(gui_sink_shown(router))
+        gui_disable_total_sent();
+}
+
+static void
+gui_sink_set_download_speed (RouterInfo *router, const gdouble down_speed)
+{
+    if(gui_sink_shown(router))
+        gui_set_download_speed(down_speed);
+}
+
+static void
+gui_sink_disable_download_speed (RouterInfo *router)
+{
+    if(gui_sink_shown(router))
+        gui_disable_download_speed();
+}
+
+static void
+gui_sink_set_upload_speed (RouterInfo *router, const gdouble up_speed)
+{
+    if(gui_sink_shown(router))
+        gui_set_upload_speed(up_speed);
+}
+
+static void
+gui_sink_disable_upload_speed (RouterInfo *router)
+{
+    if(gui_sink_shown(router))
+        gui_disable_upload_speed();
+}
+
+static void
+gui_sink_set_download_packets (RouterInfo *router, const gdouble packet_rate, const gdouble avg_packet_size)
+{
+    if(gui_sink_shown(router))
+        gui_set_download_packets(packet_rate, avg_packet_size);
+}
+
+static void
+gui_sink_set_upload_packets (RouterInfo *router, const gdouble packet_rate, const gdouble avg_packet_size)
+{
+    if(gui_sink_shown(router))
+        gui_set_upload_packets(packet_rate, avg_packet_size);
+}
+
+static void
+gui_sink_add_mapped_port (RouterInfo *router, const PortForwardInfo *port_info)
+{
+    if(gui_sink_shown(router))
+        gui_add_mapped_port(port_info);
+}
+
+static void
+gui_sink_update_mapped_port (RouterInfo *router, const PortForwardInfo *port_info)
+{
+    if(gui_sink_shown(router))
+        gui_update_mapped_port(port_info);
+}
+
+static void
+gui_sink_remove_mapped_port (RouterInfo *router, const PortForwardInfo *port_info)
+{
+    if(gui_sink_shown(router))
+        gui_remove_mapped_port(port_info);
+}
+
+static void
+gui_sink_enable_graph (RouterInfo *router)
+{
+    if(gui_sink_shown(router))
+        urc_enable_graph(router->down_history, router->up_history);
+}
+
+static void
+gui_sink_update_graph (RouterInfo *router)
+{
+    if(gui_sink_shown(router))
+        gui_update_graph();
+}
+
+const UrcSink urc_gui_sink =
+{
+    .add_router = gui_sink_add_router,
+    .remove_router = gui_sink_remove_router,
+    .set_health = gui_sink_set_health,
+    .enable_port_mapping = gui_sink_enable_port_mapping,
+    .set_ext_ip = gui_sink_set_ext_ip,
+    .disable_ext_ip = gui_sink_disable_ext_ip,
+    .set_conn_status = gui_sink_set_conn_status,
+    .disable_conn_status = gui_sink_disable_conn_status,
+    .set_total_received = gui_sink_set_total_received,
+    .disable_total_received = gui_sink_disable_total_received,
+    .set_total_sent = gui_sink_set_total_sent,
+    .disable_total_sent = gui_sink_disable_total_sent,
+    .set_download_speed = gui_sink_set_download_speed,
+    .disable_download_speed = gui_sink_disable_download_speed,
+    .set_upload_speed = gui_sink_set_upload_speed,
+    .disable_upload_speed = gui_sink_disable_upload_speed,
+    .set_download_packets = gui_sink_set_download_packets,
+    .set_upload_packets = gui_sink_set_upload_packets,
+    .add_mapped_port = gui_sink_add_mapped_port,
+    .update_mapped_port = gui_sink_update_mapped_port,
+    .remove_mapped_port = gui_sink_remove_mapped_port,
+    .enable_graph = gui_sink_enable_graph,
+    .update_graph = gui_sink_update_graph,
+};
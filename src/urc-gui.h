@@ -21,8 +21,12 @@
 #define __URC_GUI_H__
 
 #include <glib.h>
+#include "urc-sink.h"
 #include "urc-upnp.h"
 
+/* routes the router state to the main window */
+extern const UrcSink urc_gui_sink;
+
 void urc_gui_init(GApplication *app);
 
 void gui_disable();
@@ -55,10 +59,10 @@ void
 gui_disable_total_sent (void);
 
 void
-gui_set_total_received (unsigned int total_received);
+gui_set_total_received (guint64 total_received);
 
 void
-gui_set_total_sent (unsigned int total_sent);
+gui_set_total_sent (guint64 total_sent);
 
 void
 gui_disable_download_speed(void);
@@ -73,7 +77,19 @@ void
 gui_set_upload_speed(const gdouble up_speed);
 
 void
-gui_add_mapped_ports(const GSList *port_list);
+gui_set_download_packets(const gdouble packet_rate, const gdouble avg_packet_size);
+
+void
+gui_set_upload_packets(const gdouble packet_rate, const gdouble avg_packet_size);
+
+void
+gui_add_mapped_port(const PortForwardInfo *port_info);
+
+void
+gui_update_mapped_port(const PortForwardInfo *port_info);
+
+void
+gui_remove_mapped_port(const PortForwardInfo *port_info);
 
 void
 gui_clear_ports_list_treeview(void);
@@ -0,0 +1,228 @@
+/* urc-health.c
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+#include "urc-health.h"
+#include "urc-worker.h"
+
+extern gboolean opt_debug;
+
+struct _UrcHealth
+{
+    UrcHealthState state;
+
+    /* transport failures in a row while up */
+    guint failures;
+
+    /* current backoff, seconds */
+    guint backoff;
+
+    /* end of the backoff, or of the probe */
+    guint timer;
+
+    UrcHealthFunc func;
+    UrcHealthFunc failure_func;
+    gpointer user_data;
+};
+
+static void
+health_set_state (UrcHealth *health, UrcHealthState state)
+{
+    health->state = state;
+
+    if (opt_debug)
+        g_print ("\e[34mHealth: %s (%u failures, backoff %u s)\e[0m\n",
+                 urc_health_state_to_string (state), health->failures, health->backoff);
+
+    health->func (health, state, health->user_data);
+}
+
+static void
+health_clear_timer (UrcHealth *health)
+{
+    if (health->timer > 0) {
+        urc_worker_source_remove (health->timer);
+        health->timer = 0;
+    }
+}
+
+static gboolean
+health_probe_timeout_cb (gpointer data)
+{
+    UrcHealth *health = (UrcHealth *) data;
+
+    health->timer = 0;
+    urc_health_failure (health);
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+health_backoff_done_cb (gpointer data)
+{
+    UrcHealth *health = (UrcHealth *) data;
+
+    health->timer = urc_worker_timeout_add_seconds (URC_HEALTH_PROBE_TIMEOUT, health_probe_timeout_cb, health);
+    health_set_state (health, URC_HEALTH_PROBING);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void
+health_back_off (UrcHealth *health, guint backoff)
+{
+    guint delay;
+
+    health_clear_timer (health);
+
+    health->backoff = MIN (backoff, URC_HEALTH_BACKOFF_MAX);
+
+    /* +/-10%, the routers failing together don't probe together */
+    delay = health->backoff * g_random_int_range (900, 1101);
+    health->timer = urc_worker_timeout_add (delay, health_backoff_done_cb, health);
+
+    health_set_state (health, URC_HEALTH_BACKOFF);
+}
+
+UrcHealth*
+urc_health_new (UrcHealthFunc func,
+                gpointer      user_data)
+{
+    UrcHealth *health;
+
+    health = g_malloc0 (sizeof (UrcHealth));
+    health->state = URC_HEALTH_UP;
+    health->func = func;
+    health->user_data = user_data;
+
+    return health;
+}
+
+void
+urc_health_free (UrcHealth *health)
+{
+    health_clear_timer (health);
+    g_free (health);
+}
+
+void
+urc_health_set_failure_func (UrcHealth     *health,
+                             UrcHealthFunc  func)
+{
+    health->failure_func = func;
+}
+
+/* Back to up without telling, for a fresh start */
+void
+urc_health_reset (UrcHealth *health)
+{
+    health_clear_timer (health);
+
+    health->state = URC_HEALTH_UP;
+    health->failures = 0;
+    health->backoff = 0;
+}
+
+/* The router answered, even with a SOAP fault */
+void
+urc_health_success (UrcHealth *health)
+{
+    health->failures = 0;
+
+    if (health->state == URC_HEALTH_UP)
+        return;
+
+    health_clear_timer (health);
+    health->backoff = 0;
+
+    health_set_state (health, URC_HEALTH_UP);
+}
+
+/* No answer: connection refused, timeout, HTTP error */
+void
+urc_health_failure (UrcHealth *health)
+{
+    if (health->failure_func != NULL)
+        health->failure_func (health, health->state, health->user_data);
+
+    switch (health->state) {
+        case URC_HEALTH_UP:
+            if (++health->failures >= URC_HEALTH_FAILURES)
+                health_back_off (health, URC_HEALTH_BACKOFF_MIN);
+            break;
+
+        case URC_HEALTH_PROBING:
+            health_back_off (health, health->backoff * 2);
+            break;
+
+        case URC_HEALTH_BACKOFF:
+            /* requests sent before backing off */
+            break;
+    }
+}
+
+UrcHealthState
+urc_health_get_state (UrcHealth *health)
+{
+    return health->state;
+}
+
+guint
+urc_health_get_backoff (UrcHealth *health)
+{
+    return health->backoff;
+}
+
+const gchar*
+urc_health_state_to_string (UrcHealthState state)
+{
+    switch (state) {
+        case URC_HEALTH_UP:
+            return "up";
+        case URC_HEALTH_BACKOFF:
+            return "backoff";
+        case URC_HEALTH_PROBING:
+            return "probing";
+    }
+
+    return "unknown";
+}
+
+void
+urc_health_watch (UrcHealth         *health,
+                  GUPnPServiceProxy *proxy)
+{
+    g_object_set_data (G_OBJECT (proxy), "urc-health", health);
+}
+
+void
+urc_health_unwatch (GUPnPServiceProxy *proxy)
+{
+    g_object_set_data (G_OBJECT (proxy), "urc-health", NULL);
+}
+
+UrcHealth*
+urc_health_for_proxy (GUPnPServiceProxy *proxy)
+{
+    return g_object_get_data (G_OBJECT (proxy), "urc-health");
+}
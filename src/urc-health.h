@@ -0,0 +1,95 @@
+/* urc-health.h
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __URC_HEALTH_H__
+#define __URC_HEALTH_H__
+
+#include <glib.h>
+#include <libgupnp/gupnp.h>
+
+/* Whether a router answers. After URC_HEALTH_FAILURES transport failures
+ * in a row it is left alone for a backoff that doubles at every failed
+ * probe, up to URC_HEALTH_BACKOFF_MAX. Then a single probe is let
+ * through: any answer brings it back at once. */
+typedef enum
+{
+    URC_HEALTH_UP,       /* answering */
+    URC_HEALTH_BACKOFF,  /* not answering, waiting before trying again */
+    URC_HEALTH_PROBING   /* waiting for the answer to the probe */
+} UrcHealthState;
+
+#define URC_HEALTH_FAILURES       3
+
+/* seconds */
+#define URC_HEALTH_BACKOFF_MIN    2
+#define URC_HEALTH_BACKOFF_MAX    120
+
+/* a probe without any answer by then is a failure */
+#define URC_HEALTH_PROBE_TIMEOUT  15
+
+typedef struct _UrcHealth UrcHealth;
+
+/* The state changed. On URC_HEALTH_PROBING the owner sends the probe. */
+typedef void (*UrcHealthFunc) (UrcHealth      *health,
+                               UrcHealthState  state,
+                               gpointer        user_data);
+
+UrcHealth*
+urc_health_new (UrcHealthFunc func,
+                gpointer      user_data);
+
+void
+urc_health_free (UrcHealth *health);
+
+/* Also called on every failure, before any change of state */
+void
+urc_health_set_failure_func (UrcHealth     *health,
+                             UrcHealthFunc  func);
+
+void
+urc_health_reset (UrcHealth *health);
+
+void
+urc_health_success (UrcHealth *health);
+
+void
+urc_health_failure (UrcHealth *health);
+
+UrcHealthState
+urc_health_get_state (UrcHealth *health);
+
+guint
+urc_health_get_backoff (UrcHealth *health);
+
+const gchar*
+urc_health_state_to_string (UrcHealthState state);
+
+/* The SOAP actions sent through "proxy" report to "health" */
+void
+urc_health_watch (UrcHealth         *health,
+                  GUPnPServiceProxy *proxy);
+
+void
+urc_health_unwatch (GUPnPServiceProxy *proxy);
+
+UrcHealth*
+urc_health_for_proxy (GUPnPServiceProxy *proxy);
+
+#endif /* __URC_HEALTH_H__ */
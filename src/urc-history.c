@@ -0,0 +1,381 @@
+/* urc-history.c
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <glib.h>
+
+#include "urc-history.h"
+
+/* Periods of the tiers, in microseconds */
+static const gint64 tier_period[URC_HISTORY_N_TIERS] =
+{
+    G_USEC_PER_SEC,
+    G_GINT64_CONSTANT (60) * G_USEC_PER_SEC,
+    G_GINT64_CONSTANT (60) * 60 * G_USEC_PER_SEC,
+    G_GINT64_CONSTANT (24) * 60 * 60 * G_USEC_PER_SEC,
+};
+
+typedef struct
+{
+    /* fixed ring, the current period at "head" */
+    UrcHistoryPoint points[URC_HISTORY_POINTS];
+    guint head;
+
+    /* period index of "head", -1 before the first sample */
+    gint64 period;
+    gdouble sum;
+
+} HistoryTier;
+
+/* Throughput samples of a series at 1 s, 1 min, 1 h and 1 day
+ * resolution. The raw tier takes a point per second since its previous
+ * one, counted from the sample times so the ticks jitter doesn't move
+ * it; the others roll up the samples falling in the same wall clock
+ * period. The seconds, minutes... without samples stay empty. */
+struct _UrcHistory
+{
+    HistoryTier tiers[URC_HISTORY_N_TIERS];
+
+    /* wall clock time of the raw point at "head", -1 before the first */
+    gint64 raw_time;
+
+    /* raw points added, the empty ones too, never goes back */
+    guint64 seq;
+};
+
+UrcHistory*
+urc_history_new (void)
+{
+    UrcHistory *history;
+
+    history = g_malloc (sizeof (UrcHistory));
+    history->seq = 0;
+    urc_history_clear (history);
+
+    return history;
+}
+
+void
+urc_history_free (UrcHistory *history)
+{
+    g_free (history);
+}
+
+void
+urc_history_clear (UrcHistory *history)
+{
+    HistoryTier *tier;
+    guint i;
+
+    for (i = 0; i < URC_HISTORY_N_TIERS; i++) {
+        tier = &history->tiers[i];
+
+        memset (tier->points, 0, sizeof (tier->points));
+        tier->head = 0;
+        tier->period = -1;
+        tier->sum = 0.0;
+    }
+
+    history->raw_time = -1;
+
+    /* every point changed, more than a reader can scroll */
+    history->seq += URC_HISTORY_POINTS;
+}
+
+static void
+history_tier_advance (HistoryTier *tier)
+{
+    tier->head = (tier->head + 1) % URC_HISTORY_POINTS;
+    tier->points[tier->head].count = 0;
+    tier->sum = 0.0;
+}
+
+/* Move "head" by "steps" periods, the ones in between left empty */
+static void
+history_tier_move (HistoryTier *tier,
+                   gint64       steps)
+{
+    /* no more than a full ring */
+    steps = MIN (steps, URC_HISTORY_POINTS);
+
+    while (steps-- > 0)
+        history_tier_advance (tier);
+}
+
+static void
+history_tier_add (HistoryTier *tier,
+                  gdouble      value)
+{
+    UrcHistoryPoint *point = &tier->points[tier->head];
+
+    if (point->count == 0) {
+        point->min = value;
+        point->max = value;
+    }
+    else {
+        point->min = MIN (point->min, value);
+        point->max = MAX (point->max, value);
+    }
+
+    point->count++;
+    tier->sum += value;
+    point->avg = tier->sum / point->count;
+}
+
+/* Close the points of the periods ended before "time" (wall clock,
+ * microseconds), the current point of each tier is then the one of
+ * "time" */
+static void
+history_advance (UrcHistory *history,
+                 gint64      time)
+{
+    HistoryTier *tier;
+    gint64 period, steps;
+    guint i;
+
+    /* raw tier, the nearest whole number of seconds since its point */
+    tier = &history->tiers[URC_HISTORY_SECONDS];
+
+    if (history->raw_time < 0 || time < history->raw_time)
+        /* first sample, or the clock went back */
+        steps = 1;
+    else
+        steps = (time - history->raw_time + tier_period[URC_HISTORY_SECONDS] / 2) /
+                tier_period[URC_HISTORY_SECONDS];
+
+    if (steps > 0) {
+        history_tier_move (tier, steps);
+        history->raw_time = time;
+        history->seq += steps;
+    }
+
+    for (i = URC_HISTORY_SECONDS + 1; i < URC_HISTORY_N_TIERS; i++) {
+        tier = &history->tiers[i];
+        period = time / tier_period[i];
+
+        if (tier->period < 0) {
+            tier->points[tier->head].count = 0;
+            tier->sum = 0.0;
+        }
+        else if (period > tier->period)
+            history_tier_move (tier, period - tier->period);
+        else if (period < tier->period)
+            /* the clock went back, keep filling the current period */
+            period = tier->period;
+
+        tier->period = period;
+    }
+}
+
+/* Add a sample taken at "time" (wall clock, microseconds) */
+void
+urc_history_push (UrcHistory *history,
+                  gint64      time,
+                  gdouble     value)
+{
+    guint i;
+
+    history_advance (history, time);
+
+    for (i = 0; i < URC_HISTORY_N_TIERS; i++)
+        history_tier_add (&history->tiers[i], value);
+}
+
+/* No sample could be taken at "time": the points up to it are closed
+ * and the one of "time" is left empty, unless it already has a sample */
+void
+urc_history_push_gap (UrcHistory *history,
+                      gint64      time)
+{
+    history_advance (history, time);
+}
+
+/* Checkpoint encoding, little endian: per tier "head", "period", "sum"
+ * and the points, then "raw_time" */
+#define CHECKPOINT_POINT_SIZE (3 * 8 + 4)
+#define CHECKPOINT_TIER_SIZE (4 + 8 + 8 + URC_HISTORY_POINTS * CHECKPOINT_POINT_SIZE)
+#define CHECKPOINT_SIZE (URC_HISTORY_N_TIERS * CHECKPOINT_TIER_SIZE + 8)
+
+static void
+checkpoint_put_u32 (GByteArray *out, guint32 value)
+{
+    value = GUINT32_TO_LE (value);
+    g_byte_array_append (out, (const guint8 *) &value, 4);
+}
+
+static void
+checkpoint_put_u64 (GByteArray *out, guint64 value)
+{
+    value = GUINT64_TO_LE (value);
+    g_byte_array_append (out, (const guint8 *) &value, 8);
+}
+
+static void
+checkpoint_put_double (GByteArray *out, gdouble value)
+{
+    guint64 bits;
+
+    memcpy (&bits, &value, 8);
+    checkpoint_put_u64 (out, bits);
+}
+
+static guint32
+checkpoint_get_u32 (const guint8 **data)
+{
+    guint32 value;
+
+    memcpy (&value, *data, 4);
+    *data += 4;
+
+    return GUINT32_FROM_LE (value);
+}
+
+static guint64
+checkpoint_get_u64 (const guint8 **data)
+{
+    guint64 value;
+
+    memcpy (&value, *data, 8);
+    *data += 8;
+
+    return GUINT64_FROM_LE (value);
+}
+
+static gdouble
+checkpoint_get_double (const guint8 **data)
+{
+    guint64 bits;
+    gdouble value;
+
+    bits = checkpoint_get_u64 (data);
+    memcpy (&value, &bits, 8);
+
+    return value;
+}
+
+/* Append the state of the tiers to "out", to be restored after a
+ * restart without going through the samples again */
+void
+urc_history_save (const UrcHistory *history,
+                  GByteArray       *out)
+{
+    const HistoryTier *tier;
+    const UrcHistoryPoint *point;
+    guint i, j;
+
+    for (i = 0; i < URC_HISTORY_N_TIERS; i++) {
+        tier = &history->tiers[i];
+
+        checkpoint_put_u32 (out, tier->head);
+        checkpoint_put_u64 (out, (guint64) tier->period);
+        checkpoint_put_double (out, tier->sum);
+
+        for (j = 0; j < URC_HISTORY_POINTS; j++) {
+            point = &tier->points[j];
+
+            checkpoint_put_double (out, point->min);
+            checkpoint_put_double (out, point->max);
+            checkpoint_put_double (out, point->avg);
+            checkpoint_put_u32 (out, point->count);
+        }
+    }
+
+    checkpoint_put_u64 (out, (guint64) history->raw_time);
+}
+
+/* Restore the state saved by urc_history_save() at "*data", which is
+ * moved past it. FALSE, leaving the history untouched, when it is cut
+ * short or not valid. */
+gboolean
+urc_history_restore (UrcHistory    *history,
+                     const guint8 **data,
+                     gsize         *length)
+{
+    const guint8 *p = *data;
+    HistoryTier *tier;
+    UrcHistoryPoint *point;
+    guint i, j;
+
+    if (*length < CHECKPOINT_SIZE)
+        return FALSE;
+
+    for (i = 0; i < URC_HISTORY_N_TIERS; i++) {
+        if (checkpoint_get_u32 (&p) >= URC_HISTORY_POINTS)
+            return FALSE;
+
+        p += CHECKPOINT_TIER_SIZE - 4;
+    }
+
+    p = *data;
+
+    for (i = 0; i < URC_HISTORY_N_TIERS; i++) {
+        tier = &history->tiers[i];
+
+        tier->head = checkpoint_get_u32 (&p);
+        tier->period = (gint64) checkpoint_get_u64 (&p);
+        tier->sum = checkpoint_get_double (&p);
+
+        for (j = 0; j < URC_HISTORY_POINTS; j++) {
+            point = &tier->points[j];
+
+            point->min = checkpoint_get_double (&p);
+            point->max = checkpoint_get_double (&p);
+            point->avg = checkpoint_get_double (&p);
+            point->count = checkpoint_get_u32 (&p);
+        }
+    }
+
+    history->raw_time = (gint64) checkpoint_get_u64 (&p);
+
+    /* every point changed, as after urc_history_clear() */
+    history->seq += URC_HISTORY_POINTS;
+
+    *data = p;
+    *length -= CHECKPOINT_SIZE;
+
+    return TRUE;
+}
+
+guint64
+urc_history_get_seq (const UrcHistory *history)
+{
+    return history != NULL ? history->seq : 0;
+}
+
+/* Point "age" periods old, 0 is the current one. NULL when the
+ * point is out of the ring or has no samples. */
+const UrcHistoryPoint*
+urc_history_get (const UrcHistory *history,
+                 UrcHistoryTier    tier,
+                 guint             age)
+{
+    const HistoryTier *t;
+    const UrcHistoryPoint *point;
+
+    if (history == NULL || tier >= URC_HISTORY_N_TIERS || age >= URC_HISTORY_POINTS)
+        return NULL;
+
+    t = &history->tiers[tier];
+    point = &t->points[(t->head + URC_HISTORY_POINTS - age) % URC_HISTORY_POINTS];
+
+    return point->count > 0 ? point : NULL;
+}
@@ -0,0 +1,87 @@
+/* urc-history.h
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __URC_HISTORY_H__
+#define __URC_HISTORY_H__
+
+#include <glib.h>
+
+/* Points kept by each tier */
+#define URC_HISTORY_POINTS 91
+
+typedef enum
+{
+    URC_HISTORY_SECONDS,
+    URC_HISTORY_MINUTES,
+    URC_HISTORY_HOURS,
+    URC_HISTORY_DAYS,
+    URC_HISTORY_N_TIERS
+} UrcHistoryTier;
+
+/* Rollup of the samples of a period, "count" is 0 when there are none */
+typedef struct
+{
+    gdouble min;
+    gdouble max;
+    gdouble avg;
+    guint   count;
+} UrcHistoryPoint;
+
+typedef struct _UrcHistory UrcHistory;
+
+UrcHistory*
+urc_history_new (void);
+
+void
+urc_history_free (UrcHistory *history);
+
+void
+urc_history_clear (UrcHistory *history);
+
+void
+urc_history_push (UrcHistory *history,
+                  gint64      time,
+                  gdouble     value);
+
+void
+urc_history_push_gap (UrcHistory *history,
+                      gint64      time);
+
+/* Points added to the raw tier so far, the empty seconds too, a reader
+ * compares it with the value it last saw to know how far the series
+ * moved */
+guint64
+urc_history_get_seq (const UrcHistory *history);
+
+void
+urc_history_save (const UrcHistory *history,
+                  GByteArray       *out);
+
+gboolean
+urc_history_restore (UrcHistory    *history,
+                     const guint8 **data,
+                     gsize         *length);
+
+const UrcHistoryPoint*
+urc_history_get (const UrcHistory *history,
+                 UrcHistoryTier    tier,
+                 guint             age);
+
+#endif /* __URC_HISTORY_H__ */
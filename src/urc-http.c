@@ -0,0 +1,159 @@
+/* urc-http.c
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "config.h"
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+
+#include "urc-http.h"
+
+extern gboolean opt_debug;
+extern guint opt_http_max_conns;
+extern guint opt_http_idle_timeout;
+extern gboolean opt_http_keep_alive;
+
+static UrcHttpStats stats;
+
+/* Per message state, owned by the message */
+typedef struct
+{
+    gboolean new_connection;
+    gint64   sent_time;
+    gint64   rtt;
+} UrcHttpRequest;
+
+static void
+message_network_event_cb (SoupMessage        *msg,
+                          GSocketClientEvent  event,
+                          GIOStream          *connection,
+                          gpointer            user_data)
+{
+    UrcHttpRequest *request = (UrcHttpRequest *) user_data;
+
+    /* only emitted while a new connection is set up, never when an
+     * idle persistent one is picked up */
+    if (event == G_SOCKET_CLIENT_CONNECTED)
+        request->new_connection = TRUE;
+}
+
+static void
+message_wrote_body_cb (SoupMessage *msg,
+                       gpointer     user_data)
+{
+    UrcHttpRequest *request = (UrcHttpRequest *) user_data;
+
+    request->sent_time = g_get_monotonic_time ();
+}
+
+static void
+message_got_headers_cb (SoupMessage *msg,
+                        gpointer     user_data)
+{
+    UrcHttpRequest *request = (UrcHttpRequest *) user_data;
+
+    if (request->sent_time > 0)
+        request->rtt = g_get_monotonic_time () - request->sent_time;
+}
+
+static void
+session_request_queued_cb (SoupSession *session,
+                           SoupMessage *msg,
+                           gpointer     user_data)
+{
+    UrcHttpRequest *request;
+
+    request = g_new0 (UrcHttpRequest, 1);
+    g_object_set_data_full (G_OBJECT (msg), "urc-http-request", request, g_free);
+
+    /* HTTP/1.1 connections are persistent by default, but some routers
+     * only keep them open when asked explicitly */
+    soup_message_headers_replace (msg->request_headers, "Connection",
+                                  opt_http_keep_alive ? "keep-alive" : "close");
+
+    g_signal_connect (msg, "network-event", G_CALLBACK (message_network_event_cb), request);
+    g_signal_connect (msg, "wrote-body", G_CALLBACK (message_wrote_body_cb), request);
+    g_signal_connect (msg, "got-headers", G_CALLBACK (message_got_headers_cb), request);
+}
+
+static void
+session_request_unqueued_cb (SoupSession *session,
+                             SoupMessage *msg,
+                             gpointer     user_data)
+{
+    UrcHttpRequest *request;
+    SoupURI *uri;
+
+    request = g_object_get_data (G_OBJECT (msg), "urc-http-request");
+    if (request == NULL)
+        return;
+
+    stats.requests++;
+
+    if (SOUP_STATUS_IS_TRANSPORT_ERROR (msg->status_code)) {
+        stats.failed++;
+        return;
+    }
+
+    if (request->new_connection)
+        stats.new_connections++;
+    else
+        stats.reused_connections++;
+
+    stats.rtt_last = request->rtt;
+    stats.rtt_max = MAX (stats.rtt_max, request->rtt);
+    stats.rtt_total += request->rtt;
+
+    if (opt_debug) {
+        uri = soup_message_get_uri (msg);
+        g_print ("\e[34mHTTP %s %s: %.1f ms, %s connection (%" G_GUINT64_FORMAT " new, %" G_GUINT64_FORMAT " reused)\e[0m\n",
+                 msg->method, uri->path,
+                 (gdouble) request->rtt / 1000,
+                 request->new_connection ? "new" : "reused",
+                 stats.new_connections, stats.reused_connections);
+    }
+}
+
+/* Apply the connection policy to the session of a GUPnP context and
+ * start counting its requests */
+void
+urc_http_setup_session (SoupSession *session)
+{
+    guint max_conns = MAX (opt_http_max_conns, 1);
+
+    g_object_set (session,
+                  SOUP_SESSION_MAX_CONNS_PER_HOST, max_conns,
+                  SOUP_SESSION_IDLE_TIMEOUT, opt_http_idle_timeout,
+                  NULL);
+
+    g_signal_connect (session, "request-queued", G_CALLBACK (session_request_queued_cb), NULL);
+    g_signal_connect (session, "request-unqueued", G_CALLBACK (session_request_unqueued_cb), NULL);
+
+    if (opt_debug)
+        g_print ("\e[34mHTTP session: %u connections per host, %u s idle timeout, keep-alive %s\e[0m\n",
+                 max_conns, opt_http_idle_timeout, opt_http_keep_alive ? "on" : "off");
+}
+
+const UrcHttpStats *
+urc_http_get_stats (void)
+{
+    return &stats;
+}
@@ -0,0 +1,53 @@
+/* urc-http.h
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __URC_HTTP_H__
+#define __URC_HTTP_H__
+
+#include <glib.h>
+#include <libsoup/soup.h>
+
+/* Defaults of the HTTP session used for SOAP, GENA and descriptions */
+#define URC_HTTP_DEFAULT_MAX_CONNS     2
+#define URC_HTTP_DEFAULT_IDLE_TIMEOUT  30
+
+/* Counters over all the requests sent so far */
+typedef struct
+{
+    guint64 requests;
+    guint64 failed;
+
+    /* requests that had to open a TCP connection, or reused one */
+    guint64 new_connections;
+    guint64 reused_connections;
+
+    /* time between request sent and response headers, microseconds */
+    gint64  rtt_last;
+    gint64  rtt_max;
+    gint64  rtt_total;
+} UrcHttpStats;
+
+void
+urc_http_setup_session (SoupSession *session);
+
+const UrcHttpStats *
+urc_http_get_stats (void);
+
+#endif /* __URC_HTTP_H__ */
@@ -21,24 +21,62 @@
 #include "config.h"
 
 #include <glib.h>
+#include <glib-unix.h>
 #include <glib/gi18n-lib.h>
+#include <signal.h>
 
+#ifdef HAVE_GUI
 #include <gtk/gtk.h>
 
 #include "urc-gui.h"
+#endif
+#include "urc-http.h"
+#include "urc-mapping.h"
+#include "urc-rate.h"
+#include "urc-sink.h"
 #include "urc-upnp.h"
+#include "urc-worker.h"
 
 /* Options variables */
 static gboolean opt_version = FALSE;
+#ifdef HAVE_GUI
+static gboolean opt_headless = FALSE;
+#endif
 gboolean opt_debug = FALSE;
 gchar* opt_bindif = NULL;
 guint opt_bindport = 0;
+guint opt_mapping_window = URC_MAPPING_DEFAULT_WINDOW;
+UrcRateFilter opt_rate_filter = URC_RATE_FILTER_EWMA;
+guint opt_http_max_conns = URC_HTTP_DEFAULT_MAX_CONNS;
+guint opt_http_idle_timeout = URC_HTTP_DEFAULT_IDLE_TIMEOUT;
+gboolean opt_http_keep_alive = TRUE;
+guint opt_metrics_port = 0;
+
+static gboolean
+parse_rate_filter (const gchar *option_name, const gchar *value, gpointer data, GError **error)
+{
+    if (urc_rate_filter_from_string (value, &opt_rate_filter))
+        return TRUE;
+
+    g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                 "Unknown rate filter \"%s\" (none, ewma or median)", value);
+    return FALSE;
+}
 
 /* Options schema */
 static GOptionEntry entries[] = 
 {
     { "if", 'i', 0, G_OPTION_ARG_STRING, &opt_bindif, "The network interface used (all if omitted)", NULL },
     { "port", 'p', 0, G_OPTION_ARG_INT, &opt_bindport, "Use a specific source port", NULL },
+    { "mapping-window", 0, 0, G_OPTION_ARG_INT, &opt_mapping_window, "Port mapping requests sent at once while listing (default 8)", NULL },
+    { "rate-filter", 0, 0, G_OPTION_ARG_CALLBACK, parse_rate_filter, "Smoothing of the data rates: none, ewma or median (default ewma)", "FILTER" },
+    { "http-max-conns", 0, 0, G_OPTION_ARG_INT, &opt_http_max_conns, "HTTP connections kept to each router (default 2)", NULL },
+    { "http-idle-timeout", 0, 0, G_OPTION_ARG_INT, &opt_http_idle_timeout, "Seconds an idle HTTP connection is kept open (default 30)", NULL },
+    { "no-keep-alive", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &opt_http_keep_alive, "Close the HTTP connection after each request", NULL },
+    { "metrics-port", 0, 0, G_OPTION_ARG_INT, &opt_metrics_port, "Serve OpenMetrics on http://localhost:PORT/metrics", "PORT" },
+#ifdef HAVE_GUI
+    { "headless", 0, 0, G_OPTION_ARG_NONE, &opt_headless, "Run without the GUI, the router state is printed", NULL },
+#endif
     { "version", 0, 0, G_OPTION_ARG_NONE, &opt_version, "Show version and exit", NULL },
     { "debug", 0, 0, G_OPTION_ARG_NONE, &opt_debug, "Allow debug messages", NULL },
     { NULL }
@@ -50,6 +88,25 @@ urc_print_version()
     g_print("%s %s\n", PACKAGE, VERSION);
 }
 
+/* Runs on the UPnP thread */
+static gboolean
+urc_upnp_init_cb (gpointer user_data)
+{
+    upnp_init();
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Runs on the UPnP thread, the last thing it does */
+static gboolean
+urc_upnp_shutdown_cb (gpointer user_data)
+{
+    urc_upnp_shutdown();
+
+    return G_SOURCE_REMOVE;
+}
+
+#ifdef HAVE_GUI
 static void
 urc_activate_cb (GApplication *app, gpointer user_data)
 {
@@ -67,15 +124,65 @@ urc_activate_cb (GApplication *app, gpointer user_data)
 static void
 urc_startup_cb (GApplication *app, gpointer user_data)
 {
-    /* Initialize the UPnP subsystem */
-    upnp_init();
+    /* the window is updated from this thread only */
+    urc_sink_set(urc_worker_queue_sink(&urc_gui_sink));
+
+    /* Initialize the UPnP subsystem, on its own thread */
+    urc_worker_start();
+    urc_worker_invoke(urc_upnp_init_cb, NULL, NULL);
+}
+
+static void
+urc_shutdown_cb (GApplication *app, gpointer user_data)
+{
+    /* the traffic logs keep what they didn't write yet */
+    urc_worker_stop(urc_upnp_shutdown_cb, NULL);
+}
+#endif
+
+static gboolean
+urc_quit_cb (gpointer user_data)
+{
+    g_print("* Exiting...\n");
+
+    /* the traffic logs keep what they didn't write yet */
+    urc_worker_stop(urc_upnp_shutdown_cb, NULL);
+
+    g_main_loop_quit((GMainLoop *) user_data);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Discovery and polling only, on a plain main loop */
+static int
+urc_run_headless (void)
+{
+    GMainLoop *loop;
+
+    loop = g_main_loop_new(NULL, FALSE);
+
+    urc_sink_set(&urc_log_sink);
+
+    /* Initialize the UPnP subsystem, on its own thread */
+    urc_worker_start();
+    urc_worker_invoke(urc_upnp_init_cb, NULL, NULL);
+
+    g_unix_signal_add(SIGINT, urc_quit_cb, loop);
+    g_unix_signal_add(SIGTERM, urc_quit_cb, loop);
+
+    g_main_loop_run(loop);
+    g_main_loop_unref(loop);
+
+    return EXIT_SUCCESS;
 }
 
 int
 main(int argc, char** argv)
 {
+#ifdef HAVE_GUI
     GtkApplication *app;
     int status;
+#endif
 
     GError *error = NULL;
     GOptionContext *context = NULL;
@@ -97,12 +204,17 @@ main(int argc, char** argv)
         urc_print_version();
         return EXIT_SUCCESS;
     }
-    else {
+#ifdef HAVE_GUI
+    else if (!opt_headless) {
       app = gtk_application_new ("org.upnproutercontrol.UPnPRouterControl", G_APPLICATION_FLAGS_NONE);
       g_signal_connect (app, "activate", G_CALLBACK (urc_activate_cb), NULL);
       g_signal_connect (app, "startup", G_CALLBACK (urc_startup_cb), NULL);
+      g_signal_connect (app, "shutdown", G_CALLBACK (urc_shutdown_cb), NULL);
       status = g_application_run (G_APPLICATION (app), argc, argv);
       g_object_unref (app);
       return status;
     }
+#endif
+
+    return urc_run_headless();
 }
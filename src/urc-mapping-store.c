@@ -0,0 +1,327 @@
+/* urc-mapping-store.c
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+#include "urc-mapping-store.h"
+
+struct _UrcMappingStore
+{
+    /* mapping key -> PortForwardInfo, owns the entries */
+    GHashTable *by_key;
+
+    /* internal host -> GPtrArray of PortForwardInfo */
+    GHashTable *by_host;
+};
+
+gchar*
+urc_mapping_key (const gchar *remote_host,
+                 guint        external_port,
+                 const gchar *protocol)
+{
+    gchar *proto, *key;
+
+    /* routers answer "tcp" as well as "TCP" */
+    proto = g_ascii_strup (protocol != NULL ? protocol : "", -1);
+
+    key = g_strdup_printf ("%s:%u/%s",
+                           remote_host != NULL ? remote_host : "",
+                           external_port,
+                           proto);
+    g_free (proto);
+
+    return key;
+}
+
+static gchar*
+port_forward_info_key (const PortForwardInfo *port_info)
+{
+    return urc_mapping_key (port_info->remote_host,
+                            port_info->external_port,
+                            port_info->protocol);
+}
+
+/* Compare the fields shown to the user, the lease time counts
+ * down on every read and is left out */
+static gboolean
+port_forward_info_equal (const PortForwardInfo *a,
+                         const PortForwardInfo *b)
+{
+    return a->internal_port == b->internal_port &&
+           a->enabled == b->enabled &&
+           g_strcmp0 (a->internal_host, b->internal_host) == 0 &&
+           g_strcmp0 (a->description, b->description) == 0;
+}
+
+static gint
+port_forward_info_cmp (gconstpointer a,
+                       gconstpointer b)
+{
+    const PortForwardInfo *port_a = *((PortForwardInfo **) a);
+    const PortForwardInfo *port_b = *((PortForwardInfo **) b);
+    gint ret;
+
+    ret = g_ascii_strcasecmp (port_a->protocol != NULL ? port_a->protocol : "",
+                              port_b->protocol != NULL ? port_b->protocol : "");
+    if (ret != 0)
+        return ret;
+
+    return (gint) port_a->external_port - (gint) port_b->external_port;
+}
+
+UrcMappingStore*
+urc_mapping_store_new (void)
+{
+    UrcMappingStore *store;
+
+    store = g_malloc (sizeof (UrcMappingStore));
+
+    store->by_key = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, (GDestroyNotify) port_forward_info_free);
+    store->by_host = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, (GDestroyNotify) g_ptr_array_unref);
+
+    return store;
+}
+
+void
+urc_mapping_store_free (UrcMappingStore *store)
+{
+    if (store == NULL)
+        return;
+
+    /* drop the secondary index first, it points into by_key */
+    g_hash_table_unref (store->by_host);
+    g_hash_table_unref (store->by_key);
+    g_free (store);
+}
+
+guint
+urc_mapping_store_size (UrcMappingStore *store)
+{
+    return g_hash_table_size (store->by_key);
+}
+
+/* Call "func" with each PortForwardInfo, in no particular order */
+void
+urc_mapping_store_foreach (UrcMappingStore *store,
+                           GFunc            func,
+                           gpointer         user_data)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init (&iter, store->by_key);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        func (value, user_data);
+}
+
+PortForwardInfo*
+urc_mapping_store_lookup (UrcMappingStore *store,
+                          const gchar     *remote_host,
+                          guint            external_port,
+                          const gchar     *protocol)
+{
+    PortForwardInfo *port_info;
+    gchar *key;
+
+    key = urc_mapping_key (remote_host, external_port, protocol);
+    port_info = g_hash_table_lookup (store->by_key, key);
+    g_free (key);
+
+    return port_info;
+}
+
+/* Mappings forwarded to a LAN host, NULL if there are none */
+const GPtrArray*
+urc_mapping_store_lookup_by_host (UrcMappingStore *store,
+                                  const gchar     *internal_host)
+{
+    return g_hash_table_lookup (store->by_host, internal_host != NULL ? internal_host : "");
+}
+
+static void
+mapping_store_index_host (UrcMappingStore *store,
+                          PortForwardInfo *port_info)
+{
+    const gchar *host = port_info->internal_host != NULL ? port_info->internal_host : "";
+    GPtrArray *mappings;
+
+    mappings = g_hash_table_lookup (store->by_host, host);
+
+    if (mappings == NULL) {
+        mappings = g_ptr_array_new ();
+        g_hash_table_insert (store->by_host, g_strdup (host), mappings);
+    }
+
+    g_ptr_array_add (mappings, port_info);
+}
+
+static void
+mapping_store_unindex_host (UrcMappingStore *store,
+                            PortForwardInfo *port_info)
+{
+    const gchar *host = port_info->internal_host != NULL ? port_info->internal_host : "";
+    GPtrArray *mappings;
+
+    mappings = g_hash_table_lookup (store->by_host, host);
+    if (mappings == NULL)
+        return;
+
+    g_ptr_array_remove_fast (mappings, port_info);
+
+    if (mappings->len == 0)
+        g_hash_table_remove (store->by_host, host);
+}
+
+/* Add or replace a mapping, "port_info" is taken.
+ * Returns FALSE when an equal mapping was already stored. */
+gboolean
+urc_mapping_store_insert (UrcMappingStore *store,
+                          PortForwardInfo *port_info)
+{
+    PortForwardInfo *cached;
+    gchar *key;
+
+    key = port_forward_info_key (port_info);
+    cached = g_hash_table_lookup (store->by_key, key);
+
+    if (cached != NULL) {
+
+        if (port_forward_info_equal (cached, port_info)) {
+            /* keep the stored pointer, it may be referenced */
+            cached->lease_time = port_info->lease_time;
+            port_forward_info_free (port_info);
+            g_free (key);
+            return FALSE;
+        }
+
+        mapping_store_unindex_host (store, cached);
+    }
+
+    g_hash_table_replace (store->by_key, key, port_info);
+    mapping_store_index_host (store, port_info);
+
+    return TRUE;
+}
+
+gboolean
+urc_mapping_store_remove (UrcMappingStore *store,
+                          const gchar     *remote_host,
+                          guint            external_port,
+                          const gchar     *protocol)
+{
+    PortForwardInfo *cached;
+    gboolean removed;
+    gchar *key;
+
+    key = urc_mapping_key (remote_host, external_port, protocol);
+    cached = g_hash_table_lookup (store->by_key, key);
+
+    if (cached != NULL)
+        mapping_store_unindex_host (store, cached);
+
+    removed = g_hash_table_remove (store->by_key, key);
+    g_free (key);
+
+    return removed;
+}
+
+void
+urc_mapping_store_clear (UrcMappingStore *store)
+{
+    g_hash_table_remove_all (store->by_host);
+    g_hash_table_remove_all (store->by_key);
+}
+
+/* Replace the store content with a full table read, "entries" is taken.
+ * Entries equal to the stored ones are dropped, so pointers held by
+ * the caller from a previous update stay valid. */
+void
+urc_mapping_store_update (UrcMappingStore *store,
+                          GPtrArray       *entries,
+                          UrcMappingDiff  *diff)
+{
+    GHashTable *next;
+    GHashTableIter iter;
+    PortForwardInfo *port_info;
+    PortForwardInfo *cached;
+    gchar *key;
+    guint i;
+
+    diff->added = g_ptr_array_new ();
+    diff->changed = g_ptr_array_new ();
+    diff->removed = g_ptr_array_new_with_free_func ((GDestroyNotify) port_forward_info_free);
+
+    next = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    g_ptr_array_set_free_func (entries, NULL);
+
+    for (i = 0; i < entries->len; i++) {
+        port_info = g_ptr_array_index (entries, i);
+        key = port_forward_info_key (port_info);
+
+        /* some routers list the same mapping twice */
+        if (g_hash_table_contains (next, key)) {
+            port_forward_info_free (port_info);
+            g_free (key);
+        }
+        else
+            g_hash_table_insert (next, key, port_info);
+    }
+
+    g_ptr_array_unref (entries);
+
+    /* gone since the last read */
+    g_hash_table_iter_init (&iter, store->by_key);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &key, (gpointer *) &cached)) {
+
+        if (!g_hash_table_contains (next, key)) {
+            mapping_store_unindex_host (store, cached);
+            g_hash_table_iter_steal (&iter);
+            g_ptr_array_add (diff->removed, cached);
+            g_free (key);
+        }
+    }
+
+    g_hash_table_iter_init (&iter, next);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &port_info)) {
+
+        cached = urc_mapping_store_lookup (store, port_info->remote_host,
+                                           port_info->external_port, port_info->protocol);
+
+        if (urc_mapping_store_insert (store, port_info))
+            g_ptr_array_add (cached == NULL ? diff->added : diff->changed, port_info);
+    }
+
+    g_hash_table_unref (next);
+
+    g_ptr_array_sort (diff->added, port_forward_info_cmp);
+}
+
+void
+urc_mapping_diff_clear (UrcMappingDiff *diff)
+{
+    g_clear_pointer (&diff->added, g_ptr_array_unref);
+    g_clear_pointer (&diff->removed, g_ptr_array_unref);
+    g_clear_pointer (&diff->changed, g_ptr_array_unref);
+}
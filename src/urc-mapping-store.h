@@ -0,0 +1,93 @@
+/* urc-mapping-store.h
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __URC_MAPPING_STORE_H__
+#define __URC_MAPPING_STORE_H__
+
+#include <glib.h>
+
+#include "urc-upnp.h"
+
+/* Port mappings known for a router. The primary index is keyed by
+ * (remote host, external port, protocol), the triple DeletePortMapping
+ * takes; a secondary index groups the mappings by internal host. */
+typedef struct _UrcMappingStore UrcMappingStore;
+
+/* Changes between two reads of the mapping table. "added" and "changed"
+ * point into the store, "removed" owns the entries dropped from it. */
+typedef struct
+{
+    GPtrArray *added;
+    GPtrArray *removed;
+    GPtrArray *changed;
+
+} UrcMappingDiff;
+
+gchar*
+urc_mapping_key (const gchar *remote_host,
+                 guint        external_port,
+                 const gchar *protocol);
+
+UrcMappingStore*
+urc_mapping_store_new (void);
+
+void
+urc_mapping_store_free (UrcMappingStore *store);
+
+guint
+urc_mapping_store_size (UrcMappingStore *store);
+
+void
+urc_mapping_store_foreach (UrcMappingStore *store,
+                           GFunc            func,
+                           gpointer         user_data);
+
+PortForwardInfo*
+urc_mapping_store_lookup (UrcMappingStore *store,
+                          const gchar     *remote_host,
+                          guint            external_port,
+                          const gchar     *protocol);
+
+const GPtrArray*
+urc_mapping_store_lookup_by_host (UrcMappingStore *store,
+                                  const gchar     *internal_host);
+
+gboolean
+urc_mapping_store_insert (UrcMappingStore *store,
+                          PortForwardInfo *port_info);
+
+gboolean
+urc_mapping_store_remove (UrcMappingStore *store,
+                          const gchar     *remote_host,
+                          guint            external_port,
+                          const gchar     *protocol);
+
+void
+urc_mapping_store_clear (UrcMappingStore *store);
+
+void
+urc_mapping_store_update (UrcMappingStore *store,
+                          GPtrArray       *entries,
+                          UrcMappingDiff  *diff);
+
+void
+urc_mapping_diff_clear (UrcMappingDiff *diff);
+
+#endif /* __URC_MAPPING_STORE_H__ */
@@ -0,0 +1,890 @@
+/* urc-mapping.c
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include <libgupnp/gupnp.h>
+
+#include "urc-action.h"
+#include "urc-mapping.h"
+
+extern gboolean opt_debug;
+
+/* Windowed GetGenericPortMappingEntry enumeration.
+ *
+ * Up to "window" indexes are requested at once, the replies are stored
+ * by index and delivered in order when the end of the table is found:
+ * error 713, 714 or 402, or any other SOAP fault past the last entry
+ * read, as the routers end it in many ways. A transport error is not
+ * the end: the index is asked again, up to URC_MAPPING_RETRIES times,
+ * then the enumeration fails, as it does on a fault within the entries
+ * read. The window starts from a single request and grows
+ * on every valid entry, so an empty table costs one round-trip only. */
+typedef struct
+{
+    GUPnPServiceProxy *wan_service;
+    GCancellable *cancellable;
+
+    guint window;
+    guint cur_window;
+    guint next_index;
+    guint end_index;
+    guint in_flight;
+
+    /* PortForwardInfo by index, NULL until the reply arrives */
+    GPtrArray *slots;
+
+    GError *error;
+    gboolean cancelled;
+
+    gint64 start_time;
+
+    UrcMappingListCallback callback;
+    gpointer user_data;
+
+} MappingEnum;
+
+typedef struct
+{
+    MappingEnum *enumeration;
+    guint index;
+    guint attempt;
+
+} MappingEnumRequest;
+
+static void mapping_enum_fill (MappingEnum *enumeration);
+static void mapping_enum_request (MappingEnum *enumeration, guint index, guint attempt);
+
+static void
+mapping_enum_free (MappingEnum *enumeration)
+{
+    g_ptr_array_unref (enumeration->slots);
+    g_clear_object (&enumeration->cancellable);
+    g_object_unref (enumeration->wan_service);
+
+    if (enumeration->error != NULL)
+        g_error_free (enumeration->error);
+
+    g_free (enumeration);
+}
+
+static void
+mapping_enum_finish (MappingEnum *enumeration)
+{
+    GPtrArray *entries;
+    PortForwardInfo *port;
+    gdouble elapsed;
+    guint i;
+
+    /* nobody is waiting for the result */
+    if (enumeration->cancelled) {
+        mapping_enum_free (enumeration);
+        return;
+    }
+
+    entries = g_ptr_array_new_with_free_func ((GDestroyNotify) port_forward_info_free);
+
+    for (i = 0; i < enumeration->end_index && i < enumeration->slots->len; i++) {
+
+        port = g_ptr_array_index (enumeration->slots, i);
+        g_ptr_array_index (enumeration->slots, i) = NULL;
+
+        if (port == NULL)
+            continue;
+
+        if (port->external_port > 0)
+            g_ptr_array_add (entries, port);
+        else
+            port_forward_info_free (port);
+    }
+
+    if (opt_debug) {
+        elapsed = ((double) g_get_monotonic_time () - enumeration->start_time) / G_USEC_PER_SEC;
+
+        g_print ("\e[34mGetGenericPortMappingEntry: %u entries in %fs (%.1f entries/s, window %u)\e[0m\n",
+                 entries->len,
+                 elapsed,
+                 elapsed > 0 ? entries->len / elapsed : 0.0,
+                 enumeration->window);
+    }
+
+    enumeration->callback (entries, enumeration->error, enumeration->user_data);
+
+    mapping_enum_free (enumeration);
+}
+
+static void
+mapping_enum_request_cb (GUPnPServiceProxyAction *action,
+                         GError                  *error,
+                         const UrcActionInfo     *info,
+                         gpointer                 user_data)
+{
+    MappingEnumRequest *request = (MappingEnumRequest *) user_data;
+    MappingEnum *enumeration = request->enumeration;
+    guint index = request->index;
+    guint attempt = request->attempt;
+    PortForwardInfo *port = NULL;
+    gboolean transport;
+
+    g_free (request);
+    enumeration->in_flight--;
+
+    if (urc_action_cancelled (error)) {
+        enumeration->cancelled = TRUE;
+        goto next;
+    }
+
+    /* no answer, the ones below are SOAP faults */
+    transport = error != NULL;
+
+    if (error == NULL) {
+
+        port = g_malloc0 (sizeof (PortForwardInfo));
+
+        gupnp_service_proxy_action_get_result (action,
+                       /* Error location */
+                       &error,
+                       /* OUT args */
+                       "NewRemoteHost",
+                       G_TYPE_STRING, &port->remote_host,
+                       "NewExternalPort",
+                       G_TYPE_UINT, &port->external_port,
+                       "NewProtocol",
+                       G_TYPE_STRING, &port->protocol,
+                       "NewInternalPort",
+                       G_TYPE_UINT, &port->internal_port,
+                       "NewInternalClient",
+                       G_TYPE_STRING, &port->internal_host,
+                       "NewEnabled",
+                       G_TYPE_BOOLEAN, &port->enabled,
+                       "NewPortMappingDescription",
+                       G_TYPE_STRING, &port->description,
+                       "NewLeaseDuration",
+                       G_TYPE_UINT, &port->lease_time,
+                       NULL);
+    }
+
+    if (error != NULL) {
+
+        port_forward_info_free (port);
+
+        // error 713: end of ports array
+        // error 714: no such entry in array
+        // error 402: invalid args
+        if (!transport &&
+            (error->code == 713 || error->code == 714 || error->code == 402 ||
+             index >= enumeration->slots->len)) {
+            /* nothing after this index is taken */
+            enumeration->end_index = MIN (enumeration->end_index, index);
+        }
+        else if (transport && attempt < URC_MAPPING_RETRIES && enumeration->error == NULL) {
+            if (opt_debug)
+                g_print ("\e[33m[WW]\e[0m GetGenericPortMappingEntry %u: %s (%i), retrying\n", index, error->message, error->code);
+
+            mapping_enum_request (enumeration, index, attempt + 1);
+        }
+        else {
+            g_printerr ("\e[31m[EE]\e[0m GetGenericPortMappingEntry: %s (%i)\n", error->message, error->code);
+
+            if (enumeration->error == NULL)
+                enumeration->error = g_error_copy (error);
+        }
+
+        g_error_free (error);
+    }
+    else {
+        if (index >= enumeration->slots->len)
+            g_ptr_array_set_size (enumeration->slots, index + 1);
+
+        g_ptr_array_index (enumeration->slots, index) = port;
+
+        /* the table is not empty, open the window */
+        enumeration->cur_window = MIN (enumeration->cur_window * 2, enumeration->window);
+    }
+
+    next:
+    if (!enumeration->cancelled && enumeration->error == NULL)
+        mapping_enum_fill (enumeration);
+
+    /* no more requests to send and all the replies are back */
+    if (enumeration->in_flight == 0)
+        mapping_enum_finish (enumeration);
+}
+
+static void
+mapping_enum_request (MappingEnum *enumeration,
+                      guint        index,
+                      guint        attempt)
+{
+    GUPnPServiceProxyAction *action;
+    MappingEnumRequest *request;
+
+    request = g_malloc (sizeof (MappingEnumRequest));
+    request->enumeration = enumeration;
+    request->index = index;
+    request->attempt = attempt;
+
+    action = gupnp_service_proxy_action_new(
+                "GetGenericPortMappingEntry",
+                /* IN args */
+                "NewPortMappingIndex",
+                G_TYPE_UINT, index,
+                NULL
+    );
+
+    enumeration->in_flight++;
+
+    urc_action_call (enumeration->wan_service,
+                     "GetGenericPortMappingEntry",
+                     action,
+                     enumeration->cancellable,
+                     mapping_enum_request_cb,
+                     request);
+}
+
+/* Keep the window full until the end of the table is known */
+static void
+mapping_enum_fill (MappingEnum *enumeration)
+{
+    while (enumeration->in_flight < enumeration->cur_window &&
+           enumeration->next_index < enumeration->end_index)
+    {
+        mapping_enum_request (enumeration, enumeration->next_index, 0);
+        enumeration->next_index++;
+    }
+}
+
+void
+urc_mapping_enumerate (GUPnPServiceProxy      *wan_service,
+                       guint                   window,
+                       GCancellable           *cancellable,
+                       UrcMappingListCallback  callback,
+                       gpointer                user_data)
+{
+    MappingEnum *enumeration;
+
+    enumeration = g_malloc0 (sizeof (MappingEnum));
+
+    enumeration->wan_service = g_object_ref (wan_service);
+    enumeration->cancellable = cancellable != NULL ? g_object_ref (cancellable) : NULL;
+    enumeration->window = MAX (window, 1);
+    enumeration->cur_window = 1;
+    enumeration->next_index = 0;
+    enumeration->end_index = G_MAXUINT;
+    enumeration->in_flight = 0;
+    enumeration->slots = g_ptr_array_new_with_free_func ((GDestroyNotify) port_forward_info_free);
+    enumeration->error = NULL;
+    enumeration->cancelled = FALSE;
+    enumeration->start_time = g_get_monotonic_time ();
+    enumeration->callback = callback;
+    enumeration->user_data = user_data;
+
+    mapping_enum_fill (enumeration);
+}
+
+/* IGDv2 GetListOfPortMappings.
+ *
+ * The table is read per protocol in chunks of URC_MAPPING_LIST_CHUNK
+ * ports, TCP and UDP chains run in parallel. A full chunk means there
+ * may be more entries after its last port. Routers which advertise
+ * WANIPConnection:2 but fail the action are enumerated per index. */
+typedef struct
+{
+    RouterInfo *router;
+    GUPnPServiceProxy *wan_service;
+    GCancellable *cancellable;
+    guint window;
+
+    /* TCP and UDP entries */
+    GPtrArray *entries[2];
+    guint pending;
+    guint round_trips;
+
+    gboolean cancelled;
+    gboolean fallback;
+
+    gint64 start_time;
+
+    UrcMappingListCallback callback;
+    gpointer user_data;
+
+} MappingBulk;
+
+typedef struct
+{
+    MappingBulk *bulk;
+    guint proto;
+    guint start_port;
+
+} MappingBulkRequest;
+
+static const gchar *mapping_bulk_protocols[] = { "TCP", "UDP" };
+
+typedef struct
+{
+    GPtrArray *entries;
+    PortForwardInfo *current;
+    GString *text;
+
+} PortListingParser;
+
+/* element names come with the namespace prefix, e.g. "p:NewProtocol" */
+static const gchar*
+port_listing_local_name (const gchar *element_name)
+{
+    const gchar *local;
+
+    local = strrchr (element_name, ':');
+
+    return local != NULL ? local + 1 : element_name;
+}
+
+static void
+port_listing_start_element (GMarkupParseContext  *context,
+                            const gchar          *element_name,
+                            const gchar         **attribute_names,
+                            const gchar         **attribute_values,
+                            gpointer              user_data,
+                            GError              **error)
+{
+    PortListingParser *parser = (PortListingParser *) user_data;
+
+    if (g_strcmp0 (port_listing_local_name (element_name), "PortMappingEntry") == 0) {
+        port_forward_info_free (parser->current);
+        parser->current = g_malloc0 (sizeof (PortForwardInfo));
+    }
+
+    g_string_truncate (parser->text, 0);
+}
+
+static void
+port_listing_text (GMarkupParseContext  *context,
+                   const gchar          *text,
+                   gsize                 text_len,
+                   gpointer              user_data,
+                   GError              **error)
+{
+    PortListingParser *parser = (PortListingParser *) user_data;
+
+    g_string_append_len (parser->text, text, text_len);
+}
+
+static void
+port_listing_end_element (GMarkupParseContext  *context,
+                          const gchar          *element_name,
+                          gpointer              user_data,
+                          GError              **error)
+{
+    PortListingParser *parser = (PortListingParser *) user_data;
+    PortForwardInfo *port = parser->current;
+    const gchar *name;
+    gchar *value;
+
+    if (port == NULL)
+        return;
+
+    name = port_listing_local_name (element_name);
+    value = g_strstrip (parser->text->str);
+
+    if (g_strcmp0 (name, "NewRemoteHost") == 0)
+        port->remote_host = g_strdup (value);
+    else if (g_strcmp0 (name, "NewExternalPort") == 0)
+        port->external_port = (guint) g_ascii_strtoull (value, NULL, 10);
+    else if (g_strcmp0 (name, "NewProtocol") == 0)
+        port->protocol = g_ascii_strup (value, -1);
+    else if (g_strcmp0 (name, "NewInternalPort") == 0)
+        port->internal_port = (guint) g_ascii_strtoull (value, NULL, 10);
+    else if (g_strcmp0 (name, "NewInternalClient") == 0)
+        port->internal_host = g_strdup (value);
+    else if (g_strcmp0 (name, "NewEnabled") == 0)
+        port->enabled = g_strcmp0 (value, "1") == 0 || g_ascii_strcasecmp (value, "true") == 0 || g_ascii_strcasecmp (value, "yes") == 0;
+    else if (g_strcmp0 (name, "NewDescription") == 0)
+        port->description = g_strdup (value);
+    else if (g_strcmp0 (name, "NewLeaseTime") == 0)
+        port->lease_time = (guint) g_ascii_strtoull (value, NULL, 10);
+    else if (g_strcmp0 (name, "PortMappingEntry") == 0) {
+
+        if (port->protocol != NULL && port->external_port > 0) {
+            if (port->remote_host == NULL)
+                port->remote_host = g_strdup ("");
+
+            g_ptr_array_add (parser->entries, port);
+        }
+        else
+            port_forward_info_free (port);
+
+        parser->current = NULL;
+    }
+
+    g_string_truncate (parser->text, 0);
+}
+
+static const GMarkupParser port_listing_parser =
+{
+    port_listing_start_element,
+    port_listing_end_element,
+    port_listing_text,
+    NULL,
+    NULL
+};
+
+/* Parse the NewPortListing XML document, appending the entries */
+static gboolean
+port_listing_parse (const gchar  *listing,
+                    GPtrArray    *entries,
+                    GError      **error)
+{
+    GMarkupParseContext *context;
+    PortListingParser parser;
+    gboolean ret;
+
+    parser.entries = entries;
+    parser.current = NULL;
+    parser.text = g_string_new (NULL);
+
+    context = g_markup_parse_context_new (&port_listing_parser, G_MARKUP_TREAT_CDATA_AS_TEXT, &parser, NULL);
+
+    ret = g_markup_parse_context_parse (context, listing, -1, error) &&
+          g_markup_parse_context_end_parse (context, error);
+
+    g_markup_parse_context_free (context);
+    port_forward_info_free (parser.current);
+    g_string_free (parser.text, TRUE);
+
+    return ret;
+}
+
+static gint
+port_forward_info_cmp_port (gconstpointer a,
+                            gconstpointer b)
+{
+    const PortForwardInfo *port_a = *((PortForwardInfo **) a);
+    const PortForwardInfo *port_b = *((PortForwardInfo **) b);
+
+    return (gint) port_a->external_port - (gint) port_b->external_port;
+}
+
+static void
+mapping_bulk_free (MappingBulk *bulk)
+{
+    g_ptr_array_unref (bulk->entries[0]);
+    g_ptr_array_unref (bulk->entries[1]);
+    g_clear_object (&bulk->cancellable);
+    g_object_unref (bulk->wan_service);
+    g_free (bulk);
+}
+
+static void
+mapping_bulk_finish (MappingBulk *bulk)
+{
+    GPtrArray *entries;
+    gdouble elapsed;
+    guint proto, i;
+
+    if (bulk->cancelled) {
+        mapping_bulk_free (bulk);
+        return;
+    }
+
+    if (bulk->fallback) {
+        if (bulk->router->caps & URC_CAP_LIST_OF_MAPPINGS)
+            g_print ("\e[33m[WW]\e[0m GetListOfPortMappings got no answer, listing by index\n");
+        else
+            g_print ("\e[33m[WW]\e[0m GetListOfPortMappings not usable, listing by index from now on\n");
+
+        urc_mapping_enumerate (bulk->wan_service, bulk->window, bulk->cancellable,
+                               bulk->callback, bulk->user_data);
+        mapping_bulk_free (bulk);
+        return;
+    }
+
+    entries = g_ptr_array_new_with_free_func ((GDestroyNotify) port_forward_info_free);
+
+    for (proto = 0; proto < 2; proto++) {
+
+        g_ptr_array_sort (bulk->entries[proto], port_forward_info_cmp_port);
+
+        for (i = 0; i < bulk->entries[proto]->len; i++)
+            g_ptr_array_add (entries, g_ptr_array_index (bulk->entries[proto], i));
+
+        /* ownership moved to the result */
+        g_ptr_array_set_free_func (bulk->entries[proto], NULL);
+    }
+
+    if (opt_debug) {
+        elapsed = ((double) g_get_monotonic_time () - bulk->start_time) / G_USEC_PER_SEC;
+
+        g_print ("\e[34mGetListOfPortMappings: %u entries in %fs (%u round-trips)\e[0m\n",
+                 entries->len, elapsed, bulk->round_trips);
+    }
+
+    bulk->callback (entries, NULL, bulk->user_data);
+
+    mapping_bulk_free (bulk);
+}
+
+static void mapping_bulk_request (MappingBulk *bulk, guint proto, guint start_port);
+
+static void
+mapping_bulk_request_cb (GUPnPServiceProxyAction *action,
+                         GError                  *error,
+                         const UrcActionInfo     *info,
+                         gpointer                 user_data)
+{
+    MappingBulkRequest *request = (MappingBulkRequest *) user_data;
+    MappingBulk *bulk = request->bulk;
+    guint proto = request->proto;
+    guint start_port = request->start_port;
+    gchar *listing = NULL;
+    guint count, last_port;
+    gboolean transport;
+
+    g_free (request);
+    bulk->round_trips++;
+
+    if (urc_action_cancelled (error)) {
+        bulk->cancelled = TRUE;
+        goto done;
+    }
+
+    transport = error != NULL;
+
+    if (error == NULL) {
+        gupnp_service_proxy_action_get_result (action,
+                       /* Error location */
+                       &error,
+                       /* OUT args */
+                       "NewPortListing",
+                       G_TYPE_STRING, &listing,
+                       NULL);
+    }
+
+    if (error != NULL) {
+
+        // error 730: no entries in the requested range
+        if (error->code != 730) {
+            g_printerr ("\e[31m[EE]\e[0m GetListOfPortMappings: %s (%i)\n", error->message, error->code);
+
+            // any fault (401 invalid action, 602 not implemented, 606
+            // not authorized...) will come again: stop asking until the
+            // router is bound again, no answer may be a one-off
+            if (!transport)
+                bulk->router->caps &= ~URC_CAP_LIST_OF_MAPPINGS;
+
+            bulk->fallback = TRUE;
+        }
+
+        g_error_free (error);
+        goto done;
+    }
+
+    count = bulk->entries[proto]->len;
+
+    if (listing == NULL || !port_listing_parse (listing, bulk->entries[proto], &error)) {
+        g_printerr ("\e[31m[EE]\e[0m GetListOfPortMappings: invalid NewPortListing: %s\n",
+                    error != NULL ? error->message : "empty");
+        g_clear_error (&error);
+
+        bulk->router->caps &= ~URC_CAP_LIST_OF_MAPPINGS;
+        bulk->fallback = TRUE;
+        g_free (listing);
+        goto done;
+    }
+
+    g_free (listing);
+    count = bulk->entries[proto]->len - count;
+
+    /* a full chunk, ask for the ports after the last one */
+    if (count >= URC_MAPPING_LIST_CHUNK && !bulk->fallback) {
+
+        last_port = ((PortForwardInfo *) g_ptr_array_index (bulk->entries[proto],
+                                                            bulk->entries[proto]->len - 1))->external_port;
+
+        if (last_port >= start_port && last_port < G_MAXUINT16) {
+            mapping_bulk_request (bulk, proto, last_port + 1);
+            return;
+        }
+    }
+
+    done:
+    bulk->pending--;
+
+    if (bulk->pending == 0)
+        mapping_bulk_finish (bulk);
+}
+
+static void
+mapping_bulk_request (MappingBulk *bulk,
+                      guint        proto,
+                      guint        start_port)
+{
+    GUPnPServiceProxyAction *action;
+    MappingBulkRequest *request;
+
+    request = g_malloc (sizeof (MappingBulkRequest));
+    request->bulk = bulk;
+    request->proto = proto;
+    request->start_port = start_port;
+
+    action = gupnp_service_proxy_action_new(
+                "GetListOfPortMappings",
+                /* IN args */
+                "NewStartPort",
+                G_TYPE_UINT, start_port,
+                "NewEndPort",
+                G_TYPE_UINT, G_MAXUINT16,
+                "NewProtocol",
+                G_TYPE_STRING, mapping_bulk_protocols[proto],
+                "NewManage",
+                G_TYPE_BOOLEAN, TRUE,
+                "NewNumberOfPorts",
+                G_TYPE_UINT, URC_MAPPING_LIST_CHUNK,
+                NULL
+    );
+
+    urc_action_call (bulk->wan_service,
+                     "GetListOfPortMappings",
+                     action,
+                     bulk->cancellable,
+                     mapping_bulk_request_cb,
+                     request);
+}
+
+void
+urc_mapping_list_bulk (RouterInfo             *router,
+                       guint                   window,
+                       GCancellable           *cancellable,
+                       UrcMappingListCallback  callback,
+                       gpointer                user_data)
+{
+    MappingBulk *bulk;
+    guint proto;
+
+    bulk = g_malloc0 (sizeof (MappingBulk));
+
+    bulk->router = router;
+    bulk->wan_service = g_object_ref (router->wan_conn_service);
+    bulk->cancellable = cancellable != NULL ? g_object_ref (cancellable) : NULL;
+    bulk->window = window;
+    bulk->entries[0] = g_ptr_array_new_with_free_func ((GDestroyNotify) port_forward_info_free);
+    bulk->entries[1] = g_ptr_array_new_with_free_func ((GDestroyNotify) port_forward_info_free);
+    bulk->pending = 2;
+    bulk->round_trips = 0;
+    bulk->cancelled = FALSE;
+    bulk->fallback = FALSE;
+    bulk->start_time = g_get_monotonic_time ();
+    bulk->callback = callback;
+    bulk->user_data = user_data;
+
+    for (proto = 0; proto < 2; proto++)
+        mapping_bulk_request (bulk, proto, 1);
+}
+
+/* Read the whole mapping table with the cheapest method the router has */
+void
+urc_mapping_fetch (RouterInfo             *router,
+                   guint                   window,
+                   GCancellable           *cancellable,
+                   UrcMappingListCallback  callback,
+                   gpointer                user_data)
+{
+    if (router->wan_conn_version >= 2 && (router->caps & URC_CAP_LIST_OF_MAPPINGS))
+        urc_mapping_list_bulk (router, window, cancellable, callback, user_data);
+    else
+        urc_mapping_enumerate (router->wan_conn_service, window, cancellable, callback, user_data);
+}
+
+
+/* Batch add/delete.
+ *
+ * The entries go through add_port_mapping()/delete_port_mapped() with
+ * at most "concurrency" of them pending, each one is verified and
+ * applied to the store as a single request would be. */
+typedef struct
+{
+    RouterInfo *router;
+    gboolean delete;
+
+    UrcMappingResult *results;
+    guint n_results;
+    guint next;
+    guint in_flight;
+    guint concurrency;
+
+    /* the router went away, its pointer must not be used anymore */
+    gboolean cancelled;
+
+    gint64 start_time;
+
+    UrcMappingBatchCallback callback;
+    gpointer user_data;
+
+} MappingBatch;
+
+typedef struct
+{
+    MappingBatch *batch;
+    guint index;
+
+} MappingBatchEntry;
+
+static void mapping_batch_fill (MappingBatch *batch);
+
+static void
+mapping_batch_finish (MappingBatch *batch)
+{
+    guint i, failed = 0;
+
+    for (i = 0; i < batch->n_results; i++) {
+        if (batch->results[i].error != NULL)
+            failed++;
+    }
+
+    if (opt_debug)
+        g_print ("\e[34m%s batch: %u entries, %u failed in %fs\e[0m\n",
+                 batch->delete ? "DeletePortMapping" : "AddPortMapping",
+                 batch->n_results, failed,
+                 ((double) g_get_monotonic_time () - batch->start_time) / G_USEC_PER_SEC);
+
+    if (batch->callback != NULL)
+        batch->callback (batch->results, batch->n_results, batch->user_data);
+
+    for (i = 0; i < batch->n_results; i++) {
+        port_forward_info_free (batch->results[i].port_info);
+        g_clear_error (&batch->results[i].error);
+    }
+
+    g_free (batch->results);
+    g_free (batch);
+}
+
+static void
+mapping_batch_entry_done (PortForwardInfo *port_info,
+                          const GError    *error,
+                          gpointer         user_data)
+{
+    MappingBatchEntry *entry = (MappingBatchEntry *) user_data;
+    MappingBatch *batch = entry->batch;
+
+    if (error != NULL) {
+        batch->results[entry->index].error = g_error_copy (error);
+
+        if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            batch->cancelled = TRUE;
+    }
+
+    g_free (entry);
+    batch->in_flight--;
+
+    mapping_batch_fill (batch);
+}
+
+static void
+mapping_batch_fill (MappingBatch *batch)
+{
+    MappingBatchEntry *entry;
+    PortForwardInfo *port_info;
+
+    while (!batch->cancelled && batch->next < batch->n_results &&
+           batch->in_flight < batch->concurrency) {
+
+        entry = g_malloc (sizeof (MappingBatchEntry));
+        entry->batch = batch;
+        entry->index = batch->next++;
+
+        port_info = batch->results[entry->index].port_info;
+        batch->in_flight++;
+
+        if (batch->delete)
+            delete_port_mapped (batch->router,
+                                port_info->protocol,
+                                port_info->external_port,
+                                port_info->remote_host,
+                                mapping_batch_entry_done,
+                                entry);
+        else
+            add_port_mapping (batch->router, port_info, mapping_batch_entry_done, entry);
+    }
+
+    if (batch->in_flight > 0)
+        return;
+
+    /* entries never sent */
+    for (; batch->next < batch->n_results; batch->next++)
+        g_set_error_literal (&batch->results[batch->next].error,
+                             G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                             "Operation was cancelled");
+
+    mapping_batch_finish (batch);
+}
+
+static void
+mapping_batch_start (RouterInfo              *router,
+                     gboolean                 delete,
+                     GPtrArray               *entries,
+                     guint                    concurrency,
+                     UrcMappingBatchCallback  callback,
+                     gpointer                 user_data)
+{
+    MappingBatch *batch;
+    guint i;
+
+    batch = g_malloc0 (sizeof (MappingBatch));
+
+    batch->router = router;
+    batch->delete = delete;
+    batch->n_results = entries->len;
+    batch->results = g_new0 (UrcMappingResult, entries->len);
+    batch->concurrency = MAX (concurrency, 1);
+    batch->start_time = g_get_monotonic_time ();
+    batch->callback = callback;
+    batch->user_data = user_data;
+
+    for (i = 0; i < entries->len; i++)
+        batch->results[i].port_info = port_forward_info_copy (g_ptr_array_index (entries, i));
+
+    mapping_batch_fill (batch);
+}
+
+/* Add the PortForwardInfo in "entries", the caller keeps the array */
+void
+urc_mapping_add_batch (RouterInfo              *router,
+                       GPtrArray               *entries,
+                       guint                    concurrency,
+                       UrcMappingBatchCallback  callback,
+                       gpointer                 user_data)
+{
+    mapping_batch_start (router, FALSE, entries, concurrency, callback, user_data);
+}
+
+/* Delete the mappings in "entries", only the remote host, external
+ * port and protocol are used. The caller keeps the array. */
+void
+urc_mapping_delete_batch (RouterInfo              *router,
+                          GPtrArray               *entries,
+                          guint                    concurrency,
+                          UrcMappingBatchCallback  callback,
+                          gpointer                 user_data)
+{
+    mapping_batch_start (router, TRUE, entries, concurrency, callback, user_data);
+}
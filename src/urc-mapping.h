@@ -0,0 +1,99 @@
+/* urc-mapping.h
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __URC_MAPPING_H__
+#define __URC_MAPPING_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <libgupnp/gupnp.h>
+
+#include "urc-upnp.h"
+
+/* Default number of GetGenericPortMappingEntry requests in flight */
+#define URC_MAPPING_DEFAULT_WINDOW 8
+
+/* Times a GetGenericPortMappingEntry getting no answer is sent again */
+#define URC_MAPPING_RETRIES 2
+
+/* Ports requested per GetListOfPortMappings call */
+#define URC_MAPPING_LIST_CHUNK 1000
+
+/* AddPortMapping/DeletePortMapping requests in flight for a batch */
+#define URC_MAPPING_BATCH_CONCURRENCY 4
+
+/* Enumeration result: "entries" holds the PortForwardInfo in index order
+ * and is owned by the callback. "error" is set when the enumeration was
+ * interrupted before the end of the table, the entries fetched so far
+ * are still delivered but are not the whole table. */
+typedef void (*UrcMappingListCallback) (GPtrArray    *entries,
+                                        const GError *error,
+                                        gpointer      user_data);
+
+void
+urc_mapping_enumerate (GUPnPServiceProxy      *wan_service,
+                       guint                   window,
+                       GCancellable           *cancellable,
+                       UrcMappingListCallback  callback,
+                       gpointer                user_data);
+
+void
+urc_mapping_list_bulk (RouterInfo             *router,
+                       guint                   window,
+                       GCancellable           *cancellable,
+                       UrcMappingListCallback  callback,
+                       gpointer                user_data);
+
+void
+urc_mapping_fetch (RouterInfo             *router,
+                   guint                   window,
+                   GCancellable           *cancellable,
+                   UrcMappingListCallback  callback,
+                   gpointer                user_data);
+
+/* Outcome of one batch entry, "error" is NULL on success */
+typedef struct
+{
+    PortForwardInfo *port_info;
+    GError *error;
+
+} UrcMappingResult;
+
+/* Batch result: one UrcMappingResult per entry, in the request order.
+ * The results are freed after the callback returns. */
+typedef void (*UrcMappingBatchCallback) (const UrcMappingResult *results,
+                                         guint                   n_results,
+                                         gpointer                user_data);
+
+void
+urc_mapping_add_batch (RouterInfo              *router,
+                       GPtrArray               *entries,
+                       guint                    concurrency,
+                       UrcMappingBatchCallback  callback,
+                       gpointer                 user_data);
+
+void
+urc_mapping_delete_batch (RouterInfo              *router,
+                          GPtrArray               *entries,
+                          guint                    concurrency,
+                          UrcMappingBatchCallback  callback,
+                          gpointer                 user_data);
+
+#endif /* __URC_MAPPING_H__ */
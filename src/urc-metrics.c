@@ -0,0 +1,538 @@
+/* urc-metrics.c
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+#include <libsoup/soup.h>
+
+#include "urc-doc-cache.h"
+#include "urc-http.h"
+#include "urc-metrics.h"
+
+/* OpenMetrics endpoint on the loopback interface.
+ *
+ * The poller updates an in-memory snapshot as its replies come in and
+ * a scrape only formats it: no SOAP request is made for a scrape, and
+ * its cost depends on the number of series, not on how often it runs. */
+
+static const gdouble latency_bounds[] = URC_METRICS_LATENCY_BUCKETS;
+
+#define N_LATENCY_BUCKETS G_N_ELEMENTS (latency_bounds)
+
+/* SOAP latency of one action */
+typedef struct
+{
+    guint64 buckets[G_N_ELEMENTS (latency_bounds)];
+    guint64 count;
+    guint64 failed;
+    gdouble sum;
+} ActionLatency;
+
+/* Last values of one router */
+typedef struct
+{
+    gchar *udn;
+    gchar *friendly_name;
+
+    gboolean have_received, have_sent;
+    guint64 received_total, sent_total;
+    gdouble received_rate, sent_rate;
+
+    gboolean have_connection;
+    gboolean connected;
+
+    /* uptime as read, and when (monotonic) */
+    gboolean have_uptime;
+    guint uptime;
+    gint64 uptime_time;
+
+    gboolean have_port_mappings;
+    guint port_mappings;
+
+} RouterMetrics;
+
+typedef struct
+{
+    SoupServer *server;
+
+    /* UDN -> RouterMetrics */
+    GHashTable *routers;
+
+    /* action name -> ActionLatency */
+    GHashTable *latencies;
+
+} UrcMetrics;
+
+static UrcMetrics metrics;
+
+static void
+router_metrics_free (RouterMetrics *router)
+{
+    g_free (router->udn);
+    g_free (router->friendly_name);
+    g_free (router);
+}
+
+/* NULL if the metrics are off or the router is unknown */
+static RouterMetrics *
+router_metrics_lookup (const gchar *udn)
+{
+    if (metrics.server == NULL || udn == NULL)
+        return NULL;
+
+    return g_hash_table_lookup (metrics.routers, udn);
+}
+
+gboolean
+urc_metrics_enabled (void)
+{
+    return metrics.server != NULL;
+}
+
+void
+urc_metrics_set_router (const gchar *udn,
+                        const gchar *friendly_name)
+{
+    RouterMetrics *router;
+
+    if (metrics.server == NULL || udn == NULL)
+        return;
+
+    router = g_new0 (RouterMetrics, 1);
+    router->udn = g_strdup (udn);
+    router->friendly_name = g_strdup (friendly_name);
+
+    g_hash_table_replace (metrics.routers, router->udn, router);
+}
+
+/* The router went away, drop its series but keep the latencies */
+void
+urc_metrics_clear_router (const gchar *udn)
+{
+    if (metrics.server == NULL || udn == NULL)
+        return;
+
+    g_hash_table_remove (metrics.routers, udn);
+}
+
+/* rate in bytes per second */
+void
+urc_metrics_set_received (const gchar *udn,
+                          gboolean     valid,
+                          guint64      total,
+                          gdouble      rate)
+{
+    RouterMetrics *router = router_metrics_lookup (udn);
+
+    if (router == NULL)
+        return;
+
+    router->have_received = valid;
+    router->received_total = total;
+    router->received_rate = rate;
+}
+
+void
+urc_metrics_set_sent (const gchar *udn,
+                      gboolean     valid,
+                      guint64      total,
+                      gdouble      rate)
+{
+    RouterMetrics *router = router_metrics_lookup (udn);
+
+    if (router == NULL)
+        return;
+
+    router->have_sent = valid;
+    router->sent_total = total;
+    router->sent_rate = rate;
+}
+
+void
+urc_metrics_set_connection (const gchar *udn,
+                            gboolean     connected,
+                            gboolean     have_uptime,
+                            guint        uptime)
+{
+    RouterMetrics *router = router_metrics_lookup (udn);
+
+    if (router == NULL)
+        return;
+
+    router->have_connection = TRUE;
+    router->connected = connected;
+
+    /* events carry the status only, keep counting from the last read */
+    if (have_uptime) {
+        router->have_uptime = TRUE;
+        router->uptime = uptime;
+        router->uptime_time = g_get_monotonic_time ();
+    }
+    else if (!connected)
+        router->have_uptime = FALSE;
+}
+
+void
+urc_metrics_set_port_mappings (const gchar *udn,
+                               guint        count)
+{
+    RouterMetrics *router = router_metrics_lookup (udn);
+
+    if (router == NULL)
+        return;
+
+    router->have_port_mappings = TRUE;
+    router->port_mappings = count;
+}
+
+void
+urc_metrics_observe_action (const UrcActionInfo *info,
+                            gboolean             failed)
+{
+    ActionLatency *latency;
+    gdouble seconds;
+    guint i;
+
+    if (metrics.server == NULL)
+        return;
+
+    latency = g_hash_table_lookup (metrics.latencies, info->name);
+
+    if (latency == NULL) {
+        latency = g_new0 (ActionLatency, 1);
+        g_hash_table_insert (metrics.latencies, g_strdup (info->name), latency);
+    }
+
+    seconds = ((gdouble) info->response_time - info->request_time) / G_USEC_PER_SEC;
+
+    /* buckets are cumulative */
+    for (i = 0; i < N_LATENCY_BUCKETS; i++) {
+        if (seconds <= latency_bounds[i])
+            latency->buckets[i]++;
+    }
+
+    latency->count++;
+    latency->sum += seconds;
+
+    if (failed)
+        latency->failed++;
+}
+
+static void
+append_label_value (GString     *out,
+                    const gchar *value)
+{
+    const gchar *p;
+
+    for (p = value; *p != '\0'; p++) {
+        if (*p == '\\' || *p == '"')
+            g_string_append_c (out, '\\');
+
+        if (*p == '\n')
+            g_string_append (out, "\\n");
+        else
+            g_string_append_c (out, *p);
+    }
+}
+
+/* "name{label="value"" without the closing brace */
+static void
+append_sample_start (GString     *out,
+                     const gchar *name,
+                     const gchar *label,
+                     const gchar *value)
+{
+    g_string_append_printf (out, "%s{%s=\"", name, label);
+    append_label_value (out, value);
+    g_string_append_c (out, '"');
+}
+
+/* A bucket bound as the client libraries write it: "0.1", "1.0" */
+static const gchar *
+format_bound (gchar   *buffer,
+              gsize    length,
+              gdouble  bound)
+{
+    g_ascii_formatd (buffer, length, "%g", bound);
+
+    if (strpbrk (buffer, ".e") == NULL)
+        g_strlcat (buffer, ".0", length);
+
+    return buffer;
+}
+
+static void
+append_action_latency (GString             *out,
+                       const gchar         *action,
+                       const ActionLatency *latency)
+{
+    gchar number[G_ASCII_DTOSTR_BUF_SIZE];
+    guint i;
+
+    for (i = 0; i < N_LATENCY_BUCKETS; i++) {
+        append_sample_start (out, "urc_soap_request_duration_seconds_bucket", "action", action);
+        g_string_append_printf (out, ",le=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                                format_bound (number, sizeof (number), latency_bounds[i]),
+                                latency->buckets[i]);
+    }
+
+    append_sample_start (out, "urc_soap_request_duration_seconds_bucket", "action", action);
+    g_string_append_printf (out, ",le=\"+Inf\"} %" G_GUINT64_FORMAT "\n", latency->count);
+
+    append_sample_start (out, "urc_soap_request_duration_seconds_sum", "action", action);
+    g_string_append_printf (out, "} %s\n", g_ascii_dtostr (number, sizeof (number), latency->sum));
+
+    append_sample_start (out, "urc_soap_request_duration_seconds_count", "action", action);
+    g_string_append_printf (out, "} %" G_GUINT64_FORMAT "\n", latency->count);
+}
+
+static gint
+compare_names (gconstpointer a,
+               gconstpointer b)
+{
+    return strcmp (*(const gchar **) a, *(const gchar **) b);
+}
+
+/* Keys of "table" in a stable order between scrapes */
+static GPtrArray *
+sorted_keys (GHashTable *table)
+{
+    GPtrArray *keys;
+    GHashTableIter iter;
+    gpointer key;
+
+    keys = g_ptr_array_new ();
+
+    g_hash_table_iter_init (&iter, table);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+        g_ptr_array_add (keys, key);
+
+    g_ptr_array_sort (keys, compare_names);
+
+    return keys;
+}
+
+static gchar *
+urc_metrics_render (gsize *length)
+{
+    const UrcHttpStats *http = urc_http_get_stats ();
+    gchar number[G_ASCII_DTOSTR_BUF_SIZE];
+    RouterMetrics *router;
+    GString *out;
+    GPtrArray *udns, *actions;
+    gint64 now;
+    guint i;
+
+    out = g_string_sized_new (4096);
+    now = g_get_monotonic_time ();
+    udns = sorted_keys (metrics.routers);
+
+    g_string_append (out, "# TYPE urc_router info\n"
+                          "# HELP urc_router The routers being monitored.\n");
+    for (i = 0; i < udns->len; i++) {
+        router = g_hash_table_lookup (metrics.routers, g_ptr_array_index (udns, i));
+        append_sample_start (out, "urc_router_info", "udn", router->udn);
+        g_string_append (out, ",name=\"");
+        append_label_value (out, router->friendly_name != NULL ? router->friendly_name : "");
+        g_string_append (out, "\"} 1\n");
+    }
+
+    g_string_append (out, "# TYPE urc_wan_received_bytes counter\n"
+                          "# UNIT urc_wan_received_bytes bytes\n"
+                          "# HELP urc_wan_received_bytes Bytes received on the WAN link.\n");
+    for (i = 0; i < udns->len; i++) {
+        router = g_hash_table_lookup (metrics.routers, g_ptr_array_index (udns, i));
+        if (!router->have_received)
+            continue;
+
+        append_sample_start (out, "urc_wan_received_bytes_total", "udn", router->udn);
+        g_string_append_printf (out, "} %" G_GUINT64_FORMAT "\n", router->received_total);
+    }
+
+    g_string_append (out, "# TYPE urc_wan_sent_bytes counter\n"
+                          "# UNIT urc_wan_sent_bytes bytes\n"
+                          "# HELP urc_wan_sent_bytes Bytes sent on the WAN link.\n");
+    for (i = 0; i < udns->len; i++) {
+        router = g_hash_table_lookup (metrics.routers, g_ptr_array_index (udns, i));
+        if (!router->have_sent)
+            continue;
+
+        append_sample_start (out, "urc_wan_sent_bytes_total", "udn", router->udn);
+        g_string_append_printf (out, "} %" G_GUINT64_FORMAT "\n", router->sent_total);
+    }
+
+    g_string_append (out, "# TYPE urc_wan_download_rate_bytes_per_second gauge\n"
+                          "# HELP urc_wan_download_rate_bytes_per_second Download rate, as shown by the graph.\n");
+    for (i = 0; i < udns->len; i++) {
+        router = g_hash_table_lookup (metrics.routers, g_ptr_array_index (udns, i));
+        if (!router->have_received)
+            continue;
+
+        append_sample_start (out, "urc_wan_download_rate_bytes_per_second", "udn", router->udn);
+        g_string_append_printf (out, "} %s\n", g_ascii_dtostr (number, sizeof (number), router->received_rate));
+    }
+
+    g_string_append (out, "# TYPE urc_wan_upload_rate_bytes_per_second gauge\n"
+                          "# HELP urc_wan_upload_rate_bytes_per_second Upload rate, as shown by the graph.\n");
+    for (i = 0; i < udns->len; i++) {
+        router = g_hash_table_lookup (metrics.routers, g_ptr_array_index (udns, i));
+        if (!router->have_sent)
+            continue;
+
+        append_sample_start (out, "urc_wan_upload_rate_bytes_per_second", "udn", router->udn);
+        g_string_append_printf (out, "} %s\n", g_ascii_dtostr (number, sizeof (number), router->sent_rate));
+    }
+
+    g_string_append (out, "# TYPE urc_wan_connected gauge\n"
+                          "# HELP urc_wan_connected 1 if the WAN connection status is Connected.\n");
+    for (i = 0; i < udns->len; i++) {
+        router = g_hash_table_lookup (metrics.routers, g_ptr_array_index (udns, i));
+        if (!router->have_connection)
+            continue;
+
+        append_sample_start (out, "urc_wan_connected", "udn", router->udn);
+        g_string_append_printf (out, "} %d\n", router->connected ? 1 : 0);
+    }
+
+    g_string_append (out, "# TYPE urc_wan_uptime_seconds gauge\n"
+                          "# UNIT urc_wan_uptime_seconds seconds\n"
+                          "# HELP urc_wan_uptime_seconds WAN connection uptime.\n");
+    for (i = 0; i < udns->len; i++) {
+        router = g_hash_table_lookup (metrics.routers, g_ptr_array_index (udns, i));
+        if (!router->have_uptime)
+            continue;
+
+        append_sample_start (out, "urc_wan_uptime_seconds", "udn", router->udn);
+        g_string_append_printf (out, "} %" G_GINT64_FORMAT "\n",
+                                router->uptime + (now - router->uptime_time) / G_USEC_PER_SEC);
+    }
+
+    g_string_append (out, "# TYPE urc_port_mappings gauge\n"
+                          "# HELP urc_port_mappings Port mappings on the router.\n");
+    for (i = 0; i < udns->len; i++) {
+        router = g_hash_table_lookup (metrics.routers, g_ptr_array_index (udns, i));
+        if (!router->have_port_mappings)
+            continue;
+
+        append_sample_start (out, "urc_port_mappings", "udn", router->udn);
+        g_string_append_printf (out, "} %u\n", router->port_mappings);
+    }
+
+    g_ptr_array_free (udns, TRUE);
+
+    g_string_append_printf (out,
+                            "# TYPE urc_http_requests counter\n"
+                            "# HELP urc_http_requests HTTP requests sent to the routers.\n"
+                            "urc_http_requests_total %" G_GUINT64_FORMAT "\n"
+                            "# TYPE urc_http_connections counter\n"
+                            "# HELP urc_http_connections Requests sent on a new or on a reused connection.\n"
+                            "urc_http_connections_total{kind=\"new\"} %" G_GUINT64_FORMAT "\n"
+                            "urc_http_connections_total{kind=\"reused\"} %" G_GUINT64_FORMAT "\n"
+                            "# TYPE urc_http_cached_documents counter\n"
+                            "# HELP urc_http_cached_documents Descriptions and SCPDs taken from the disk cache.\n"
+                            "urc_http_cached_documents_total %" G_GUINT64_FORMAT "\n",
+                            http->requests,
+                            http->new_connections,
+                            http->reused_connections,
+                            urc_doc_cache_get_hits ());
+
+    actions = sorted_keys (metrics.latencies);
+
+    g_string_append (out, "# TYPE urc_soap_request_duration_seconds histogram\n"
+                          "# UNIT urc_soap_request_duration_seconds seconds\n"
+                          "# HELP urc_soap_request_duration_seconds Time from SOAP request to reply.\n");
+
+    for (i = 0; i < actions->len; i++)
+        append_action_latency (out, g_ptr_array_index (actions, i),
+                               g_hash_table_lookup (metrics.latencies, g_ptr_array_index (actions, i)));
+
+    g_string_append (out, "# TYPE urc_soap_request_failures counter\n"
+                          "# HELP urc_soap_request_failures SOAP requests that got no reply.\n");
+
+    for (i = 0; i < actions->len; i++) {
+        ActionLatency *latency = g_hash_table_lookup (metrics.latencies, g_ptr_array_index (actions, i));
+
+        append_sample_start (out, "urc_soap_request_failures_total", "action", g_ptr_array_index (actions, i));
+        g_string_append_printf (out, "} %" G_GUINT64_FORMAT "\n", latency->failed);
+    }
+
+    g_ptr_array_free (actions, TRUE);
+
+    g_string_append (out, "# EOF\n");
+
+    *length = out->len;
+    return g_string_free (out, FALSE);
+}
+
+static void
+metrics_handler (SoupServer        *server,
+                 SoupMessage       *msg,
+                 const char        *path,
+                 GHashTable        *query,
+                 SoupClientContext *client,
+                 gpointer           user_data)
+{
+    gchar *body;
+    gsize length;
+
+    if (msg->method != SOUP_METHOD_GET && msg->method != SOUP_METHOD_HEAD) {
+        soup_message_set_status (msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+        return;
+    }
+
+    if (g_strcmp0 (path, "/metrics") != 0) {
+        soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+        return;
+    }
+
+    body = urc_metrics_render (&length);
+
+    soup_message_set_status (msg, SOUP_STATUS_OK);
+    soup_message_set_response (msg,
+                               "application/openmetrics-text; version=1.0.0; charset=utf-8",
+                               SOUP_MEMORY_TAKE, body, length);
+}
+
+/* Serve /metrics on the loopback interface */
+gboolean
+urc_metrics_start (guint    port,
+                   GError **error)
+{
+    g_return_val_if_fail (metrics.server == NULL, FALSE);
+
+    metrics.server = soup_server_new (SOUP_SERVER_SERVER_HEADER, PACKAGE "/" VERSION, NULL);
+
+    if (!soup_server_listen_local (metrics.server, port, 0, error)) {
+        g_clear_object (&metrics.server);
+        return FALSE;
+    }
+
+    soup_server_add_handler (metrics.server, "/metrics", metrics_handler, NULL, NULL);
+
+    metrics.routers = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) router_metrics_free);
+    metrics.latencies = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+    g_print ("* Serving metrics on http://localhost:%u/metrics\n", port);
+
+    return TRUE;
+}
@@ -0,0 +1,71 @@
+/* urc-metrics.h
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __URC_METRICS_H__
+#define __URC_METRICS_H__
+
+#include <glib.h>
+
+#include "urc-action.h"
+
+/* Upper bounds of the SOAP latency histogram buckets, in seconds */
+#define URC_METRICS_LATENCY_BUCKETS  { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0 }
+
+gboolean
+urc_metrics_start (guint    port,
+                   GError **error);
+
+gboolean
+urc_metrics_enabled (void);
+
+void
+urc_metrics_set_router (const gchar *udn,
+                        const gchar *friendly_name);
+
+void
+urc_metrics_clear_router (const gchar *udn);
+
+void
+urc_metrics_set_received (const gchar *udn,
+                          gboolean     valid,
+                          guint64      total,
+                          gdouble      rate);
+
+void
+urc_metrics_set_sent (const gchar *udn,
+                      gboolean     valid,
+                      guint64      total,
+                      gdouble      rate);
+
+void
+urc_metrics_set_connection (const gchar *udn,
+                            gboolean     connected,
+                            gboolean     have_uptime,
+                            guint        uptime);
+
+void
+urc_metrics_set_port_mappings (const gchar *udn,
+                               guint        count);
+
+void
+urc_metrics_observe_action (const UrcActionInfo *info,
+                            gboolean             failed);
+
+#endif /* __URC_METRICS_H__ */
@@ -0,0 +1,162 @@
+/* urc-rate.c
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "config.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "urc-rate.h"
+
+gboolean
+urc_rate_filter_from_string (const gchar   *name,
+                             UrcRateFilter *filter)
+{
+    if (g_strcmp0 (name, "none") == 0)
+        *filter = URC_RATE_FILTER_NONE;
+    else if (g_strcmp0 (name, "ewma") == 0)
+        *filter = URC_RATE_FILTER_EWMA;
+    else if (g_strcmp0 (name, "median") == 0)
+        *filter = URC_RATE_FILTER_MEDIAN;
+    else
+        return FALSE;
+
+    return TRUE;
+}
+
+void
+urc_rate_init (UrcRate *rate)
+{
+    memset (rate, 0, sizeof (UrcRate));
+}
+
+/* Forget the filter state and take "time" as the start of the next
+ * interval, after the counter was reset */
+void
+urc_rate_restart (UrcRate *rate,
+                  gint64   time)
+{
+    urc_rate_init (rate);
+
+    rate->last_time = time;
+    rate->valid = TRUE;
+}
+
+static gdouble
+urc_rate_median (const UrcRate *rate)
+{
+    gdouble sorted[URC_RATE_MEDIAN_WINDOW];
+    guint i, j;
+
+    /* insertion sort, the window is tiny */
+    for (i = 0; i < rate->window_len; i++) {
+        gdouble value = rate->window[i];
+
+        for (j = i; j > 0 && sorted[j - 1] > value; j--)
+            sorted[j] = sorted[j - 1];
+
+        sorted[j] = value;
+    }
+
+    if (rate->window_len % 2 == 1)
+        return sorted[rate->window_len / 2];
+
+    return (sorted[rate->window_len / 2 - 1] + sorted[rate->window_len / 2]) / 2.0;
+}
+
+/* Add the increase "delta" of a counter read at monotonic "time", the
+ * midpoint between request and reply, which is the best guess of when
+ * the router actually read its counter.
+ *
+ * The rate is taken over the real interval since the previous reading,
+ * so a late main loop or a slow reply doesn't skew it. With the EWMA
+ * filter the weight of a reading grows with the interval it covers.
+ *
+ * A reading with no time elapsed since the previous one doesn't move
+ * it: its increase goes to the next interval, and the previous rate is
+ * given again.
+ *
+ * Returns TRUE and the rate, in units per second, in "value" when there
+ * was a previous reading to compare with. */
+gboolean
+urc_rate_update (UrcRate       *rate,
+                 UrcRateFilter  filter,
+                 gint64         time,
+                 guint64        delta,
+                 gdouble       *value)
+{
+    gint64 interval;
+    gdouble instant, alpha;
+
+    if (!rate->valid) {
+        urc_rate_restart (rate, time);
+        return FALSE;
+    }
+
+    interval = time - rate->last_time;
+
+    /* no time elapsed, nothing to measure */
+    if (interval <= 0) {
+        rate->pending += delta;
+
+        if (rate->last_value_valid)
+            *value = rate->last_value;
+
+        return rate->last_value_valid;
+    }
+
+    rate->last_time = time;
+
+    instant = (gdouble) (delta + rate->pending) * G_USEC_PER_SEC / interval;
+    rate->pending = 0;
+
+    switch (filter) {
+        case URC_RATE_FILTER_EWMA:
+            if (!rate->smoothed_valid) {
+                rate->smoothed = instant;
+                rate->smoothed_valid = TRUE;
+            }
+            else {
+                alpha = 1.0 - exp (-(gdouble) interval / URC_RATE_EWMA_TAU);
+                rate->smoothed += alpha * (instant - rate->smoothed);
+            }
+            *value = rate->smoothed;
+            break;
+
+        case URC_RATE_FILTER_MEDIAN:
+            rate->window[rate->window_pos] = instant;
+            rate->window_pos = (rate->window_pos + 1) % URC_RATE_MEDIAN_WINDOW;
+            if (rate->window_len < URC_RATE_MEDIAN_WINDOW)
+                rate->window_len++;
+            *value = urc_rate_median (rate);
+            break;
+
+        default:
+            *value = instant;
+            break;
+    }
+
+    rate->last_value = *value;
+    rate->last_value_valid = TRUE;
+
+    return TRUE;
+}
@@ -0,0 +1,78 @@
+/* urc-rate.h
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __URC_RATE_H__
+#define __URC_RATE_H__
+
+#include <glib.h>
+
+typedef enum
+{
+    URC_RATE_FILTER_NONE,
+    URC_RATE_FILTER_EWMA,
+    URC_RATE_FILTER_MEDIAN
+} UrcRateFilter;
+
+/* time constant of the EWMA filter */
+#define URC_RATE_EWMA_TAU       (3 * G_USEC_PER_SEC)
+
+/* samples in the median filter window */
+#define URC_RATE_MEDIAN_WINDOW  5
+
+/* Rate of a counter over the real interval between two readings */
+typedef struct
+{
+    gint64   last_time;
+    gboolean valid;
+
+    /* increase read with no time elapsed, counted in the next interval */
+    guint64  pending;
+
+    /* last rate returned, given again for such a reading */
+    gdouble  last_value;
+    gboolean last_value_valid;
+
+    gdouble  smoothed;
+    gboolean smoothed_valid;
+
+    gdouble  window[URC_RATE_MEDIAN_WINDOW];
+    guint    window_len;
+    guint    window_pos;
+} UrcRate;
+
+gboolean
+urc_rate_filter_from_string (const gchar   *name,
+                             UrcRateFilter *filter);
+
+void
+urc_rate_init (UrcRate *rate);
+
+void
+urc_rate_restart (UrcRate *rate,
+                  gint64   time);
+
+gboolean
+urc_rate_update (UrcRate       *rate,
+                 UrcRateFilter  filter,
+                 gint64         time,
+                 guint64        delta,
+                 gdouble       *value);
+
+#endif /* __URC_RATE_H__ */
@@ -0,0 +1,144 @@
+/* urc-router-cache.c
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "config.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "urc-router-cache.h"
+
+extern gboolean opt_debug;
+
+/* One group per router, named after its root UDN */
+#define LOCATION_KEY "Location"
+
+static gchar*
+router_cache_path (void)
+{
+    return g_build_filename (g_get_user_cache_dir (), "upnp-router-control", "routers", NULL);
+}
+
+static GKeyFile*
+router_cache_load (const gchar *path)
+{
+    GKeyFile *key_file;
+    GError *error = NULL;
+
+    key_file = g_key_file_new ();
+
+    if (!g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, &error)) {
+        if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            g_printerr ("\e[33m[WW]\e[0m Router cache %s: %s\n", path, error->message);
+
+        g_error_free (error);
+    }
+
+    return key_file;
+}
+
+static void
+router_cache_write (GKeyFile *key_file, const gchar *path)
+{
+    GError *error = NULL;
+    gchar *dir;
+
+    dir = g_path_get_dirname (path);
+    g_mkdir_with_parents (dir, 0700);
+    g_free (dir);
+
+    if (!g_key_file_save_to_file (key_file, path, &error)) {
+        g_printerr ("\e[31m[EE]\e[0m Router cache %s: %s\n", path, error->message);
+        g_error_free (error);
+    }
+}
+
+void
+urc_router_cache_foreach (UrcRouterCacheFunc func,
+                          gpointer           user_data)
+{
+    GKeyFile *key_file;
+    gchar *path;
+    gchar **groups;
+    gchar *location;
+    guint i;
+
+    path = router_cache_path ();
+    key_file = router_cache_load (path);
+
+    groups = g_key_file_get_groups (key_file, NULL);
+
+    for (i = 0; groups[i] != NULL; i++) {
+        location = g_key_file_get_string (key_file, groups[i], LOCATION_KEY, NULL);
+        if (location == NULL)
+            continue;
+
+        func (groups[i], location, user_data);
+        g_free (location);
+    }
+
+    g_strfreev (groups);
+    g_key_file_free (key_file);
+    g_free (path);
+}
+
+/* Remember where the router is, written only when it changes */
+void
+urc_router_cache_save (const gchar *root_udn,
+                       const gchar *location)
+{
+    GKeyFile *key_file;
+    gchar *path;
+    gchar *cached;
+
+    path = router_cache_path ();
+    key_file = router_cache_load (path);
+
+    cached = g_key_file_get_string (key_file, root_udn, LOCATION_KEY, NULL);
+
+    if (g_strcmp0 (cached, location) != 0) {
+        g_key_file_set_string (key_file, root_udn, LOCATION_KEY, location);
+        router_cache_write (key_file, path);
+    }
+
+    g_free (cached);
+    g_key_file_free (key_file);
+    g_free (path);
+}
+
+void
+urc_router_cache_forget (const gchar *root_udn)
+{
+    GKeyFile *key_file;
+    gchar *path;
+
+    path = router_cache_path ();
+    key_file = router_cache_load (path);
+
+    if (g_key_file_remove_group (key_file, root_udn, NULL)) {
+        if (opt_debug)
+            g_print ("\e[34mForgot the cached location of %s\e[0m\n", root_udn);
+
+        router_cache_write (key_file, path);
+    }
+
+    g_key_file_free (key_file);
+    g_free (path);
+}
@@ -0,0 +1,44 @@
+/* urc-router-cache.h
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __URC_ROUTER_CACHE_H__
+#define __URC_ROUTER_CACHE_H__
+
+#include <glib.h>
+
+/* Routers found in the past, to reach them again at startup without
+ * waiting for the SSDP discovery */
+
+typedef void (*UrcRouterCacheFunc) (const gchar *root_udn,
+                                    const gchar *location,
+                                    gpointer     user_data);
+
+void
+urc_router_cache_foreach (UrcRouterCacheFunc func,
+                          gpointer           user_data);
+
+void
+urc_router_cache_save (const gchar *root_udn,
+                       const gchar *location);
+
+void
+urc_router_cache_forget (const gchar *root_udn);
+
+#endif /* __URC_ROUTER_CACHE_H__ */
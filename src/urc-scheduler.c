@@ -0,0 +1,270 @@
+/* urc-scheduler.c
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+#include "urc-scheduler.h"
+#include "urc-worker.h"
+
+extern gboolean opt_debug;
+
+/* Items due within this much of the earliest one run on the same wakeup */
+#define SCHEDULER_SLACK_US  (20 * 1000)
+
+typedef struct
+{
+    const gchar *name;
+    guint interval_ms;
+    gdouble jitter;     /* fraction of the interval, either way */
+    gint priority;
+    UrcScheduleFunc func;
+
+    gboolean active;
+    gint64 next_due;    /* monotonic, us */
+
+} ScheduleItem;
+
+struct _UrcScheduler
+{
+    ScheduleItem *items;
+    guint n_items;
+    gpointer user_data;
+
+    /* nothing runs by itself, urc_scheduler_run_now() still does */
+    gboolean paused;
+
+    GSource *timer;
+};
+
+static void scheduler_arm (UrcScheduler *scheduler);
+
+static gint64
+item_interval (const ScheduleItem *item)
+{
+    gdouble interval = item->interval_ms * 1000.0;
+
+    /* spread the polls of several routers, and of one router over time */
+    if (item->jitter > 0.0)
+        interval *= 1.0 + g_random_double_range (-item->jitter, item->jitter);
+
+    return (gint64) interval;
+}
+
+static void
+item_run (UrcScheduler *scheduler, ScheduleItem *item, gint64 now)
+{
+    /* from the planned time, so the cadence doesn't drift */
+    item->next_due = MAX (item->next_due, now - item->interval_ms * 1000) + item_interval (item);
+
+    if (opt_debug)
+        g_print ("\e[34mPoll %s\e[0m\n", item->name);
+
+    item->func (scheduler->user_data);
+}
+
+static gboolean
+scheduler_timeout_cb (gpointer data)
+{
+    UrcScheduler *scheduler = (UrcScheduler *) data;
+    ScheduleItem *item, *next;
+    gint64 now;
+    guint i;
+
+    g_source_unref (scheduler->timer);
+    scheduler->timer = NULL;
+
+    now = g_get_monotonic_time ();
+
+    /* the due items, higher priority first */
+    for (;;) {
+        next = NULL;
+
+        for (i = 0; i < scheduler->n_items; i++) {
+            item = &scheduler->items[i];
+
+            if (!item->active || item->next_due > now + SCHEDULER_SLACK_US)
+                continue;
+
+            if (next == NULL || item->priority < next->priority)
+                next = item;
+        }
+
+        if (next == NULL)
+            break;
+
+        item_run (scheduler, next, now);
+    }
+
+    scheduler_arm (scheduler);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* One timer for the earliest item, at the priority of that item */
+static void
+scheduler_arm (UrcScheduler *scheduler)
+{
+    ScheduleItem *item, *next = NULL;
+    gint64 delay;
+    guint i;
+
+    if (scheduler->timer != NULL) {
+        g_source_destroy (scheduler->timer);
+        g_source_unref (scheduler->timer);
+        scheduler->timer = NULL;
+    }
+
+    if (scheduler->paused)
+        return;
+
+    for (i = 0; i < scheduler->n_items; i++) {
+        item = &scheduler->items[i];
+
+        if (item->active && (next == NULL || item->next_due < next->next_due))
+            next = item;
+    }
+
+    if (next == NULL)
+        return;
+
+    delay = (next->next_due - g_get_monotonic_time ()) / 1000;
+
+    scheduler->timer = g_timeout_source_new (delay > 0 ? delay : 0);
+    g_source_set_priority (scheduler->timer, next->priority);
+    g_source_set_callback (scheduler->timer, scheduler_timeout_cb, scheduler, NULL);
+    g_source_attach (scheduler->timer, urc_worker_get_context ());
+}
+
+UrcScheduler*
+urc_scheduler_new (guint    n_items,
+                   gpointer user_data)
+{
+    UrcScheduler *scheduler;
+
+    scheduler = g_malloc0 (sizeof (UrcScheduler));
+    scheduler->items = g_new0 (ScheduleItem, n_items);
+    scheduler->n_items = n_items;
+    scheduler->user_data = user_data;
+
+    return scheduler;
+}
+
+void
+urc_scheduler_free (UrcScheduler *scheduler)
+{
+    urc_scheduler_stop_all (scheduler);
+
+    g_free (scheduler->items);
+    g_free (scheduler);
+}
+
+void
+urc_scheduler_set_item (UrcScheduler    *scheduler,
+                        guint            item,
+                        const gchar     *name,
+                        guint            interval_ms,
+                        gdouble          jitter,
+                        gint             priority,
+                        UrcScheduleFunc  func)
+{
+    ScheduleItem *entry = &scheduler->items[item];
+
+    entry->name = name;
+    entry->interval_ms = interval_ms;
+    entry->jitter = jitter;
+    entry->priority = priority;
+    entry->func = func;
+}
+
+/* Poll the item from now on, the first time after "delay_ms" */
+void
+urc_scheduler_start (UrcScheduler *scheduler,
+                     guint         item,
+                     guint         delay_ms)
+{
+    ScheduleItem *entry = &scheduler->items[item];
+
+    entry->active = TRUE;
+    entry->next_due = g_get_monotonic_time () + (gint64) delay_ms * 1000;
+
+    scheduler_arm (scheduler);
+}
+
+void
+urc_scheduler_stop_all (UrcScheduler *scheduler)
+{
+    guint i;
+
+    for (i = 0; i < scheduler->n_items; i++)
+        scheduler->items[i].active = FALSE;
+
+    scheduler_arm (scheduler);
+}
+
+gboolean
+urc_scheduler_is_active (UrcScheduler *scheduler,
+                         guint         item)
+{
+    return scheduler->items[item].active;
+}
+
+/* Hold the polls, the overdue ones run when resumed */
+void
+urc_scheduler_set_paused (UrcScheduler *scheduler,
+                          gboolean      paused)
+{
+    scheduler->paused = paused;
+
+    scheduler_arm (scheduler);
+}
+
+/* The item was just refreshed by an event, its poll can wait */
+void
+urc_scheduler_touch (UrcScheduler *scheduler,
+                     guint         item)
+{
+    ScheduleItem *entry = &scheduler->items[item];
+
+    if (!entry->active)
+        return;
+
+    entry->next_due = g_get_monotonic_time () + item_interval (entry);
+
+    scheduler_arm (scheduler);
+}
+
+/* Poll the item now instead of at its time */
+void
+urc_scheduler_run_now (UrcScheduler *scheduler,
+                       guint         item)
+{
+    ScheduleItem *entry = &scheduler->items[item];
+    gint64 now = g_get_monotonic_time ();
+
+    if (!entry->active)
+        return;
+
+    entry->next_due = now;
+    item_run (scheduler, entry, now);
+
+    scheduler_arm (scheduler);
+}
@@ -0,0 +1,74 @@
+/* urc-scheduler.h
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __URC_SCHEDULER_H__
+#define __URC_SCHEDULER_H__
+
+#include <glib.h>
+
+/* Periodic polls of one router on a single timer. Each item has its own
+ * interval, jitter and main loop priority, and an item refreshed by
+ * other means (an event) is pushed back a full interval. */
+
+typedef void (*UrcScheduleFunc) (gpointer user_data);
+
+typedef struct _UrcScheduler UrcScheduler;
+
+UrcScheduler*
+urc_scheduler_new (guint    n_items,
+                   gpointer user_data);
+
+void
+urc_scheduler_free (UrcScheduler *scheduler);
+
+void
+urc_scheduler_set_item (UrcScheduler    *scheduler,
+                        guint            item,
+                        const gchar     *name,
+                        guint            interval_ms,
+                        gdouble          jitter,
+                        gint             priority,
+                        UrcScheduleFunc  func);
+
+void
+urc_scheduler_start (UrcScheduler *scheduler,
+                     guint         item,
+                     guint         delay_ms);
+
+void
+urc_scheduler_stop_all (UrcScheduler *scheduler);
+
+gboolean
+urc_scheduler_is_active (UrcScheduler *scheduler,
+                         guint         item);
+
+void
+urc_scheduler_set_paused (UrcScheduler *scheduler,
+                          gboolean      paused);
+
+void
+urc_scheduler_touch (UrcScheduler *scheduler,
+                     guint         item);
+
+void
+urc_scheduler_run_now (UrcScheduler *scheduler,
+                       guint         item);
+
+#endif /* __URC_SCHEDULER_H__ */
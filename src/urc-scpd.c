@@ -0,0 +1,291 @@
+/* urc-scpd.c
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <glib.h>
+#include <libxml/parser.h>
+
+#include "urc-doc-cache.h"
+#include "urc-scpd.h"
+#include "urc-worker.h"
+
+struct _UrcScpd
+{
+    xmlDoc *doc;
+};
+
+typedef struct
+{
+    SoupURI *uri;
+    gchar *udn;
+    GCancellable *cancellable;
+    UrcScpdCallback callback;
+    gpointer user_data;
+
+    /* the cached document */
+    gchar *data;
+    gsize length;
+
+} ScpdFetch;
+
+static void
+scpd_fetch_free (ScpdFetch *fetch)
+{
+    soup_uri_free (fetch->uri);
+    g_free (fetch->udn);
+    g_clear_object (&fetch->cancellable);
+    g_free (fetch->data);
+    g_free (fetch);
+}
+
+static gboolean
+node_is (const xmlNode *node, const gchar *name)
+{
+    return node->type == XML_ELEMENT_NODE && strcmp ((const char *) node->name, name) == 0;
+}
+
+static xmlNode*
+node_child (const xmlNode *node, const gchar *name)
+{
+    xmlNode *child;
+
+    for (child = node->children; child != NULL; child = child->next) {
+        if (node_is (child, name))
+            return child;
+    }
+
+    return NULL;
+}
+
+/* Whether the text of the "name" child of "node" is "value" */
+static gboolean
+node_child_text_is (const xmlNode *node, const gchar *name, const gchar *value)
+{
+    xmlNode *child;
+    xmlChar *text;
+    gboolean equal;
+
+    child = node_child (node, name);
+    if (child == NULL)
+        return FALSE;
+
+    text = xmlNodeGetContent (child);
+    equal = text != NULL && g_strcmp0 (g_strstrip ((gchar *) text), value) == 0;
+    xmlFree (text);
+
+    return equal;
+}
+
+/* The "item" element of the "list" child of the root named "name" */
+static xmlNode*
+scpd_find (UrcScpd *scpd, const gchar *list, const gchar *item, const gchar *name)
+{
+    xmlNode *node;
+
+    node = xmlDocGetRootElement (scpd->doc);
+    node = node != NULL ? node_child (node, list) : NULL;
+    if (node == NULL)
+        return NULL;
+
+    for (node = node->children; node != NULL; node = node->next) {
+        if (node_is (node, item) && node_child_text_is (node, "name", name))
+            return node;
+    }
+
+    return NULL;
+}
+
+gboolean
+urc_scpd_has_action (UrcScpd     *scpd,
+                     const gchar *action)
+{
+    return scpd_find (scpd, "actionList", "action", action) != NULL;
+}
+
+gchar**
+urc_scpd_list_actions (UrcScpd *scpd)
+{
+    GPtrArray *names;
+    xmlNode *node, *name;
+    xmlChar *text;
+
+    names = g_ptr_array_new ();
+
+    node = xmlDocGetRootElement (scpd->doc);
+    node = node != NULL ? node_child (node, "actionList") : NULL;
+
+    for (node = node != NULL ? node->children : NULL; node != NULL; node = node->next) {
+        name = node_is (node, "action") ? node_child (node, "name") : NULL;
+        if (name == NULL)
+            continue;
+
+        text = xmlNodeGetContent (name);
+        if (text != NULL)
+            g_ptr_array_add (names, g_strdup (g_strstrip ((gchar *) text)));
+        xmlFree (text);
+    }
+
+    g_ptr_array_add (names, NULL);
+
+    return (gchar **) g_ptr_array_free (names, FALSE);
+}
+
+gboolean
+urc_scpd_action_has_argument (UrcScpd     *scpd,
+                              const gchar *action,
+                              const gchar *argument)
+{
+    xmlNode *node;
+
+    node = scpd_find (scpd, "actionList", "action", action);
+    node = node != NULL ? node_child (node, "argumentList") : NULL;
+    if (node == NULL)
+        return FALSE;
+
+    for (node = node->children; node != NULL; node = node->next) {
+        if (node_is (node, "argument") && node_child_text_is (node, "name", argument))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+gchar*
+urc_scpd_get_variable_type (UrcScpd     *scpd,
+                            const gchar *variable)
+{
+    xmlNode *node;
+    xmlChar *text;
+    gchar *type;
+
+    node = scpd_find (scpd, "serviceStateTable", "stateVariable", variable);
+    node = node != NULL ? node_child (node, "dataType") : NULL;
+    if (node == NULL)
+        return NULL;
+
+    text = xmlNodeGetContent (node);
+    type = g_strdup (g_strstrip ((gchar *) text));
+    xmlFree (text);
+
+    return type;
+}
+
+/* Parse and hand over the document */
+static void
+scpd_fetch_finish (ScpdFetch *fetch, const gchar *data, gsize length)
+{
+    UrcScpd scpd;
+    xmlNode *root;
+    GError *error = NULL;
+
+    scpd.doc = xmlRecoverMemory (data, length);
+    root = scpd.doc != NULL ? xmlDocGetRootElement (scpd.doc) : NULL;
+
+    if (root == NULL || !node_is (root, "scpd")) {
+        g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Not a service description");
+        fetch->callback (NULL, error, fetch->user_data);
+        g_error_free (error);
+    }
+    else
+        fetch->callback (&scpd, NULL, fetch->user_data);
+
+    if (scpd.doc != NULL)
+        xmlFreeDoc (scpd.doc);
+}
+
+static gboolean
+scpd_cached_cb (gpointer data)
+{
+    ScpdFetch *fetch = (ScpdFetch *) data;
+
+    if (!g_cancellable_is_cancelled (fetch->cancellable))
+        scpd_fetch_finish (fetch, fetch->data, fetch->length);
+
+    scpd_fetch_free (fetch);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void
+scpd_fetch_cb (SoupSession *session,
+               SoupMessage *msg,
+               gpointer     user_data)
+{
+    ScpdFetch *fetch = (ScpdFetch *) user_data;
+    GError *error = NULL;
+
+    if (g_cancellable_is_cancelled (fetch->cancellable) || msg->status_code == SOUP_STATUS_CANCELLED)
+        goto out;
+
+    if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code)) {
+        g_set_error (&error, SOUP_HTTP_ERROR, msg->status_code, "%s", msg->reason_phrase);
+        fetch->callback (NULL, error, fetch->user_data);
+        g_error_free (error);
+        goto out;
+    }
+
+    urc_doc_cache_store (fetch->uri, fetch->udn, msg->response_body->data, msg->response_body->length);
+
+    scpd_fetch_finish (fetch, msg->response_body->data, msg->response_body->length);
+
+out:
+    scpd_fetch_free (fetch);
+}
+
+void
+urc_scpd_fetch (SoupSession     *session,
+                const gchar     *url,
+                const gchar     *udn,
+                GCancellable    *cancellable,
+                UrcScpdCallback  callback,
+                gpointer         user_data)
+{
+    ScpdFetch *fetch;
+    SoupMessage *msg;
+    SoupURI *uri;
+    GError *error = NULL;
+
+    uri = url != NULL ? soup_uri_new (url) : NULL;
+
+    if (uri == NULL) {
+        g_set_error (&error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Invalid SCPD URL \"%s\"", url);
+        callback (NULL, error, user_data);
+        g_error_free (error);
+        return;
+    }
+
+    fetch = g_new0 (ScpdFetch, 1);
+    fetch->uri = uri;
+    fetch->udn = g_strdup (udn);
+    fetch->cancellable = cancellable != NULL ? g_object_ref (cancellable) : NULL;
+    fetch->callback = callback;
+    fetch->user_data = user_data;
+
+    /* replied from an idle, as a fetch would */
+    if (urc_doc_cache_lookup (uri, udn, &fetch->data, &fetch->length)) {
+        urc_worker_timeout_add (0, scpd_cached_cb, fetch);
+        return;
+    }
+
+    msg = soup_message_new_from_uri (SOUP_METHOD_GET, uri);
+    soup_session_queue_message (session, msg, scpd_fetch_cb, fetch);
+}
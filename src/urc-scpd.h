@@ -0,0 +1,66 @@
+/* urc-scpd.h
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __URC_SCPD_H__
+#define __URC_SCPD_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+
+/* Service description (SCPD) of a router service, read for the actions
+ * and the state variable types it lists. It comes from the document
+ * cache when still valid, otherwise it is fetched and stored there. */
+typedef struct _UrcScpd UrcScpd;
+
+/* "scpd" is NULL on error, and freed after the callback returns. Not
+ * called once "cancellable" is cancelled. */
+typedef void (*UrcScpdCallback) (UrcScpd      *scpd,
+                                 const GError *error,
+                                 gpointer      user_data);
+
+/* "udn" is the root device of the service, the key in the cache */
+void
+urc_scpd_fetch (SoupSession     *session,
+                const gchar     *url,
+                const gchar     *udn,
+                GCancellable    *cancellable,
+                UrcScpdCallback  callback,
+                gpointer         user_data);
+
+gboolean
+urc_scpd_has_action (UrcScpd     *scpd,
+                     const gchar *action);
+
+/* Names of the actions listed, free with g_strfreev() */
+gchar**
+urc_scpd_list_actions (UrcScpd *scpd);
+
+gboolean
+urc_scpd_action_has_argument (UrcScpd     *scpd,
+                              const gchar *action,
+                              const gchar *argument);
+
+/* dataType of a state variable, as written ("ui4", "ui8"...), or NULL */
+gchar*
+urc_scpd_get_variable_type (UrcScpd     *scpd,
+                            const gchar *variable);
+
+#endif /* __URC_SCPD_H__ */
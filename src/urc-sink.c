@@ -0,0 +1,207 @@
+/* urc-sink.c
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+#include "urc-sink.h"
+
+extern gboolean opt_debug;
+
+const UrcSink *urc_sink = &urc_log_sink;
+
+void
+urc_sink_set (const UrcSink *sink)
+{
+    urc_sink = sink;
+}
+
+/* Log sink: state changes go to stdout, the per second values only
+ * with --debug. Every router is logged, prefixed by its name. */
+
+static void
+log_prefix (RouterInfo *router)
+{
+    g_print ("\e[1;37m[%s]\e[0m ", router->friendly_name);
+}
+
+static void
+log_add_router (RouterInfo *router)
+{
+    log_prefix (router);
+    g_print ("\e[36mRouter:\e[0m %s", router->friendly_name);
+
+    if (router->brand != NULL)
+        g_print (" (%s %s)", router->brand, router->model_name != NULL ? router->model_name : "");
+
+    g_print (" at %s\n", router->device_ip);
+}
+
+static void
+log_remove_router (RouterInfo *router)
+{
+    log_prefix (router);
+    g_print ("Router disconnected\n");
+}
+
+static void
+log_set_health (RouterInfo *router)
+{
+    log_prefix (router);
+
+    switch (urc_health_get_state (router->health)) {
+        case URC_HEALTH_BACKOFF:
+            g_print ("\e[36mHealth:\e[0m not answering, next try in %u s\n", urc_health_get_backoff (router->health));
+            break;
+        case URC_HEALTH_PROBING:
+            g_print ("\e[36mHealth:\e[0m probing\n");
+            break;
+        default:
+            g_print ("\e[36mHealth:\e[0m answering\n");
+    }
+}
+
+static void
+log_enable_port_mapping (RouterInfo *router)
+{
+    log_prefix (router);
+    g_print ("\e[36mPort mapping:\e[0m available\n");
+}
+
+static void
+log_set_ext_ip (RouterInfo *router, const gchar *ip)
+{
+    log_prefix (router);
+    g_print ("\e[36mExternal IP:\e[0m %s\n", ip != NULL ? ip : "none");
+}
+
+static void
+log_disable_ext_ip (RouterInfo *router)
+{
+    log_prefix (router);
+    g_print ("\e[36mExternal IP:\e[0m unavailable\n");
+}
+
+static void
+log_set_conn_status (RouterInfo *router, const gchar *state)
+{
+    log_prefix (router);
+    g_print ("\e[36mConnection status:\e[0m %s\n", state);
+}
+
+static void
+log_disable_conn_status (RouterInfo *router)
+{
+    log_prefix (router);
+    g_print ("\e[36mConnection status:\e[0m unavailable\n");
+}
+
+static void
+log_set_total (RouterInfo *router, guint64 total)
+{
+}
+
+static void
+log_set_download_speed (RouterInfo *router, const gdouble down_speed)
+{
+    if (opt_debug) {
+        log_prefix (router);
+        g_print ("\e[34mDownload: %.2f KiB/s\e[0m\n", down_speed);
+    }
+}
+
+static void
+log_set_upload_speed (RouterInfo *router, const gdouble up_speed)
+{
+    if (opt_debug) {
+        log_prefix (router);
+        g_print ("\e[34mUpload: %.2f KiB/s\e[0m\n", up_speed);
+    }
+}
+
+static void
+log_set_packets (RouterInfo *router, const gdouble packet_rate, const gdouble avg_packet_size)
+{
+}
+
+static void
+log_nothing (RouterInfo *router)
+{
+}
+
+static void
+log_mapped_port (RouterInfo *router, const gchar *what, const PortForwardInfo *port_info)
+{
+    log_prefix (router);
+    g_print ("\e[36mPort mapping %s:\e[0m %s %u -> %s:%u \"%s\"%s\n",
+             what,
+             port_info->protocol,
+             port_info->external_port,
+             port_info->internal_host,
+             port_info->internal_port,
+             port_info->description != NULL ? port_info->description : "",
+             port_info->enabled ? "" : " (disabled)");
+}
+
+static void
+log_add_mapped_port (RouterInfo *router, const PortForwardInfo *port_info)
+{
+    log_mapped_port (router, "added", port_info);
+}
+
+static void
+log_update_mapped_port (RouterInfo *router, const PortForwardInfo *port_info)
+{
+    log_mapped_port (router, "changed", port_info);
+}
+
+static void
+log_remove_mapped_port (RouterInfo *router, const PortForwardInfo *port_info)
+{
+    log_mapped_port (router, "removed", port_info);
+}
+
+const UrcSink urc_log_sink =
+{
+    .add_router = log_add_router,
+    .remove_router = log_remove_router,
+    .set_health = log_set_health,
+    .enable_port_mapping = log_enable_port_mapping,
+    .set_ext_ip = log_set_ext_ip,
+    .disable_ext_ip = log_disable_ext_ip,
+    .set_conn_status = log_set_conn_status,
+    .disable_conn_status = log_disable_conn_status,
+    .set_total_received = log_set_total,
+    .disable_total_received = log_nothing,
+    .set_total_sent = log_set_total,
+    .disable_total_sent = log_nothing,
+    .set_download_speed = log_set_download_speed,
+    .disable_download_speed = log_nothing,
+    .set_upload_speed = log_set_upload_speed,
+    .disable_upload_speed = log_nothing,
+    .set_download_packets = log_set_packets,
+    .set_upload_packets = log_set_packets,
+    .add_mapped_port = log_add_mapped_port,
+    .update_mapped_port = log_update_mapped_port,
+    .remove_mapped_port = log_remove_mapped_port,
+    .enable_graph = log_nothing,
+    .update_graph = log_nothing,
+};
@@ -0,0 +1,86 @@
+/* urc-sink.h
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __URC_SINK_H__
+#define __URC_SINK_H__
+
+#include <glib.h>
+
+#include "urc-upnp.h"
+
+/* Where the router state ends up: the GTK window, or the log when
+ * running headless. Every entry must be set. All the routers found
+ * report here, the sink decides which ones it shows. */
+typedef struct
+{
+    /* a router was found, its descriptive fields are set */
+    void (*add_router) (RouterInfo *router);
+
+    /* the router went away, it is freed after the call */
+    void (*remove_router) (RouterInfo *router);
+
+    /* router->health changed state */
+    void (*set_health) (RouterInfo *router);
+
+    /* the port mapping service is ready */
+    void (*enable_port_mapping) (RouterInfo *router);
+
+    void (*set_ext_ip) (RouterInfo *router, const gchar *ip);
+    void (*disable_ext_ip) (RouterInfo *router);
+
+    void (*set_conn_status) (RouterInfo *router, const gchar *state);
+    void (*disable_conn_status) (RouterInfo *router);
+
+    /* totals in bytes */
+    void (*set_total_received) (RouterInfo *router, guint64 total_received);
+    void (*disable_total_received) (RouterInfo *router);
+    void (*set_total_sent) (RouterInfo *router, guint64 total_sent);
+    void (*disable_total_sent) (RouterInfo *router);
+
+    /* rates in KiB/s */
+    void (*set_download_speed) (RouterInfo *router, const gdouble down_speed);
+    void (*disable_download_speed) (RouterInfo *router);
+    void (*set_upload_speed) (RouterInfo *router, const gdouble up_speed);
+    void (*disable_upload_speed) (RouterInfo *router);
+
+    /* packets/s and bytes per packet, a negative rate if unknown */
+    void (*set_download_packets) (RouterInfo *router, const gdouble packet_rate, const gdouble avg_packet_size);
+    void (*set_upload_packets) (RouterInfo *router, const gdouble packet_rate, const gdouble avg_packet_size);
+
+    void (*add_mapped_port) (RouterInfo *router, const PortForwardInfo *port_info);
+    void (*update_mapped_port) (RouterInfo *router, const PortForwardInfo *port_info);
+    void (*remove_mapped_port) (RouterInfo *router, const PortForwardInfo *port_info);
+
+    /* the router histories are ready, then got a new sample */
+    void (*enable_graph) (RouterInfo *router);
+    void (*update_graph) (RouterInfo *router);
+
+} UrcSink;
+
+/* the sink in use */
+extern const UrcSink *urc_sink;
+
+/* prints the state changes, for headless mode */
+extern const UrcSink urc_log_sink;
+
+void
+urc_sink_set (const UrcSink *sink);
+
+#endif /* __URC_SINK_H__ */
@@ -0,0 +1,752 @@
+/* urc-traffic-log.c
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "urc-traffic-log.h"
+
+extern gboolean opt_debug;
+
+/* Traffic history file, one per router UDN.
+ *
+ * After a 16 bytes file header the file is a sequence of fixed size
+ * blocks, only the last one is still being filled. A block header holds
+ * the absolute values of its first sample, the following samples are
+ * varints of zigzag encoded deltas:
+ *
+ *   time:      change of the interval from the previous one, in ms
+ *   received:  bytes since the previous sample
+ *   sent:      bytes since the previous sample
+ *
+ * With a steady 1 s poll the time takes one byte and a sample is a few
+ * bytes. A block flagged BLOCK_FLAG_GAP starts after a reading with no
+ * rate (first one of a run, counter reset): there is no rate between
+ * its first sample and the previous one. Blocks are sorted by time, a range query seeks with a binary
+ * search on the block headers of the mapped file.
+ *
+ * The rates are not stored, they follow from two adjacent samples. Next
+ * to the log, the ".tiers" file keeps a checkpoint of the rollups built
+ * from it so far (see urc_history_save()): a restart reads it and only
+ * the samples logged after it, instead of the whole log. */
+
+#define LOG_MAGIC "URCTLOG1"
+#define LOG_HEADER_SIZE 16
+
+#define BLOCK_MAGIC 0x42435255 /* "URCB" */
+#define BLOCK_SIZE 4096
+#define BLOCK_HEADER_SIZE 40
+#define BLOCK_PAYLOAD_SIZE (BLOCK_SIZE - BLOCK_HEADER_SIZE)
+
+#define BLOCK_FLAG_GAP 1
+
+/* three 64 bit varints */
+#define SAMPLE_MAX_SIZE 30
+
+/* samples between two writes of the open block */
+#define FLUSH_SAMPLES 60
+
+#define CHECKPOINT_MAGIC "URCTCKP1"
+#define CHECKPOINT_HEADER_SIZE 16
+
+/* longer intervals are a gap, no rate across them */
+#define MAX_SAMPLE_INTERVAL (10 * G_USEC_PER_SEC)
+
+typedef struct
+{
+    guint32 count;
+    guint32 used;
+    guint32 flags;
+    gint64  time;
+    guint64 received;
+    guint64 sent;
+    guint8  payload[BLOCK_PAYLOAD_SIZE];
+} LogBlock;
+
+/* Decoder/encoder position inside a block */
+typedef struct
+{
+    UrcTrafficSample sample;
+    gint64 interval_ms;
+    gsize offset;
+} LogCursor;
+
+struct _UrcTrafficLog
+{
+    gchar *path;
+    FILE *file;
+
+    /* block being filled and its index in the file */
+    LogBlock block;
+    guint64 block_index;
+    gboolean block_open;
+    LogCursor last;
+
+    guint unflushed;
+
+    /* the next sample starts a block flagged BLOCK_FLAG_GAP */
+    gboolean gap;
+};
+
+static inline guint64
+zigzag_encode (gint64 value)
+{
+    return ((guint64) value << 1) ^ (guint64) (value >> 63);
+}
+
+static inline gint64
+zigzag_decode (guint64 value)
+{
+    return (gint64) (value >> 1) ^ -(gint64) (value & 1);
+}
+
+static gsize
+varint_write (guint8 *buf, guint64 value)
+{
+    gsize len = 0;
+
+    while (value >= 0x80) {
+        buf[len++] = (guint8) (value | 0x80);
+        value >>= 7;
+    }
+    buf[len++] = (guint8) value;
+
+    return len;
+}
+
+/* Returns 0 on truncated or overlong input */
+static gsize
+varint_read (const guint8 *buf, gsize size, guint64 *value)
+{
+    guint64 result = 0;
+    guint shift = 0;
+    gsize len = 0;
+
+    while (len < size && shift < 64) {
+        result |= (guint64) (buf[len] & 0x7f) << shift;
+
+        if ((buf[len++] & 0x80) == 0) {
+            *value = result;
+            return len;
+        }
+        shift += 7;
+    }
+
+    return 0;
+}
+
+static void
+block_header_write (const LogBlock *block, guint8 *buf)
+{
+    guint32 u32;
+    guint64 u64;
+
+    u32 = GUINT32_TO_LE (BLOCK_MAGIC);     memcpy (buf, &u32, 4);
+    u32 = GUINT32_TO_LE (block->count);    memcpy (buf + 4, &u32, 4);
+    u32 = GUINT32_TO_LE (block->used);     memcpy (buf + 8, &u32, 4);
+    u32 = GUINT32_TO_LE (block->flags);    memcpy (buf + 12, &u32, 4);
+    u64 = GUINT64_TO_LE (block->time);     memcpy (buf + 16, &u64, 8);
+    u64 = GUINT64_TO_LE (block->received); memcpy (buf + 24, &u64, 8);
+    u64 = GUINT64_TO_LE (block->sent);     memcpy (buf + 32, &u64, 8);
+}
+
+static gboolean
+block_header_read (const guint8 *buf, LogBlock *block)
+{
+    guint32 u32;
+    guint64 u64;
+
+    memcpy (&u32, buf, 4);
+    if (GUINT32_FROM_LE (u32) != BLOCK_MAGIC)
+        return FALSE;
+
+    memcpy (&u32, buf + 4, 4);  block->count = GUINT32_FROM_LE (u32);
+    memcpy (&u32, buf + 8, 4);  block->used = GUINT32_FROM_LE (u32);
+    memcpy (&u32, buf + 12, 4); block->flags = GUINT32_FROM_LE (u32);
+    memcpy (&u64, buf + 16, 8); block->time = (gint64) GUINT64_FROM_LE (u64);
+    memcpy (&u64, buf + 24, 8); block->received = GUINT64_FROM_LE (u64);
+    memcpy (&u64, buf + 32, 8); block->sent = GUINT64_FROM_LE (u64);
+
+    return block->count > 0 && block->used <= BLOCK_PAYLOAD_SIZE;
+}
+
+static void
+cursor_init (LogCursor *cursor, const LogBlock *block)
+{
+    cursor->sample.time = block->time;
+    cursor->sample.received = block->received;
+    cursor->sample.sent = block->sent;
+    cursor->interval_ms = 0;
+    cursor->offset = 0;
+}
+
+/* Decode the sample after the cursor, FALSE at the end of the block */
+static gboolean
+cursor_next (LogCursor *cursor, const guint8 *payload, gsize used)
+{
+    guint64 dt, drx, dtx;
+    gsize len;
+
+    if (cursor->offset >= used)
+        return FALSE;
+
+    len = varint_read (payload + cursor->offset, used - cursor->offset, &dt);
+    if (len == 0)
+        return FALSE;
+    cursor->offset += len;
+
+    len = varint_read (payload + cursor->offset, used - cursor->offset, &drx);
+    if (len == 0)
+        return FALSE;
+    cursor->offset += len;
+
+    len = varint_read (payload + cursor->offset, used - cursor->offset, &dtx);
+    if (len == 0)
+        return FALSE;
+    cursor->offset += len;
+
+    cursor->interval_ms += zigzag_decode (dt);
+    cursor->sample.time += cursor->interval_ms * 1000;
+    cursor->sample.received += zigzag_decode (drx);
+    cursor->sample.sent += zigzag_decode (dtx);
+
+    return TRUE;
+}
+
+static gchar*
+traffic_log_path (const gchar *udn)
+{
+    gchar *name, *path;
+    gchar *p;
+
+    name = g_strdup (udn);
+    for (p = name; *p != '\0'; p++) {
+        if (!g_ascii_isalnum (*p) && *p != '-')
+            *p = '_';
+    }
+
+    path = g_build_filename (g_get_user_data_dir (), "upnp-router-control", "history", name, NULL);
+    g_free (name);
+
+    return path;
+}
+
+static gboolean
+traffic_log_write_block (UrcTrafficLog *log)
+{
+    guint8 header[BLOCK_HEADER_SIZE];
+
+    block_header_write (&log->block, header);
+
+    if (fseeko (log->file, LOG_HEADER_SIZE + (off_t) log->block_index * BLOCK_SIZE, SEEK_SET) != 0 ||
+        fwrite (header, 1, BLOCK_HEADER_SIZE, log->file) != BLOCK_HEADER_SIZE ||
+        fwrite (log->block.payload, 1, BLOCK_PAYLOAD_SIZE, log->file) != BLOCK_PAYLOAD_SIZE ||
+        fflush (log->file) != 0) {
+
+        g_printerr ("\e[31m[EE]\e[0m Traffic history %s: %s\n", log->path, g_strerror (errno));
+        return FALSE;
+    }
+
+    log->unflushed = 0;
+
+    return TRUE;
+}
+
+/* Reload the last block to keep appending to it */
+static void
+traffic_log_resume (UrcTrafficLog *log, guint64 n_blocks)
+{
+    guint8 header[BLOCK_HEADER_SIZE];
+
+    log->block_index = n_blocks;
+    log->block_open = FALSE;
+
+    if (n_blocks == 0)
+        return;
+
+    if (fseeko (log->file, LOG_HEADER_SIZE + (off_t) (n_blocks - 1) * BLOCK_SIZE, SEEK_SET) != 0 ||
+        fread (header, 1, BLOCK_HEADER_SIZE, log->file) != BLOCK_HEADER_SIZE ||
+        fread (log->block.payload, 1, BLOCK_PAYLOAD_SIZE, log->file) != BLOCK_PAYLOAD_SIZE ||
+        !block_header_read (header, &log->block))
+        return;
+
+    if (log->block.used + SAMPLE_MAX_SIZE > BLOCK_PAYLOAD_SIZE)
+        return;
+
+    /* position after the last sample */
+    cursor_init (&log->last, &log->block);
+    while (cursor_next (&log->last, log->block.payload, log->block.used))
+        ;
+
+    log->block.used = log->last.offset;
+    log->block_index = n_blocks - 1;
+    log->block_open = TRUE;
+}
+
+/* Open (or create) the history of a router */
+UrcTrafficLog*
+urc_traffic_log_open (const gchar  *udn,
+                      GError      **error)
+{
+    UrcTrafficLog *log;
+    gchar header[LOG_HEADER_SIZE];
+    gchar *dir, *old_path;
+    guint32 block_size;
+    off_t size;
+
+    log = g_malloc0 (sizeof (UrcTrafficLog));
+    log->path = traffic_log_path (udn);
+
+    dir = g_path_get_dirname (log->path);
+    g_mkdir_with_parents (dir, 0700);
+    g_free (dir);
+
+    log->file = g_fopen (log->path, "r+b");
+    if (log->file == NULL)
+        log->file = g_fopen (log->path, "w+b");
+
+    if (log->file == NULL) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "%s: %s", log->path, g_strerror (errno));
+        g_free (log->path);
+        g_free (log);
+        return NULL;
+    }
+
+    fseeko (log->file, 0, SEEK_END);
+    size = ftello (log->file);
+    rewind (log->file);
+
+    if (size >= LOG_HEADER_SIZE &&
+        fread (header, 1, LOG_HEADER_SIZE, log->file) == LOG_HEADER_SIZE &&
+        memcmp (header, LOG_MAGIC, 8) == 0) {
+
+        memcpy (&block_size, header + 8, 4);
+
+        if (GUINT32_FROM_LE (block_size) == BLOCK_SIZE) {
+            /* a partial block at the end is a write cut short, drop it */
+            traffic_log_resume (log, (size - LOG_HEADER_SIZE) / BLOCK_SIZE);
+            return log;
+        }
+    }
+
+    if (size > 0) {
+        /* not ours, keep it aside */
+        old_path = g_strconcat (log->path, ".old", NULL);
+        g_printerr ("\e[33m[WW]\e[0m Traffic history %s is not readable, moved to %s\n", log->path, old_path);
+
+        fclose (log->file);
+        g_rename (log->path, old_path);
+        g_free (old_path);
+
+        log->file = g_fopen (log->path, "w+b");
+        if (log->file == NULL) {
+            g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                         "%s: %s", log->path, g_strerror (errno));
+            g_free (log->path);
+            g_free (log);
+            return NULL;
+        }
+    }
+
+    memset (header, 0, LOG_HEADER_SIZE);
+    memcpy (header, LOG_MAGIC, 8);
+    block_size = GUINT32_TO_LE (BLOCK_SIZE);
+    memcpy (header + 8, &block_size, 4);
+
+    if (fwrite (header, 1, LOG_HEADER_SIZE, log->file) != LOG_HEADER_SIZE) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "%s: %s", log->path, g_strerror (errno));
+        fclose (log->file);
+        g_free (log->path);
+        g_free (log);
+        return NULL;
+    }
+
+    return log;
+}
+
+gboolean
+urc_traffic_log_flush (UrcTrafficLog *log)
+{
+    if (log == NULL || !log->block_open || log->unflushed == 0)
+        return TRUE;
+
+    return traffic_log_write_block (log);
+}
+
+void
+urc_traffic_log_close (UrcTrafficLog *log)
+{
+    if (log == NULL)
+        return;
+
+    urc_traffic_log_flush (log);
+
+    fclose (log->file);
+    g_free (log->path);
+    g_free (log);
+}
+
+/* Add a counters reading, "time" must not go back */
+gboolean
+urc_traffic_log_append (UrcTrafficLog *log,
+                        gint64         time,
+                        guint64        received,
+                        guint64        sent)
+{
+    guint8 *buf;
+    gint64 interval_ms;
+
+    if (log->block_open && time < log->last.sample.time)
+        return FALSE;
+
+    /* full or after a gap, write it and start the next one */
+    if (log->block_open && (log->gap || log->block.used + SAMPLE_MAX_SIZE > BLOCK_PAYLOAD_SIZE)) {
+        if (log->unflushed > 0 && !traffic_log_write_block (log))
+            return FALSE;
+
+        log->block_index++;
+        log->block_open = FALSE;
+    }
+
+    if (!log->block_open) {
+        memset (&log->block, 0, sizeof (LogBlock));
+        log->block.count = 1;
+        log->block.flags = log->gap ? BLOCK_FLAG_GAP : 0;
+        log->block.time = time;
+        log->block.received = received;
+        log->block.sent = sent;
+
+        cursor_init (&log->last, &log->block);
+        log->block_open = TRUE;
+        log->gap = FALSE;
+    }
+    else {
+        buf = log->block.payload + log->block.used;
+
+        /* round to the ms as the decoder does */
+        interval_ms = (time - log->last.sample.time + 500) / 1000;
+
+        log->block.used += varint_write (buf, zigzag_encode (interval_ms - log->last.interval_ms));
+        log->block.used += varint_write (log->block.payload + log->block.used,
+                                         zigzag_encode ((gint64) (received - log->last.sample.received)));
+        log->block.used += varint_write (log->block.payload + log->block.used,
+                                         zigzag_encode ((gint64) (sent - log->last.sample.sent)));
+        log->block.count++;
+
+        log->last.interval_ms = interval_ms;
+        log->last.sample.time += interval_ms * 1000;
+        log->last.sample.received = received;
+        log->last.sample.sent = sent;
+        log->last.offset = log->block.used;
+    }
+
+    if (++log->unflushed >= FLUSH_SAMPLES)
+        return traffic_log_write_block (log);
+
+    return TRUE;
+}
+
+/* The counters could not give a rate, the reading appended next starts
+ * over: no rate is computed across it */
+void
+urc_traffic_log_append_gap (UrcTrafficLog *log)
+{
+    log->gap = TRUE;
+}
+
+static const guint8*
+mapped_block (const gchar *data, gsize size, guint64 index)
+{
+    gsize offset = LOG_HEADER_SIZE + index * BLOCK_SIZE;
+
+    if (offset + BLOCK_SIZE > size)
+        return NULL;
+
+    return (const guint8 *) data + offset;
+}
+
+/* Call "func" for the samples between "from" and "to" (wall clock, us),
+ * returns the number of samples visited */
+guint
+urc_traffic_log_foreach (UrcTrafficLog     *log,
+                         gint64             from,
+                         gint64             to,
+                         UrcTrafficLogFunc  func,
+                         gpointer           user_data)
+{
+    GMappedFile *mapped;
+    GError *error = NULL;
+    const gchar *data;
+    const guint8 *buf;
+    gsize size;
+    guint64 n_blocks, lo, hi, mid, index;
+    LogBlock block;
+    LogCursor cursor;
+    UrcTrafficSample prev;
+    gboolean have_prev = FALSE, more;
+    gdouble elapsed, down_rate, up_rate;
+    gboolean rates_valid;
+    guint visited = 0;
+    gint64 start_time = g_get_monotonic_time ();
+
+    urc_traffic_log_flush (log);
+
+    mapped = g_mapped_file_new (log->path, FALSE, &error);
+    if (mapped == NULL) {
+        g_printerr ("\e[31m[EE]\e[0m Traffic history: %s\n", error->message);
+        g_error_free (error);
+        return 0;
+    }
+
+    data = g_mapped_file_get_contents (mapped);
+    size = g_mapped_file_get_length (mapped);
+    n_blocks = size > LOG_HEADER_SIZE ? (size - LOG_HEADER_SIZE) / BLOCK_SIZE : 0;
+
+    /* last block starting at or before "from" */
+    lo = 0;
+    hi = n_blocks;
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+
+        if (block_header_read (mapped_block (data, size, mid), &block) && block.time <= from)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    for (index = lo; index < n_blocks; index++) {
+
+        buf = mapped_block (data, size, index);
+
+        if (!block_header_read (buf, &block))
+            continue;
+        if (block.time > to)
+            break;
+
+        cursor_init (&cursor, &block);
+        more = TRUE;
+
+        if (block.flags & BLOCK_FLAG_GAP)
+            have_prev = FALSE;
+
+        while (more && cursor.sample.time <= to) {
+
+            if (cursor.sample.time >= from) {
+
+                rates_valid = FALSE;
+                down_rate = up_rate = 0.0;
+
+                if (have_prev &&
+                    cursor.sample.time > prev.time &&
+                    cursor.sample.time - prev.time <= MAX_SAMPLE_INTERVAL &&
+                    cursor.sample.received >= prev.received &&
+                    cursor.sample.sent >= prev.sent) {
+
+                    elapsed = (gdouble) (cursor.sample.time - prev.time) / G_USEC_PER_SEC;
+                    down_rate = (cursor.sample.received - prev.received) / elapsed / 1024.0;
+                    up_rate = (cursor.sample.sent - prev.sent) / elapsed / 1024.0;
+                    rates_valid = TRUE;
+                }
+
+                func (&cursor.sample, rates_valid, down_rate, up_rate, user_data);
+                visited++;
+            }
+
+            prev = cursor.sample;
+            have_prev = TRUE;
+
+            more = cursor_next (&cursor, buf + BLOCK_HEADER_SIZE, block.used);
+        }
+
+        if (more)
+            break;
+    }
+
+    g_mapped_file_unref (mapped);
+
+    if (opt_debug)
+        g_print ("\e[34mTraffic history: %u samples read in %fs\e[0m\n",
+                 visited, ((double) g_get_monotonic_time () - start_time) / G_USEC_PER_SEC);
+
+    return visited;
+}
+
+static gchar*
+traffic_log_checkpoint_path (UrcTrafficLog *log)
+{
+    return g_strconcat (log->path, ".tiers", NULL);
+}
+
+/* Keep "data", the state built from the samples up to "time" */
+gboolean
+urc_traffic_log_save_checkpoint (UrcTrafficLog *log,
+                                 gint64         time,
+                                 const guint8  *data,
+                                 gsize          length)
+{
+    GError *error = NULL;
+    gchar *path, *contents;
+    guint64 u64;
+    gboolean saved;
+
+    contents = g_malloc (CHECKPOINT_HEADER_SIZE + length);
+    memcpy (contents, CHECKPOINT_MAGIC, 8);
+    u64 = GUINT64_TO_LE (time);
+    memcpy (contents + 8, &u64, 8);
+    memcpy (contents + CHECKPOINT_HEADER_SIZE, data, length);
+
+    path = traffic_log_checkpoint_path (log);
+    saved = g_file_set_contents (path, contents, CHECKPOINT_HEADER_SIZE + length, &error);
+
+    if (!saved) {
+        g_printerr ("\e[31m[EE]\e[0m Traffic history %s: %s\n", path, error->message);
+        g_error_free (error);
+    }
+
+    g_free (path);
+    g_free (contents);
+
+    return saved;
+}
+
+/* The last checkpoint and the time of its last sample, NULL if none */
+guint8*
+urc_traffic_log_load_checkpoint (UrcTrafficLog *log,
+                                 gint64        *time,
+                                 gsize         *length)
+{
+    gchar *path, *contents = NULL;
+    guint8 *data = NULL;
+    guint64 u64;
+    gsize size;
+
+    path = traffic_log_checkpoint_path (log);
+
+    if (!g_file_get_contents (path, &contents, &size, NULL) ||
+        size < CHECKPOINT_HEADER_SIZE ||
+        memcmp (contents, CHECKPOINT_MAGIC, 8) != 0)
+        goto out;
+
+    memcpy (&u64, contents + 8, 8);
+    *time = (gint64) GUINT64_FROM_LE (u64);
+
+    *length = size - CHECKPOINT_HEADER_SIZE;
+    memmove (contents, contents + CHECKPOINT_HEADER_SIZE, *length);
+
+    data = (guint8 *) contents;
+    contents = NULL;
+
+out:
+    g_free (contents);
+    g_free (path);
+
+    return data;
+}
+
+/* Drop the blocks whose samples are all older than "before". The file
+ * is rewritten, so only once a quarter of it or more can go. */
+gboolean
+urc_traffic_log_prune (UrcTrafficLog *log,
+                       gint64         before)
+{
+    guint8 buf[BLOCK_SIZE];
+    LogBlock block;
+    FILE *file;
+    gchar *tmp_path;
+    guint64 n_blocks, lo, hi, mid, index;
+    off_t size;
+
+    if (!urc_traffic_log_flush (log))
+        return FALSE;
+
+    fseeko (log->file, 0, SEEK_END);
+    size = ftello (log->file);
+    n_blocks = size > LOG_HEADER_SIZE ? (size - LOG_HEADER_SIZE) / BLOCK_SIZE : 0;
+
+    /* first block with samples at or after "before" */
+    lo = 0;
+    hi = n_blocks;
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+
+        if (fseeko (log->file, LOG_HEADER_SIZE + (off_t) mid * BLOCK_SIZE, SEEK_SET) == 0 &&
+            fread (buf, 1, BLOCK_HEADER_SIZE, log->file) == BLOCK_HEADER_SIZE &&
+            block_header_read (buf, &block) && block.time <= before)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0 || lo < n_blocks / 4)
+        return TRUE;
+
+    tmp_path = g_strconcat (log->path, ".tmp", NULL);
+
+    file = g_fopen (tmp_path, "w+b");
+    if (file == NULL)
+        goto fail;
+
+    rewind (log->file);
+
+    if (fread (buf, 1, LOG_HEADER_SIZE, log->file) != LOG_HEADER_SIZE ||
+        fwrite (buf, 1, LOG_HEADER_SIZE, file) != LOG_HEADER_SIZE ||
+        fseeko (log->file, LOG_HEADER_SIZE + (off_t) lo * BLOCK_SIZE, SEEK_SET) != 0)
+        goto fail;
+
+    for (index = lo; index < n_blocks; index++) {
+        if (fread (buf, 1, BLOCK_SIZE, log->file) != BLOCK_SIZE ||
+            fwrite (buf, 1, BLOCK_SIZE, file) != BLOCK_SIZE)
+            goto fail;
+    }
+
+    if (fflush (file) != 0 || g_rename (tmp_path, log->path) != 0)
+        goto fail;
+
+    if (opt_debug)
+        g_print ("\e[34mTraffic history: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " blocks pruned\e[0m\n",
+                 lo, n_blocks);
+
+    fclose (log->file);
+    log->file = file;
+    log->block_index -= lo;
+
+    g_free (tmp_path);
+
+    return TRUE;
+
+fail:
+    g_printerr ("\e[31m[EE]\e[0m Traffic history %s: %s\n", tmp_path, g_strerror (errno));
+
+    if (file != NULL) {
+        fclose (file);
+        g_unlink (tmp_path);
+    }
+
+    g_free (tmp_path);
+
+    return FALSE;
+}
@@ -0,0 +1,86 @@
+/* urc-traffic-log.h
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __URC_TRAFFIC_LOG_H__
+#define __URC_TRAFFIC_LOG_H__
+
+#include <glib.h>
+
+/* One reading of the WAN byte counters, "time" is wall clock in us */
+typedef struct
+{
+    gint64  time;
+    guint64 received;
+    guint64 sent;
+} UrcTrafficSample;
+
+/* Called for each sample of a range, the rates are in KiB/s against
+ * the previous sample and "rates_valid" is FALSE when there is none
+ * (first sample, gap in the log or counter reset) */
+typedef void (*UrcTrafficLogFunc) (const UrcTrafficSample *sample,
+                                   gboolean                rates_valid,
+                                   gdouble                 down_rate,
+                                   gdouble                 up_rate,
+                                   gpointer                user_data);
+
+typedef struct _UrcTrafficLog UrcTrafficLog;
+
+UrcTrafficLog*
+urc_traffic_log_open (const gchar  *udn,
+                      GError      **error);
+
+void
+urc_traffic_log_close (UrcTrafficLog *log);
+
+gboolean
+urc_traffic_log_append (UrcTrafficLog *log,
+                        gint64         time,
+                        guint64        received,
+                        guint64        sent);
+
+void
+urc_traffic_log_append_gap (UrcTrafficLog *log);
+
+gboolean
+urc_traffic_log_flush (UrcTrafficLog *log);
+
+guint
+urc_traffic_log_foreach (UrcTrafficLog     *log,
+                         gint64             from,
+                         gint64             to,
+                         UrcTrafficLogFunc  func,
+                         gpointer           user_data);
+
+gboolean
+urc_traffic_log_prune (UrcTrafficLog *log,
+                       gint64         before);
+
+gboolean
+urc_traffic_log_save_checkpoint (UrcTrafficLog *log,
+                                 gint64         time,
+                                 const guint8  *data,
+                                 gsize          length);
+
+guint8*
+urc_traffic_log_load_checkpoint (UrcTrafficLog *log,
+                                 gint64        *time,
+                                 gsize         *length);
+
+#endif /* __URC_TRAFFIC_LOG_H__ */
@@ -24,113 +24,324 @@
 #include <glib.h>
 #include <libgupnp/gupnp.h>
 #include <libgssdp/gssdp.h>
-
-#include "urc-gui.h"
-#include "urc-graph.h"
+#include <libxml/parser.h>
+
+#include "urc-action.h"
+#include "urc-counter.h"
+#include "urc-doc-cache.h"
+#include "urc-http.h"
+#include "urc-mapping.h"
+#include "urc-mapping-store.h"
+#include "urc-metrics.h"
+#include "urc-router-cache.h"
+#include "urc-scpd.h"
+#include "urc-sink.h"
 #include "urc-upnp.h"
+#include "urc-worker.h"
 
 extern gboolean opt_debug;
+extern UrcRateFilter opt_rate_filter;
 extern char* opt_bindif;
 extern guint opt_bindport;
+extern guint opt_mapping_window;
+extern guint opt_metrics_port;
 
 
 static const gchar* client_ip = NULL;
 GUPnPContextManager *context_mngr = NULL;
 
+/* Routers managed, root device UDN -> RouterInfo */
+static GHashTable *routers = NULL;
+
 const gchar* get_client_ip()
 {
     return client_ip;
 }
 
-gboolean delete_port_mapped(GUPnPServiceProxy *wan_service, const gchar *protocol, const guint external_port, const gchar *remote_host, GError **error)
+PortForwardInfo* port_forward_info_copy(const PortForwardInfo *port_info)
+{
+    PortForwardInfo *copy;
+
+    copy = g_malloc( sizeof(PortForwardInfo) );
+
+    copy->enabled = port_info->enabled;
+    copy->description = g_strdup(port_info->description);
+    copy->protocol = g_strdup(port_info->protocol);
+    copy->internal_port = port_info->internal_port;
+    copy->external_port = port_info->external_port;
+    copy->internal_host = g_strdup(port_info->internal_host);
+    copy->remote_host = g_strdup(port_info->remote_host);
+    copy->lease_time = port_info->lease_time;
+
+    return copy;
+}
+
+void port_forward_info_free(PortForwardInfo *port_info)
+{
+    if(port_info == NULL)
+        return;
+
+    g_free (port_info->description);
+    g_free (port_info->protocol);
+    g_free (port_info->internal_host);
+    g_free (port_info->remote_host);
+    g_free (port_info);
+}
+
+typedef struct
+{
+    RouterInfo *router;
+    PortForwardInfo *port_info;
+    /* TRUE for DeletePortMapping */
+    gboolean delete;
+    UrcPortMappingCallback callback;
+    gpointer user_data;
+
+} PortMappingRequest;
+
+static PortMappingRequest* port_mapping_request_new(RouterInfo *router, PortForwardInfo *port_info, gboolean delete, UrcPortMappingCallback callback, gpointer user_data)
+{
+    PortMappingRequest *request;
+
+    request = g_malloc( sizeof(PortMappingRequest) );
+    request->router = router;
+    request->port_info = port_info;
+    request->delete = delete;
+    request->callback = callback;
+    request->user_data = user_data;
+
+    return request;
+}
+
+static void port_mapping_request_done(PortMappingRequest *request, const GError *error)
+{
+    if(request->callback != NULL)
+        request->callback(request->port_info, error, request->user_data);
+
+    port_forward_info_free(request->port_info);
+    g_free(request);
+}
+
+/* The router went away before the reply: the request did not complete,
+ * and its router must not be touched anymore */
+static void port_mapping_request_cancelled(PortMappingRequest *request)
+{
+    GError *error;
+
+    error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED, "Operation was cancelled");
+    port_mapping_request_done(request, error);
+    g_error_free(error);
+}
+
+/* Store the mapping as read back from the router and show it */
+static void port_mapping_store_set(RouterInfo *router, PortForwardInfo *port_info)
+{
+    PortForwardInfo *stored;
+
+    if(urc_mapping_store_insert(router->port_mappings, port_info)) {
+
+        stored = urc_mapping_store_lookup(router->port_mappings,
+                                          port_info->remote_host,
+                                          port_info->external_port,
+                                          port_info->protocol);
+        urc_sink->update_mapped_port(router, stored);
+    }
+
+    urc_metrics_set_port_mappings(router->udn, urc_mapping_store_size(router->port_mappings));
+}
+
+static void port_mapping_store_unset(RouterInfo *router, const PortForwardInfo *port_info)
+{
+    urc_mapping_store_remove(router->port_mappings,
+                             port_info->remote_host,
+                             port_info->external_port,
+                             port_info->protocol);
+    urc_sink->remove_mapped_port(router, port_info);
+
+    urc_metrics_set_port_mappings(router->udn, urc_mapping_store_size(router->port_mappings));
+}
+
+static void port_mapping_verify_cb(GUPnPServiceProxyAction *action, GError *error, const UrcActionInfo *info, gpointer user_data)
+{
+    PortMappingRequest *request = (PortMappingRequest *) user_data;
+    PortForwardInfo *port_info;
+
+    /* the change went through but could not be read back */
+    if (urc_action_cancelled (error)) {
+        port_mapping_request_cancelled(request);
+        return;
+    }
+
+    port_info = g_malloc0( sizeof(PortForwardInfo) );
+    port_info->remote_host = g_strdup(request->port_info->remote_host);
+    port_info->external_port = request->port_info->external_port;
+    port_info->protocol = g_strdup(request->port_info->protocol);
+
+    if (error == NULL) {
+        gupnp_service_proxy_action_get_result (action,
+                       /* Error location */
+                       &error,
+                       /* OUT args */
+                       "NewInternalPort",
+                       G_TYPE_UINT, &port_info->internal_port,
+                       "NewInternalClient",
+                       G_TYPE_STRING, &port_info->internal_host,
+                       "NewEnabled",
+                       G_TYPE_BOOLEAN, &port_info->enabled,
+                       "NewPortMappingDescription",
+                       G_TYPE_STRING, &port_info->description,
+                       "NewLeaseDuration",
+                       G_TYPE_UINT, &port_info->lease_time,
+                       NULL);
+    }
+
+    if (error == NULL) {
+        if (request->delete)
+            g_print("\e[33m[WW]\e[0m Port %d (%s) still mapped after removal\n", port_info->external_port, port_info->protocol);
+
+        port_mapping_store_set(request->router, port_info);
+    }
+    // error 714: NoSuchEntryInArray
+    else if (error->code == 714) {
+        if (!request->delete)
+            g_print("\e[33m[WW]\e[0m Port %d (%s) not found after adding it\n", port_info->external_port, port_info->protocol);
+
+        port_mapping_store_unset(request->router, port_info);
+        port_forward_info_free(port_info);
+    }
+    else {
+        /* can't read it back, assume the request took effect */
+        if(opt_debug)
+            g_print("\e[33m[WW]\e[0m GetSpecificPortMappingEntry: %s (%i)\n", error->message, error->code);
+
+        port_forward_info_free(port_info);
+
+        if (request->delete)
+            port_mapping_store_unset(request->router, request->port_info);
+        else
+            port_mapping_store_set(request->router, port_forward_info_copy(request->port_info));
+    }
+
+    g_clear_error (&error);
+
+    port_mapping_request_done(request, NULL);
+}
+
+static void port_mapping_own_change_failed(RouterInfo *router)
+{
+    if (router->own_mapping_changes > 0)
+        router->own_mapping_changes--;
+}
+
+/* Read back a single mapping after changing it */
+static void port_mapping_verify(PortMappingRequest *request)
 {
-    GError *local_error = NULL;
     GUPnPServiceProxyAction *action = NULL;
 
     action = gupnp_service_proxy_action_new(
-                "DeletePortMapping",
+                "GetSpecificPortMappingEntry",
                 /* IN args */
                 "NewRemoteHost",
-                G_TYPE_STRING, remote_host,
+                G_TYPE_STRING, request->port_info->remote_host,
                 "NewExternalPort",
-                G_TYPE_UINT, external_port,
+                G_TYPE_UINT, request->port_info->external_port,
                 "NewProtocol",
-                G_TYPE_STRING, protocol,
+                G_TYPE_STRING, request->port_info->protocol,
                 NULL
     );
 
-    gupnp_service_proxy_call_action(wan_service,
-                                    action,
-                                    NULL,
-                                    &local_error);
+    urc_action_call(request->router->wan_conn_service,
+                    "GetSpecificPortMappingEntry",
+                    action,
+                    request->router->cancellable,
+                    port_mapping_verify_cb,
+                    request);
+}
+
+static void delete_port_mapped_cb(GUPnPServiceProxyAction *action, GError *error, const UrcActionInfo *info, gpointer user_data)
+{
+    PortMappingRequest *request = (PortMappingRequest *) user_data;
+
+    if (urc_action_cancelled (error)) {
+        port_mapping_request_cancelled(request);
+        return;
+    }
 
-    if (local_error != NULL) {
+    if (error != NULL) {
         goto out;
     }
 
-    gupnp_service_proxy_action_get_result (action, &local_error, NULL);
-    gupnp_service_proxy_action_unref (action);
+    gupnp_service_proxy_action_get_result (action, &error, NULL);
 
-    if (local_error == NULL) {
-        g_print("\e[36m*** Removed entry:\e[0m Port %d (%s)\n", external_port, protocol);
+    if (error == NULL) {
+        g_print("\e[36m*** Removed entry:\e[0m Port %d (%s)\n", request->port_info->external_port, request->port_info->protocol);
 
-        error = NULL;
-        return TRUE;
+        port_mapping_verify(request);
+        return;
     }
 
     out:
-    if (local_error != NULL) {
-        g_warning ("\e[31m[EE]\e[0m DeletePortMapping: %s (%i)\n", local_error->message, local_error->code);
+    if (error != NULL) {
+        g_warning ("\e[31m[EE]\e[0m DeletePortMapping: %s (%i)\n", error->message, error->code);
 
-        *error = g_error_copy(local_error);
-        g_error_free (local_error);
+        /* no change, no event */
+        port_mapping_own_change_failed(request->router);
 
-        return FALSE;
+        port_mapping_request_done(request, error);
+        g_error_free (error);
     }
-
-    return FALSE;
 }
 
-gboolean add_port_mapping(GUPnPServiceProxy *wan_service, PortForwardInfo* port_info, GError **error)
+void delete_port_mapped(RouterInfo *router, const gchar *protocol, const guint external_port, const gchar *remote_host, UrcPortMappingCallback callback, gpointer user_data)
 {
-    GError *local_error = NULL;
     GUPnPServiceProxyAction *action = NULL;
+    PortForwardInfo *port_info;
+
+    /* only the mapping key is known here */
+    port_info = g_malloc0( sizeof(PortForwardInfo) );
+    port_info->protocol = g_strdup(protocol);
+    port_info->external_port = external_port;
+    port_info->remote_host = g_strdup(remote_host);
 
     action = gupnp_service_proxy_action_new(
-                "AddPortMapping",
+                "DeletePortMapping",
                 /* IN args */
                 "NewRemoteHost",
-                G_TYPE_STRING, port_info->remote_host,
+                G_TYPE_STRING, remote_host,
                 "NewExternalPort",
-                G_TYPE_UINT, port_info->external_port,
+                G_TYPE_UINT, external_port,
                 "NewProtocol",
-                G_TYPE_STRING, port_info->protocol,
-                "NewInternalPort",
-                G_TYPE_UINT, port_info->internal_port,
-                "NewInternalClient",
-                G_TYPE_STRING, port_info->internal_host,
-                "NewEnabled",
-                G_TYPE_BOOLEAN, port_info->enabled,
-                "NewPortMappingDescription",
-                G_TYPE_STRING, port_info->description,
-                "NewLeaseDuration",
-                G_TYPE_UINT, port_info->lease_time,
+                G_TYPE_STRING, protocol,
                 NULL
-            );
+    );
+
+    router->own_mapping_changes++;
+
+    urc_action_call(router->wan_conn_service,
+                    "DeletePortMapping",
+                    action,
+                    router->cancellable,
+                    delete_port_mapped_cb,
+                    port_mapping_request_new(router, port_info, TRUE, callback, user_data));
+}
+
+static void add_port_mapping_cb(GUPnPServiceProxyAction *action, GError *error, const UrcActionInfo *info, gpointer user_data)
+{
+    PortMappingRequest *request = (PortMappingRequest *) user_data;
+    PortForwardInfo *port_info = request->port_info;
 
-    gupnp_service_proxy_call_action(wan_service,
-                                    action,
-                                    NULL,
-                                    &local_error);
+    if (urc_action_cancelled (error)) {
+        port_mapping_request_cancelled(request);
+        return;
+    }
 
-    if (local_error != NULL) {
+    if (error != NULL) {
         goto out;
     }
 
-    gupnp_service_proxy_action_get_result (action, &local_error, NULL);
-    gupnp_service_proxy_action_unref (action);
+    gupnp_service_proxy_action_get_result (action, &error, NULL);
 
-    if (local_error == NULL) {
+    if (error == NULL) {
 
         g_print ("\e[36m*** Added entry: \e[0m%s\n", port_info->description );
         g_print ("    RemoteIP: %s, ExtPort: %d %s, IntPort: %d, IntIP: %s\n",
@@ -141,169 +352,143 @@ gboolean add_port_mapping(GUPnPServiceProxy *wan_service, PortForwardInfo* port_
                      port_info->internal_host
                      );
 
-        GSList *port_list = NULL;
-        port_list = g_slist_prepend(port_list, port_info);
-
-        gui_add_mapped_ports(port_list);
-
-        g_slist_free(port_list);
-
-        error = NULL;
-        return TRUE;
+        port_mapping_verify(request);
+        return;
 
     }
 
     out:
-    if (local_error != NULL) {
-        g_printerr ("\e[31m[EE]\e[0m AddPortMapping: %s (%i)\n", local_error->message, local_error->code);
+    if (error != NULL) {
+        g_printerr ("\e[31m[EE]\e[0m AddPortMapping: %s (%i)\n", error->message, error->code);
 
-        *error = g_error_copy(local_error);
-        g_error_free (local_error);
+        /* no change, no event */
+        port_mapping_own_change_failed(request->router);
 
-        return FALSE;
+        port_mapping_request_done(request, error);
+        g_error_free (error);
     }
-
-    return FALSE;
 }
 
-static PortForwardInfo* get_mapped_port(RouterInfo *router, guint index)
+void add_port_mapping(RouterInfo *router, PortForwardInfo* port_info, UrcPortMappingCallback callback, gpointer user_data)
 {
-
-    GError *error = NULL;
     GUPnPServiceProxyAction *action = NULL;
-    PortForwardInfo* port;
-
-    port = g_malloc( sizeof(PortForwardInfo) );
 
     action = gupnp_service_proxy_action_new(
-                "GetGenericPortMappingEntry",
+                "AddPortMapping",
                 /* IN args */
-                "NewPortMappingIndex",
-                G_TYPE_UINT, index,
+                "NewRemoteHost",
+                G_TYPE_STRING, port_info->remote_host,
+                "NewExternalPort",
+                G_TYPE_UINT, port_info->external_port,
+                "NewProtocol",
+                G_TYPE_STRING, port_info->protocol,
+                "NewInternalPort",
+                G_TYPE_UINT, port_info->internal_port,
+                "NewInternalClient",
+                G_TYPE_STRING, port_info->internal_host,
+                "NewEnabled",
+                G_TYPE_BOOLEAN, port_info->enabled,
+                "NewPortMappingDescription",
+                G_TYPE_STRING, port_info->description,
+                "NewLeaseDuration",
+                G_TYPE_UINT, port_info->lease_time,
                 NULL
-    );
-
-    gupnp_service_proxy_call_action(router->wan_conn_service,
-                                    action,
-                                    NULL,
-                                    &error);
-
-   if (error != NULL) {
-        goto out;
-    }
-
-    gupnp_service_proxy_action_get_result (action,
-                   /* Error location */
-                   &error,
-                   /* OUT args */
-                   "NewRemoteHost",
-                   G_TYPE_STRING, &port->remote_host,
-                   "NewExternalPort",
-                   G_TYPE_UINT, &port->external_port,
-                   "NewProtocol",
-                   G_TYPE_STRING, &port->protocol,
-                   "NewInternalPort",
-                   G_TYPE_UINT, &port->internal_port,
-                   "NewInternalClient",
-                   G_TYPE_STRING, &port->internal_host,
-                   "NewEnabled",
-                   G_TYPE_BOOLEAN, &port->enabled,
-                   "NewPortMappingDescription",
-                   G_TYPE_STRING, &port->description,
-                   "NewLeaseDuration",
-                   G_TYPE_UINT, &port->lease_time,
-                   NULL);
-
-    g_clear_pointer (&action, gupnp_service_proxy_action_unref);
-
-    out:
-    if (error) {
-
-        // error 713: end of ports array
-        // error 402: invalid args
-        if(error->code != 713 && error->code != 402) {
-            g_printerr ("\e[31m[EE]\e[0m GetGenericPortMappingEntry: %s (%i)\n", error->message, error->code);
-            g_error_free (error);
-        }
-        return NULL;
-    }
+            );
 
-    return port;
+    router->own_mapping_changes++;
 
+    /* the caller keeps the ownership of port_info */
+    urc_action_call(router->wan_conn_service,
+                    "AddPortMapping",
+                    action,
+                    router->cancellable,
+                    add_port_mapping_cb,
+                    port_mapping_request_new(router, port_forward_info_copy(port_info), FALSE, callback, user_data));
 }
 
-/* Retrive ports mapped and populate the treeview */
-void discovery_mapped_ports_list(RouterInfo *router)
+static void discovery_mapped_ports_list_cb(GPtrArray *entries, const GError *error, gpointer user_data)
 {
+    RouterInfo *router = (RouterInfo *) user_data;
     PortForwardInfo* port_info;
-    guint index = 0;
-    GSList *port_list = NULL;
-    GSList *iter;
+    UrcMappingDiff diff;
+    guint i;
 
-    g_print("\e[1;32m==> Getting mapped ports list...\e[0;0m\n");
+    /* a partial table would remove the mappings not read, keep the
+     * known ones until the next read */
+    if (error != NULL) {
+        g_printerr ("\e[31m[EE]\e[0m Mapped ports list incomplete: %s\n", error->message);
+        g_ptr_array_unref (entries);
+        return;
+    }
 
-    while( (port_info = get_mapped_port(router, index)) != NULL )
+    for (i = 0; i < entries->len; i++)
     {
+        port_info = g_ptr_array_index (entries, i);
 
         g_print (" * %s [%s]\n", port_info->description, port_info->enabled ? "enabled" : "disabled" );
 
         g_print ("   local %s:%d ext %s:%d [%s]\n",
                  port_info->internal_host,
                  port_info->internal_port,
-                 strlen(port_info->remote_host) > 0 ? port_info->remote_host : "*",
+                 port_info->remote_host != NULL && strlen(port_info->remote_host) > 0 ? port_info->remote_host : "*",
                  port_info->external_port,
                  port_info->protocol
         );
+    }
 
-        if(port_info->external_port > 0)
-            port_list = g_slist_prepend(port_list, port_info);
+    /* Apply only the differences from the previous read to the treeview */
+    urc_mapping_store_update (router->port_mappings, entries, &diff);
 
-        index++;
-    }
+    if(opt_debug)
+        g_print ("\e[34mMapping table: %u added, %u removed, %u changed\e[0m\n",
+                 diff.added->len, diff.removed->len, diff.changed->len);
 
-    /* Clear previus entries */
-    gui_clear_ports_list_treeview();
+    for (i = 0; i < diff.removed->len; i++)
+        urc_sink->remove_mapped_port (router, g_ptr_array_index (diff.removed, i));
 
-    /* Update GUI treeview */
-    gui_add_mapped_ports(port_list);
+    for (i = 0; i < diff.changed->len; i++)
+        urc_sink->update_mapped_port (router, g_ptr_array_index (diff.changed, i));
 
-    /* Destroy the list */
-    iter = port_list;
-    while(iter)
-    {
-        port_info = (PortForwardInfo*) iter->data;
+    for (i = 0; i < diff.added->len; i++)
+        urc_sink->add_mapped_port (router, g_ptr_array_index (diff.added, i));
 
-        g_free (port_info->description);
-        g_free (port_info->protocol);
-        g_free (port_info->internal_host);
-        g_free (port_info->remote_host);
-        g_free (port_info);
+    urc_mapping_diff_clear (&diff);
 
-        iter = g_slist_next (iter);
-    }
-    g_slist_free (port_list);
+    urc_metrics_set_port_mappings (router->udn, urc_mapping_store_size (router->port_mappings));
 }
 
-/* Retrive connection infos: connection status, uptime and last error. */
-gboolean get_conn_status (RouterInfo *router)
+/* Retrive ports mapped and populate the treeview */
+void discovery_mapped_ports_list(RouterInfo *router)
 {
-    GError *error = NULL;
-    GUPnPServiceProxyAction *action = NULL;
-    gchar* conn_status;
-    gchar* last_conn_error;
-    guint  uptime = 0;
+    if (!(router->caps & (URC_CAP_GENERIC_MAPPING | URC_CAP_LIST_OF_MAPPINGS)))
+        return;
 
-    g_print("\e[36mRequest for connection status info... ");
+    /* a read still running is out of date, only the new one reports */
+    if (router->mapping_cancellable != NULL) {
+        g_cancellable_cancel (router->mapping_cancellable);
+        g_object_unref (router->mapping_cancellable);
+    }
 
-    action = gupnp_service_proxy_action_new(
-        "GetStatusInfo",
-        NULL
-    );
+    router->mapping_cancellable = g_cancellable_new ();
 
-    gupnp_service_proxy_call_action(router->wan_conn_service,
-                                    action,
-                                    NULL,
-                                    &error);
+    g_print("\e[1;32m==> Getting mapped ports list...\e[0;0m\n");
+
+    urc_mapping_fetch(router,
+                      opt_mapping_window,
+                      router->mapping_cancellable,
+                      discovery_mapped_ports_list_cb,
+                      router);
+}
+
+static void get_conn_status_cb(GUPnPServiceProxyAction *action, GError *error, const UrcActionInfo *info, gpointer user_data)
+{
+    RouterInfo *router = (RouterInfo *) user_data;
+    gchar* conn_status = NULL;
+    gchar* last_conn_error = NULL;
+    guint  uptime = 0;
+
+    if (urc_action_cancelled (error))
+        return;
 
     if (error != NULL) {
         goto out;
@@ -321,201 +506,601 @@ gboolean get_conn_status (RouterInfo *router)
                    G_TYPE_UINT, &uptime,
                    NULL);
 
-    g_clear_pointer (&action, gupnp_service_proxy_action_unref);
-
     if (error == NULL) {
         if(g_strcmp0("Connected", conn_status) == 0)
             router->connected = TRUE;
         else
             router->connected = FALSE;
 
-        g_print("\e[32msuccessful\e[0;0m\n");
+        g_print("\e[36mRequest for connection status info... \e[32msuccessful\e[0;0m\n");
         g_print("\e[36mConnection info:\e[0m Status: %s, Uptime: %i sec.\n", conn_status, uptime);
 
-        gui_set_conn_status(conn_status);
+        g_free(router->conn_status);
+        router->conn_status = g_strdup(conn_status);
+
+        urc_sink->set_conn_status(router, conn_status);
+        urc_metrics_set_connection(router->udn, router->connected, TRUE, uptime);
 
         if(g_strcmp0("ERROR_NONE", last_conn_error) != 0)
             g_print("\e[33mLast connection error:\e[0m %s\n", last_conn_error);
 
-        return TRUE;
+        g_free(conn_status);
+        g_free(last_conn_error);
+        return;
     }
 
     out:
     if (error != NULL) {
-        g_print("\e[1;31mfailed\e[0;0m\n");
+        g_print("\e[36mRequest for connection status info... \e[1;31mfailed\e[0;0m\n");
+
+        g_clear_pointer(&router->conn_status, g_free);
 
-        gui_disable_conn_status();
+        urc_sink->disable_conn_status(router);
 
         g_printerr ("\e[31m[EE]\e[0m GetStatusInfo: %s (%i)\n", error->message, error->code);
         g_error_free (error);
     }
-    return FALSE;
 }
 
-/* Retrive download and upload speeds */
-static gboolean update_data_rate_cb (gpointer data)
+/* Retrive connection infos: connection status, uptime and last error. */
+void get_conn_status (RouterInfo *router)
 {
-    GError *error = NULL;
-    GUPnPServiceProxyAction *action_in = NULL;
-    GUPnPServiceProxyAction *action_out = NULL;
-    GUPnPServiceProxy *wan_device;
-    gint64 begin_time;
-    gint64 end_time;
-    gdouble duration_secs;
-
-    static guint old_total_bytes_received = 0;
-    guint current_total_bytes_received;
-    double data_rate_down;
-
-    static guint old_total_bytes_sent = 0;
-    guint current_total_bytes_sent;
-    double data_rate_up;
+    GUPnPServiceProxyAction *action = NULL;
 
-    wan_device = ((RouterInfo *) data)->wan_common_ifc;
+    if (!(router->caps & URC_CAP_STATUS_INFO))
+        return;
 
-    action_in = gupnp_service_proxy_action_new(
-        "GetTotalBytesReceived",
+    action = gupnp_service_proxy_action_new(
+        "GetStatusInfo",
         NULL
     );
 
-    action_out = gupnp_service_proxy_action_new(
-        "GetTotalBytesSent",
-        NULL
-    );
+    urc_action_call(router->wan_conn_service,
+                    "GetStatusInfo",
+                    action,
+                    router->cancellable,
+                    get_conn_status_cb,
+                    router);
+}
 
-    /* download speed */
-    begin_time = g_get_monotonic_time();
-    gupnp_service_proxy_call_action(wan_device,
-                                    action_in,
-                                    NULL,
-                                    &error);
+void get_wan_link_properties (RouterInfo *router);
 
-    if (error != NULL) {
-        goto error_in;
-    }
+static void traffic_log_replay_cb(const UrcTrafficSample *sample, gboolean rates_valid, gdouble down_rate, gdouble up_rate, gpointer user_data)
+{
+    RouterInfo *router = (RouterInfo *) user_data;
 
-    gupnp_service_proxy_action_get_result (action_in,
-                   /* Error location */
-                   &error,
-                   /* OUT args */
-                   "NewTotalBytesReceived",
-                   G_TYPE_UINT, &current_total_bytes_received,
-                   NULL);
+    router->traffic_log_time = sample->time;
 
-    g_clear_pointer (&action_in, gupnp_service_proxy_action_unref);
+    if(!rates_valid)
+        return;
 
-    end_time  = g_get_monotonic_time();
+    urc_history_push(router->down_history, sample->time, down_rate);
+    urc_history_push(router->up_history, sample->time, up_rate);
+}
 
-    if (error == NULL) {
+/* Save the histories next to the log, a restart goes on from them */
+static void traffic_log_checkpoint(RouterInfo *router)
+{
+    GByteArray *data;
 
-        if(old_total_bytes_received == 0)
-            data_rate_down = 0.0;
-        else {
+    if(router->traffic_log == NULL || router->traffic_log_time == router->traffic_checkpoint_time)
+        return;
 
-            // UPnP query time
-            duration_secs = 1 + ((double)end_time - begin_time) / G_USEC_PER_SEC;
+    data = g_byte_array_new();
+    urc_history_save(router->down_history, data);
+    urc_history_save(router->up_history, data);
 
-            if(opt_debug)
-                g_print("\e[34mGetTotalBytesReceived() duration: %fs\e[0m\n", duration_secs);
+    if(urc_traffic_log_save_checkpoint(router->traffic_log, router->traffic_log_time, data->data, data->len))
+        router->traffic_checkpoint_time = router->traffic_log_time;
 
-            data_rate_down = ((current_total_bytes_received - old_total_bytes_received) / (duration_secs)  ) / 1024.0;
-        }
+    g_byte_array_free(data, TRUE);
+}
 
-        gui_set_download_speed(data_rate_down);
-        gui_set_total_received(current_total_bytes_received);
+/* Open the router traffic log and fill the history with it: from the
+ * last checkpoint and the samples logged after it */
+static void traffic_log_load(RouterInfo *router)
+{
+    GError *error = NULL;
+    const guint8 *p;
+    guint8 *data;
+    gsize length;
+    gint64 now, from, time;
 
-        old_total_bytes_received = current_total_bytes_received;
+    router->traffic_log = urc_traffic_log_open(router->udn, &error);
 
+    if(router->traffic_log == NULL) {
+        g_printerr ("\e[31m[EE]\e[0m Unable to open the traffic history: %s\n", error->message);
+        g_error_free (error);
+        return;
     }
 
-    error_in:
-    if (error != NULL) {
-        gui_disable_download_speed();
-        gui_disable_total_received();
+    /* as far back as the coarsest tier shows */
+    now = g_get_real_time();
+    from = now - (gint64) URC_HISTORY_POINTS * 24 * 60 * 60 * G_USEC_PER_SEC;
 
-        g_printerr ("\e[31m[EE]\e[0m GetTotalBytesReceived: %s (%i)\n", error->message, error->code);
-        g_error_free (error);
-        error = NULL;
-    }
+    urc_traffic_log_prune(router->traffic_log, from);
 
-    /* upload speed */
-    begin_time = g_get_monotonic_time();
-    gupnp_service_proxy_call_action(wan_device,
-                                    action_out,
-                                    NULL,
-                                    &error);
+    data = urc_traffic_log_load_checkpoint(router->traffic_log, &time, &length);
 
-    if (error != NULL) {
-        goto error_out;
+    if(data != NULL) {
+        p = data;
+
+        if(urc_history_restore(router->down_history, &p, &length) &&
+           urc_history_restore(router->up_history, &p, &length)) {
+            from = MAX(from, time + 1);
+            router->traffic_log_time = router->traffic_checkpoint_time = time;
+        }
+        else {
+            g_printerr ("\e[33m[WW]\e[0m Traffic history checkpoint not readable, reading the whole log\n");
+            urc_history_clear(router->down_history);
+            urc_history_clear(router->up_history);
+        }
+
+        g_free(data);
     }
 
-    gupnp_service_proxy_action_get_result (action_out,
-                   /* Error location */
-                   &error,
-                   /* OUT args */
-                   "NewTotalBytesSent",
-                   G_TYPE_UINT, &current_total_bytes_sent,
-                   NULL);
+    urc_traffic_log_foreach(router->traffic_log,
+                            from,
+                            now,
+                            traffic_log_replay_cb,
+                            router);
 
-    g_clear_pointer (&action_out, gupnp_service_proxy_action_unref);
+    /* the first one on a log without checkpoint */
+    traffic_log_checkpoint(router);
+}
 
-    end_time  = g_get_monotonic_time();
+/* One tick of the data rate refresh. The counter requests are sent
+ * together and their replies are joined here. */
+typedef struct
+{
+    RouterInfo *router;
+    guint pending;
+    gboolean cancelled;
 
-    if (error == NULL) {
+    /* wall clock time of the sample */
+    gint64 time;
 
-        if(old_total_bytes_sent == 0)
-            data_rate_up = 0.0;
-        else {
+    /* each counter with the midpoint of its request and reply (monotonic) */
+    gboolean have_received, have_sent;
+    guint64 received, sent;
+    gint64 received_time, sent_time;
 
-            // UPnP query time
-            duration_secs = 1 + ((double)end_time - begin_time) / G_USEC_PER_SEC;
+    gboolean have_packets_received, have_packets_sent;
+    guint64 packets_received, packets_sent;
+    gint64 packets_received_time, packets_sent_time;
 
-            if(opt_debug)
-                g_print("\e[34mGetTotalBytesSent() duration:     %fs\e[0m\n", duration_secs);
+} DataRateSample;
 
-            data_rate_up = (current_total_bytes_sent - old_total_bytes_sent) / (duration_secs) / 1024.0;
-        }
-        gui_set_upload_speed(data_rate_up);
-        gui_set_total_sent(current_total_bytes_sent);
+typedef void (*DataRateReadFunc) (DataRateSample *sample, GUPnPServiceProxyAction *action, gint64 time, GError **error);
 
-        old_total_bytes_sent = current_total_bytes_sent;
-    }
+typedef struct
+{
+    DataRateSample *sample;
+    DataRateReadFunc read;
+    /* an optional packet counter */
+    gboolean packets;
 
-    error_out:
-    if (error != NULL) {
-        gui_disable_upload_speed();
-        gui_disable_total_sent();
+} DataRateRequest;
 
-        g_printerr ("\e[31m[EE]\e[0m GetTotalBytesSent: %s (%i)\n", error->message, error->code);
-        g_error_free (error);
+/* Rate of a counter since its previous reading, KiB or packets per second */
+static gboolean data_rate_counter_rate(UrcCounter *counter, UrcRate *estimator, guint64 raw, gint64 time, gdouble divisor, gdouble *rate, guint64 *delta)
+{
+    if(!urc_counter_update(counter, raw, delta)) {
+        /* first reading or counter reset, the interval starts over */
+        urc_rate_restart(estimator, time);
+        return FALSE;
     }
 
-    gui_update_graph();
+    if(!urc_rate_update(estimator, opt_rate_filter, time, *delta, rate))
+        return FALSE;
 
-    ((RouterInfo *) data)->data_rate_timer = g_timeout_add_full(G_PRIORITY_HIGH, 1000, update_data_rate_cb, data, NULL);
+    *rate /= divisor;
 
-    return FALSE;
+    return TRUE;
 }
 
-
-/* Retrive external IP address */
-gboolean get_external_ip (RouterInfo *router)
+/* All replies are in, update history, log and GUI at once */
+static void data_rate_sample_done(DataRateSample *sample)
 {
-    GError *error = NULL;
-    GUPnPServiceProxyAction *action = NULL;
-    gchar *ext_ip_addr = NULL;
+    RouterInfo *router = sample->router;
+    gdouble data_rate_down = 0.0, data_rate_up = 0.0;
+    gdouble packet_rate_down = 0.0, packet_rate_up = 0.0;
+    guint64 bytes_down = 0, bytes_up = 0;
+    guint64 packets_down, packets_up;
+    gboolean down_valid = FALSE, up_valid = FALSE;
+
+    if(sample->cancelled) {
+        g_free(sample);
+        return;
+    }
 
-    g_print("\e[36mRequest for external IP address... ");
+    if(sample->have_received) {
+        down_valid = data_rate_counter_rate(&router->received_counter, &router->received_rate,
+                                            sample->received, sample->received_time,
+                                            1024.0, &data_rate_down, &bytes_down);
 
-    action = gupnp_service_proxy_action_new(
-        "GetExternalIPAddress",
-        NULL
-    );
+        /* no rate yet, or the counter was reset: a gap, not a zero */
+        if(down_valid) {
+            urc_history_push(router->down_history, sample->time, data_rate_down);
+            urc_sink->set_download_speed(router, data_rate_down);
+        }
+        else
+            urc_history_push_gap(router->down_history, sample->time);
+
+        urc_sink->set_total_received(router, router->received_counter.total);
+    }
+    else {
+        urc_history_push_gap(router->down_history, sample->time);
+        urc_sink->disable_download_speed(router);
+        urc_sink->disable_total_received(router);
+    }
+
+    if(sample->have_sent) {
+        up_valid = data_rate_counter_rate(&router->sent_counter, &router->sent_rate,
+                                          sample->sent, sample->sent_time,
+                                          1024.0, &data_rate_up, &bytes_up);
+
+        if(up_valid) {
+            urc_history_push(router->up_history, sample->time, data_rate_up);
+            urc_sink->set_upload_speed(router, data_rate_up);
+        }
+        else
+            urc_history_push_gap(router->up_history, sample->time);
+
+        urc_sink->set_total_sent(router, router->sent_counter.total);
+    }
+    else {
+        urc_history_push_gap(router->up_history, sample->time);
+        urc_sink->disable_upload_speed(router);
+        urc_sink->disable_total_sent(router);
+    }
+
+    if(sample->have_packets_received &&
+       data_rate_counter_rate(&router->packets_received_counter, &router->packets_received_rate,
+                              sample->packets_received, sample->packets_received_time,
+                              1.0, &packet_rate_down, &packets_down) &&
+       down_valid)
+        urc_sink->set_download_packets(router, packet_rate_down, packets_down > 0 ? (gdouble) bytes_down / packets_down : 0.0);
+    else
+        urc_sink->set_download_packets(router, -1.0, 0.0);
+
+    if(sample->have_packets_sent &&
+       data_rate_counter_rate(&router->packets_sent_counter, &router->packets_sent_rate,
+                              sample->packets_sent, sample->packets_sent_time,
+                              1.0, &packet_rate_up, &packets_up) &&
+       up_valid)
+        urc_sink->set_upload_packets(router, packet_rate_up, packets_up > 0 ? (gdouble) bytes_up / packets_up : 0.0);
+    else
+        urc_sink->set_upload_packets(router, -1.0, 0.0);
+
+    urc_metrics_set_received(router->udn, sample->have_received, router->received_counter.total, data_rate_down * 1024.0);
+    urc_metrics_set_sent(router->udn, sample->have_sent, router->sent_counter.total, data_rate_up * 1024.0);
+
+    /* the log rates come from its own samples, none across this one */
+    if(router->traffic_log != NULL && sample->have_received && sample->have_sent &&
+       !(down_valid && up_valid))
+        urc_traffic_log_append_gap(router->traffic_log);
+
+    if(router->traffic_log != NULL && sample->have_received && sample->have_sent &&
+       urc_traffic_log_append(router->traffic_log, sample->time,
+                              router->received_counter.total, router->sent_counter.total)) {
+
+        router->traffic_log_time = sample->time;
+
+        if(sample->time - router->traffic_checkpoint_time >= URC_TRAFFIC_CHECKPOINT_INTERVAL)
+            traffic_log_checkpoint(router);
+    }
+
+    urc_sink->update_graph(router);
+
+    router->data_rate_busy = FALSE;
+
+    g_free(sample);
+}
+
+static void data_rate_request_cb(GUPnPServiceProxyAction *action, GError *error, const UrcActionInfo *info, gpointer user_data)
+{
+    DataRateRequest *request = (DataRateRequest *) user_data;
+    DataRateSample *sample = request->sample;
+
+    if (error != NULL && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        sample->cancelled = TRUE;
+        g_error_free (error);
+        goto out;
+    }
+
+    if (error == NULL)
+        request->read(sample, action, (info->request_time + info->response_time) / 2, &error);
+
+    if (error != NULL) {
+        // error 401: invalid action
+        // error 602: optional action not implemented
+        if (request->packets && (error->code == 401 || error->code == 602))
+            sample->router->caps &= ~URC_CAP_TOTAL_PACKETS;
+
+        g_printerr ("\e[31m[EE]\e[0m %s: %s (%i)\n", info->name, error->message, error->code);
+        g_error_free (error);
+    }
+
+    out:
+    g_free (request);
+
+    if (--sample->pending == 0)
+        data_rate_sample_done(sample);
+}
+
+/* Read a counter that is ui4 or ui8 depending on the router */
+static gboolean data_rate_read_counter(GUPnPServiceProxyAction *action, const gchar *name, gboolean ui8, guint64 *value, GError **error)
+{
+    guint value_32 = 0;
+
+    if(ui8)
+        gupnp_service_proxy_action_get_result (action, error, name, G_TYPE_UINT64, value, NULL);
+    else {
+        gupnp_service_proxy_action_get_result (action, error, name, G_TYPE_UINT, &value_32, NULL);
+        *value = value_32;
+    }
+
+    return *error == NULL;
+}
+
+static void data_rate_read_bytes_received(DataRateSample *sample, GUPnPServiceProxyAction *action, gint64 time, GError **error)
+{
+    sample->received_time = time;
+    sample->have_received = data_rate_read_counter(action, "NewTotalBytesReceived",
+                                                   sample->router->counter_source == URC_COUNTERS_UI8,
+                                                   &sample->received, error);
+}
+
+static void data_rate_read_bytes_sent(DataRateSample *sample, GUPnPServiceProxyAction *action, gint64 time, GError **error)
+{
+    sample->sent_time = time;
+    sample->have_sent = data_rate_read_counter(action, "NewTotalBytesSent",
+                                               sample->router->counter_source == URC_COUNTERS_UI8,
+                                               &sample->sent, error);
+}
+
+static void data_rate_read_packets_received(DataRateSample *sample, GUPnPServiceProxyAction *action, gint64 time, GError **error)
+{
+    sample->packets_received_time = time;
+    sample->have_packets_received = data_rate_read_counter(action, "NewTotalPacketsReceived", FALSE,
+                                                           &sample->packets_received, error);
+}
+
+static void data_rate_read_packets_sent(DataRateSample *sample, GUPnPServiceProxyAction *action, gint64 time, GError **error)
+{
+    sample->packets_sent_time = time;
+    sample->have_packets_sent = data_rate_read_counter(action, "NewTotalPacketsSent", FALSE,
+                                                       &sample->packets_sent, error);
+}
+
+/* AVM 64 bit counters, both in a single reply */
+static void data_rate_read_addon_infos(DataRateSample *sample, GUPnPServiceProxyAction *action, gint64 time, GError **error)
+{
+    gchar *total_bytes_sent = NULL;
+    gchar *total_bytes_received = NULL;
+
+    gupnp_service_proxy_action_get_result (action,
+                   /* Error location */
+                   error,
+                   /* OUT args */
+                   "NewX_AVM_DE_TotalBytesSent64",
+                   G_TYPE_STRING, &total_bytes_sent,
+                   "NewX_AVM_DE_TotalBytesReceived64",
+                   G_TYPE_STRING, &total_bytes_received,
+                   NULL);
+
+    if (*error == NULL && total_bytes_sent != NULL && total_bytes_received != NULL) {
+        sample->received = g_ascii_strtoull(total_bytes_received, NULL, 10);
+        sample->sent = g_ascii_strtoull(total_bytes_sent, NULL, 10);
+        sample->have_received = TRUE;
+        sample->have_sent = TRUE;
+        sample->received_time = time;
+        sample->sent_time = time;
+    }
+
+    g_free(total_bytes_sent);
+    g_free(total_bytes_received);
+}
+
+static void data_rate_request(DataRateSample *sample, const gchar *name, DataRateReadFunc read, gboolean packets)
+{
+    GUPnPServiceProxyAction *action;
+    DataRateRequest *request;
+
+    request = g_malloc (sizeof (DataRateRequest));
+    request->sample = sample;
+    request->read = read;
+    request->packets = packets;
+
+    sample->pending++;
+
+    action = gupnp_service_proxy_action_new(name, NULL);
+
+    urc_action_call(sample->router->wan_common_ifc,
+                    name,
+                    action,
+                    sample->router->cancellable,
+                    data_rate_request_cb,
+                    request);
+}
+
+/* Retrive download and upload speeds */
+static void update_data_rate (RouterInfo *router)
+{
+    DataRateSample *sample;
+
+    /* the previous tick is still waiting, its replies are late */
+    if(router->data_rate_busy)
+        return;
+
+    router->data_rate_busy = TRUE;
+
+    sample = g_malloc0 (sizeof (DataRateSample));
+    sample->router = router;
+    sample->time = g_get_real_time();
+
+    /* all in flight together, the replies are joined in one sample */
+    if(router->counter_source == URC_COUNTERS_AVM)
+        data_rate_request(sample, "GetAddonInfos", data_rate_read_addon_infos, FALSE);
+    else if(router->caps & URC_CAP_TOTAL_BYTES) {
+        data_rate_request(sample, "GetTotalBytesReceived", data_rate_read_bytes_received, FALSE);
+        data_rate_request(sample, "GetTotalBytesSent", data_rate_read_bytes_sent, FALSE);
+    }
+
+    if(router->caps & URC_CAP_TOTAL_PACKETS) {
+        data_rate_request(sample, "GetTotalPacketsReceived", data_rate_read_packets_received, TRUE);
+        data_rate_request(sample, "GetTotalPacketsSent", data_rate_read_packets_sent, TRUE);
+    }
+}
+
+/* The actions behind each capability, a capability with more than one
+ * action needs all of them */
+typedef struct
+{
+    const gchar *action;
+    UrcCaps cap;
+
+} CapAction;
+
+static const CapAction wan_conn_actions[] = {
+    { "GetExternalIPAddress",       URC_CAP_EXTERNAL_IP },
+    { "GetStatusInfo",              URC_CAP_STATUS_INFO },
+    { "GetNATRSIPStatus",           URC_CAP_NAT_RSIP_STATUS },
+    { "GetGenericPortMappingEntry", URC_CAP_GENERIC_MAPPING },
+    { "GetListOfPortMappings",      URC_CAP_LIST_OF_MAPPINGS },
+};
+
+static const CapAction wan_common_ifc_actions[] = {
+    { "GetCommonLinkProperties",    URC_CAP_COMMON_LINK_PROPERTIES },
+    { "GetTotalBytesReceived",      URC_CAP_TOTAL_BYTES },
+    { "GetTotalBytesSent",          URC_CAP_TOTAL_BYTES },
+    { "GetTotalPacketsReceived",    URC_CAP_TOTAL_PACKETS },
+    { "GetTotalPacketsSent",        URC_CAP_TOTAL_PACKETS },
+};
+
+/* Capabilities of a service, all of them when its description can't
+ * be read so the requests are tried as before */
+static guint
+caps_from_scpd (UrcScpd         *scpd,
+                const CapAction *actions,
+                guint            n_actions)
+{
+    guint caps = 0, missing = 0;
+    guint i;
+
+    for (i = 0; i < n_actions; i++) {
+        caps |= actions[i].cap;
+
+        if (scpd != NULL && !urc_scpd_has_action (scpd, actions[i].action))
+            missing |= actions[i].cap;
+    }
+
+    return caps & ~missing;
+}
+
+static void
+caps_print (guint caps, const CapAction *actions, guint n_actions)
+{
+    guint i;
+
+    for (i = 0; i < n_actions; i++)
+        g_print ("\e[34m  %s %s\e[0m\n", actions[i].cap & caps ? "+" : "-", actions[i].action);
+}
+
+static void
+scpd_print_actions (UrcScpd *scpd)
+{
+    gchar **actions;
+    guint i;
+
+    actions = urc_scpd_list_actions (scpd);
+
+    for (i = 0; actions[i] != NULL; i++)
+        g_print ("               > %s\n", actions[i]);
+
+    g_strfreev (actions);
+}
+
+/* Read the capabilities and the counter type in the service description,
+ * then start the data rate refresh */
+static void wan_common_ifc_scpd_cb(UrcScpd *scpd, const GError *error, gpointer user_data)
+{
+    RouterInfo *router = (RouterInfo *) user_data;
+    gchar *received_type, *sent_type;
+
+    router->counter_source = URC_COUNTERS_32;
+
+    if (error != NULL) {
+        g_printerr ("\e[33m[WW]\e[0m Unable to read the WANCommonInterfaceConfig description: %s\n", error->message);
+        router->caps |= caps_from_scpd (NULL, wan_common_ifc_actions, G_N_ELEMENTS (wan_common_ifc_actions));
+        goto out;
+    }
 
-    gupnp_service_proxy_call_action(router->wan_conn_service,
-                                    action,
-                                    NULL,
-                                    &error);
+    router->caps |= caps_from_scpd (scpd, wan_common_ifc_actions, G_N_ELEMENTS (wan_common_ifc_actions));
+
+    if (urc_scpd_action_has_argument (scpd, "GetAddonInfos", "NewX_AVM_DE_TotalBytesSent64") &&
+        urc_scpd_action_has_argument (scpd, "GetAddonInfos", "NewX_AVM_DE_TotalBytesReceived64"))
+        router->caps |= URC_CAP_ADDON_INFOS;
+
+    received_type = urc_scpd_get_variable_type (scpd, "TotalBytesReceived");
+    sent_type = urc_scpd_get_variable_type (scpd, "TotalBytesSent");
+
+    if (g_strcmp0 (received_type, "ui8") == 0 && g_strcmp0 (sent_type, "ui8") == 0)
+        router->caps |= URC_CAP_TOTAL_BYTES_UI8;
+
+    g_free (received_type);
+    g_free (sent_type);
+
+    if (router->caps & URC_CAP_ADDON_INFOS)
+        router->counter_source = URC_COUNTERS_AVM;
+    else if (router->caps & URC_CAP_TOTAL_BYTES_UI8)
+        router->counter_source = URC_COUNTERS_UI8;
+
+    out:
+    urc_counter_init (&router->received_counter, router->counter_source == URC_COUNTERS_32 ? 32 : 64);
+    urc_counter_init (&router->sent_counter, router->counter_source == URC_COUNTERS_32 ? 32 : 64);
+    urc_counter_init (&router->packets_received_counter, 32);
+    urc_counter_init (&router->packets_sent_counter, 32);
+    urc_rate_init (&router->received_rate);
+    urc_rate_init (&router->sent_rate);
+    urc_rate_init (&router->packets_received_rate);
+    urc_rate_init (&router->packets_sent_rate);
+
+    if(opt_debug) {
+        if (scpd != NULL) {
+            g_print ("\e[34mWANCommonInterfaceConfig actions:\e[0m\n");
+            scpd_print_actions (scpd);
+        }
+
+        g_print ("\e[34mWANCommonInterfaceConfig capabilities:\e[0m\n");
+        caps_print (router->caps, wan_common_ifc_actions, G_N_ELEMENTS (wan_common_ifc_actions));
+        g_print ("\e[34mTraffic counters: %s\e[0m\n",
+                 router->counter_source == URC_COUNTERS_AVM ? "GetAddonInfos 64 bit" :
+                 router->counter_source == URC_COUNTERS_UI8 ? "ui8" : "ui4");
+    }
+
+    /* Get common WAN link properties */
+    get_wan_link_properties (router);
+
+    /* Start data rate polling */
+    if (router->caps & (URC_CAP_ADDON_INFOS | URC_CAP_TOTAL_BYTES))
+        urc_scheduler_start (router->scheduler, URC_POLL_COUNTERS, 0);
+    else {
+        urc_sink->disable_download_speed (router);
+        urc_sink->disable_upload_speed (router);
+        urc_sink->disable_total_received (router);
+        urc_sink->disable_total_sent (router);
+    }
+}
+
+static void get_external_ip_cb(GUPnPServiceProxyAction *action, GError *error, const UrcActionInfo *info, gpointer user_data)
+{
+    RouterInfo *router = (RouterInfo *) user_data;
+    gchar *ext_ip_addr = NULL;
+
+    if (urc_action_cancelled (error))
+        return;
 
     if (error != NULL) {
         goto out;
@@ -529,54 +1114,60 @@ gboolean get_external_ip (RouterInfo *router)
        G_TYPE_STRING, &ext_ip_addr,
        NULL);
 
-    g_clear_pointer (&action, gupnp_service_proxy_action_unref);
-
     if (error == NULL) {
         if(router->external_ip != NULL)
             g_free(router->external_ip);
 
-        router->external_ip = g_strdup(ext_ip_addr);
+        router->external_ip = ext_ip_addr;
 
-        g_print("\e[32msuccessful \e[0m[%s]\n", router->external_ip);
+        g_print("\e[36mRequest for external IP address... \e[32msuccessful \e[0m[%s]\n", router->external_ip);
 
         if( g_strcmp0(router->external_ip, "0.0.0.0") == 0 )
-            gui_set_ext_ip (NULL);
+            urc_sink->set_ext_ip (router, NULL);
         else
-            gui_set_ext_ip (router->external_ip);
+            urc_sink->set_ext_ip (router, router->external_ip);
 
-        return TRUE;
+        return;
     }
 
     out:
     if (error != NULL) {
-        g_print("\e[1;31mfailed\e[0;0m\n");
+        g_print("\e[36mRequest for external IP address... \e[1;31mfailed\e[0;0m\n");
 
-        gui_disable_ext_ip ();
+        urc_sink->disable_ext_ip (router);
 
         g_printerr ("\e[31m[EE]\e[0m GetExternalIPAddress: %s (%i)\n", error->message, error->code);
         g_error_free (error);
     }
-
-    return FALSE;
 }
 
-/* Retrive RSIP and NAT availability */
-gboolean get_nat_rsip_status (RouterInfo *router)
+/* Retrive external IP address */
+void get_external_ip (RouterInfo *router)
 {
-    GError *error = NULL;
     GUPnPServiceProxyAction *action = NULL;
 
-    g_print("\e[36mRequest for NAT and RSIP availability... ");
+    if (!(router->caps & URC_CAP_EXTERNAL_IP))
+        return;
 
     action = gupnp_service_proxy_action_new(
-        "GetNATRSIPStatus",
+        "GetExternalIPAddress",
         NULL
     );
 
-    gupnp_service_proxy_call_action(router->wan_conn_service,
-                                    action,
-                                    NULL,
-                                    &error);
+    urc_action_call(router->wan_conn_service,
+                    "GetExternalIPAddress",
+                    action,
+                    router->cancellable,
+                    get_external_ip_cb,
+                    router);
+}
+
+static void get_nat_rsip_status_cb(GUPnPServiceProxyAction *action, GError *error, const UrcActionInfo *info, gpointer user_data)
+{
+    RouterInfo *router = (RouterInfo *) user_data;
+
+    if (urc_action_cancelled (error))
+        return;
 
     if (error != NULL) {
         goto out;
@@ -592,44 +1183,48 @@ gboolean get_nat_rsip_status (RouterInfo *router)
                    G_TYPE_BOOLEAN, &router->nat_enabled,
                    NULL);
 
-    g_clear_pointer (&action, gupnp_service_proxy_action_unref);
-
     if (error == NULL) {
-        g_print("\e[32msuccessful \e[0m[RSIP=%s, NAT=%s]\n", router->rsip_available == TRUE ? "yes" : "no", router->nat_enabled == TRUE ? "yes" : "no" );
-        return TRUE;
+        g_print("\e[36mRequest for NAT and RSIP availability... \e[32msuccessful \e[0m[RSIP=%s, NAT=%s]\n", router->rsip_available == TRUE ? "yes" : "no", router->nat_enabled == TRUE ? "yes" : "no" );
+        return;
     }
 
     out:
     if (error != NULL) {
-        g_print("\e[1;31mfailed\e[0;0m\n");
+        g_print("\e[36mRequest for NAT and RSIP availability... \e[1;31mfailed\e[0;0m\n");
 
         g_printerr ("\e[31m[EE]\e[0m GetNATRSIPStatus: %s (%i)\n", error->message, error->code);
         g_error_free (error);
     }
-
-    return FALSE;
 }
 
-/* Retrive WAN link properties */
-gboolean get_wan_link_properties (RouterInfo *router)
+/* Retrive RSIP and NAT availability */
+void get_nat_rsip_status (RouterInfo *router)
 {
-    GError *error = NULL;
     GUPnPServiceProxyAction *action = NULL;
 
-    gchar *access_type, *physical_link_status;
-    guint upstream_max_bitrate, downstream_max_bitrate;
-
-    g_print("\e[36mRequest for WAN link properties... ");
+    if (!(router->caps & URC_CAP_NAT_RSIP_STATUS))
+        return;
 
     action = gupnp_service_proxy_action_new(
-        "GetCommonLinkProperties",
+        "GetNATRSIPStatus",
         NULL
     );
 
-    gupnp_service_proxy_call_action(router->wan_common_ifc,
-                                    action,
-                                    NULL,
-                                    &error);
+    urc_action_call(router->wan_conn_service,
+                    "GetNATRSIPStatus",
+                    action,
+                    router->cancellable,
+                    get_nat_rsip_status_cb,
+                    router);
+}
+
+static void get_wan_link_properties_cb(GUPnPServiceProxyAction *action, GError *error, const UrcActionInfo *info, gpointer user_data)
+{
+    gchar *access_type = NULL, *physical_link_status = NULL;
+    guint upstream_max_bitrate, downstream_max_bitrate;
+
+    if (urc_action_cancelled (error))
+        return;
 
     if (error != NULL) {
         goto out;
@@ -649,52 +1244,101 @@ gboolean get_wan_link_properties (RouterInfo *router)
         G_TYPE_STRING, &physical_link_status,
         NULL);
 
-    g_clear_pointer (&action, gupnp_service_proxy_action_unref);
-
     if (error == NULL) {
-        g_print("\e[32msuccessful\e[0m\n");
+        g_print("\e[36mRequest for WAN link properties... \e[32msuccessful\e[0m\n");
         g_print("\e[36mWAN link properties:\e[0m access_type=%s, link_status=%s, max_up=%u, max_down=%u\n",
                      access_type, physical_link_status, upstream_max_bitrate, downstream_max_bitrate );
 
-        return TRUE;
+        g_free(access_type);
+        g_free(physical_link_status);
+        return;
     }
 
     out:
     if (error != NULL) {
-        g_print("\e[1;31mfailed\e[0;0m\n");
+        g_print("\e[36mRequest for WAN link properties... \e[1;31mfailed\e[0;0m\n");
 
         g_printerr ("\e[31m[EE]\e[0m GetCommonLinkProperties: %s (%i)\n", error->message, error->code);
         g_error_free (error);
     }
-
-    return FALSE;
 }
 
-static gchar*
-get_default_connection_service (GUPnPServiceProxy *proxy, int level)
+/* Retrive WAN link properties */
+void get_wan_link_properties (RouterInfo *router)
 {
-    GError *error = NULL;
     GUPnPServiceProxyAction *action = NULL;
-    gchar *string_buffer = NULL;
-    gchar *connect_service = NULL;
-    int i;
-
-    if (opt_debug) {
-        for(i = 0; i < level; i++)
-            g_print("    ");
 
-        g_print("      \e[32m** Getting DefaultConnectionService...\e[0m\n");
-    }
+    if (!(router->caps & URC_CAP_COMMON_LINK_PROPERTIES))
+        return;
 
     action = gupnp_service_proxy_action_new(
-        "GetDefaultConnectionService",
+        "GetCommonLinkProperties",
         NULL
     );
 
-    gupnp_service_proxy_call_action(proxy,
-                                    action,
-                                    NULL,
-                                    &error);
+    urc_action_call(router->wan_common_ifc,
+                    "GetCommonLinkProperties",
+                    action,
+                    router->cancellable,
+                    get_wan_link_properties_cb,
+                    router);
+}
+
+/* Read the capabilities in the service description, then the first
+ * state of the connection */
+static void
+wan_conn_scpd_cb (UrcScpd      *scpd,
+                  const GError *error,
+                  gpointer      user_data)
+{
+    RouterInfo *router = (RouterInfo *) user_data;
+
+    if (error != NULL)
+        g_printerr ("\e[33m[WW]\e[0m Unable to read the WANIPConnection description: %s\n", error->message);
+
+    router->caps |= caps_from_scpd (scpd, wan_conn_actions, G_N_ELEMENTS (wan_conn_actions));
+
+    if (opt_debug) {
+        if (scpd != NULL) {
+            g_print ("\e[34mWANIPConnection actions:\e[0m\n");
+            scpd_print_actions (scpd);
+        }
+
+        g_print ("\e[34mWANIPConnection capabilities:\e[0m\n");
+        caps_print (router->caps, wan_conn_actions, G_N_ELEMENTS (wan_conn_actions));
+    }
+
+    /* Poll what the router has, the first time right away */
+    if (router->caps & URC_CAP_EXTERNAL_IP)
+        urc_scheduler_start (router->scheduler, URC_POLL_EXTERNAL_IP, 0);
+    else
+        urc_sink->disable_ext_ip (router);
+
+    if (router->caps & URC_CAP_STATUS_INFO)
+        urc_scheduler_start (router->scheduler, URC_POLL_STATUS, 0);
+    else
+        urc_sink->disable_conn_status (router);
+
+    if (router->caps & URC_CAP_NAT_RSIP_STATUS)
+        urc_scheduler_start (router->scheduler, URC_POLL_NAT_RSIP, 0);
+
+    if (router->caps & (URC_CAP_GENERIC_MAPPING | URC_CAP_LIST_OF_MAPPINGS))
+        urc_scheduler_start (router->scheduler, URC_POLL_MAPPINGS, 0);
+}
+
+static void
+get_default_connection_service_cb (GUPnPServiceProxyAction *action,
+                                   GError                  *error,
+                                   const UrcActionInfo     *info,
+                                   gpointer                 user_data)
+{
+    gchar *string_buffer = NULL;
+    gchar *connect_service = NULL;
+    int level = GPOINTER_TO_INT (user_data);
+    int i;
+
+    if (urc_action_cancelled (error))
+        return;
 
     if (error != NULL) {
         goto out;
@@ -708,8 +1352,6 @@ get_default_connection_service (GUPnPServiceProxy *proxy, int level)
            G_TYPE_STRING, &string_buffer,
            NULL);
 
-    g_clear_pointer (&action, gupnp_service_proxy_action_unref);
-
     if (error == NULL) {
 
         if (string_buffer != NULL && strnlen(string_buffer, 32) > 0) {
@@ -733,6 +1375,7 @@ get_default_connection_service (GUPnPServiceProxy *proxy, int level)
         }
         // yes, can free NULL string
         g_free (string_buffer);
+        g_free (connect_service);
     }
 
     out:
@@ -740,49 +1383,125 @@ get_default_connection_service (GUPnPServiceProxy *proxy, int level)
         g_printerr ("\e[31m[EE]\e[0m GetDefaultConnectionService: %s (%i)\n", error->message, error->code);
         g_error_free (error);
     }
+}
+
+static void
+get_default_connection_service (GUPnPServiceProxy *proxy, RouterInfo *router, int level)
+{
+    GUPnPServiceProxyAction *action = NULL;
+    int i;
+
+    if (opt_debug) {
+        for(i = 0; i < level; i++)
+            g_print("    ");
+
+        g_print("      \e[32m** Getting DefaultConnectionService...\e[0m\n");
+    }
+
+    action = gupnp_service_proxy_action_new(
+        "GetDefaultConnectionService",
+        NULL
+    );
 
-    return connect_service;
+    urc_action_call(proxy,
+                    "GetDefaultConnectionService",
+                    action,
+                    router->cancellable,
+                    get_default_connection_service_cb,
+                    GINT_TO_POINTER (level));
 }
 
-static gboolean
-urc_upnp_refresh_data_timeout(gpointer data) {
-    urc_upnp_refresh_data( (RouterInfo *) data );
-    
-    // Every 5 minutes.
-    ((RouterInfo *) data)->refresh_timeout = g_timeout_add_seconds(300, urc_upnp_refresh_data_timeout, data);
+/* Poll interval, jitter and priority of each item. Status, external IP
+ * and mappings are evented by most routers, their polls are a fallback
+ * pushed back by every event. */
+static const struct
+{
+    const gchar *name;
+    guint interval_ms;
+    gdouble jitter;
+    gint priority;
+    UrcScheduleFunc func;
+
+} poll_items[URC_POLL_N_ITEMS] = {
+    [URC_POLL_COUNTERS]    = { "counters",    1000,   0.0, G_PRIORITY_HIGH,         (UrcScheduleFunc) update_data_rate },
+    [URC_POLL_STATUS]      = { "status",      120000, 0.1, G_PRIORITY_DEFAULT,      (UrcScheduleFunc) get_conn_status },
+    [URC_POLL_EXTERNAL_IP] = { "external IP", 300000, 0.1, G_PRIORITY_DEFAULT,      (UrcScheduleFunc) get_external_ip },
+    [URC_POLL_NAT_RSIP]    = { "NAT/RSIP",    900000, 0.1, G_PRIORITY_DEFAULT_IDLE, (UrcScheduleFunc) get_nat_rsip_status },
+    [URC_POLL_MAPPINGS]    = { "mappings",    300000, 0.1, G_PRIORITY_DEFAULT_IDLE, (UrcScheduleFunc) discovery_mapped_ports_list },
+};
+
+/* Leave a router that doesn't answer alone, catch up when it's back */
+static void
+router_health_changed (UrcHealth      *health,
+                       UrcHealthState  state,
+                       gpointer        user_data)
+{
+    RouterInfo *router = (RouterInfo *) user_data;
+    static const UrcPollItem probe_order[] = {
+        URC_POLL_STATUS, URC_POLL_EXTERNAL_IP, URC_POLL_COUNTERS, URC_POLL_NAT_RSIP, URC_POLL_MAPPINGS
+    };
+    guint i;
+
+    switch (state) {
+        case URC_HEALTH_BACKOFF:
+            g_print ("\e[33m[WW]\e[0m %s not answering, next try in %u s\n",
+                     router->friendly_name, urc_health_get_backoff (health));
+            urc_scheduler_set_paused (router->scheduler, TRUE);
+            break;
+
+        case URC_HEALTH_PROBING:
+            /* a single poll, of the first item the router has */
+            for (i = 0; i < G_N_ELEMENTS (probe_order); i++) {
+                if (urc_scheduler_is_active (router->scheduler, probe_order[i])) {
+                    urc_scheduler_run_now (router->scheduler, probe_order[i]);
+                    break;
+                }
+            }
+            break;
+
+        case URC_HEALTH_UP:
+            g_print ("* %s answering again\n", router->friendly_name);
+            urc_scheduler_set_paused (router->scheduler, FALSE);
+            urc_upnp_refresh_data (router);
+            break;
+    }
 
-    return FALSE;
+    urc_sink->set_health (router);
 }
 
+/* The requests are sent together, the replies update the GUI when ready */
 void
 urc_upnp_refresh_data(RouterInfo *router)
 { 
     g_print("Refresh data...\n");
-    get_conn_status( (RouterInfo *) router);
-    get_external_ip( (RouterInfo *) router);
-    get_nat_rsip_status( (RouterInfo *) router);
-    discovery_mapped_ports_list( (RouterInfo *) router);
+    urc_scheduler_run_now (router->scheduler, URC_POLL_STATUS);
+    urc_scheduler_run_now (router->scheduler, URC_POLL_EXTERNAL_IP);
+    urc_scheduler_run_now (router->scheduler, URC_POLL_NAT_RSIP);
+    urc_scheduler_run_now (router->scheduler, URC_POLL_MAPPINGS);
 }
 
 
-/* Service event callback */
+/* Apply the last value of an evented variable */
 static void
-service_proxy_event_cb (GUPnPServiceProxy *proxy,
-                        const char *variable,
-                        GValue *value,
-                        gpointer data)
+service_event_apply (RouterInfo   *router,
+                     const gchar  *variable,
+                     const GValue *value)
 {
-
-    RouterInfo *router;
-    router = (RouterInfo *) data;
-
     /* Numebr of port mapped entries */
     if(g_strcmp0("PortMappingNumberOfEntries", variable) == 0)
     {
 
         g_print("\e[33mEvent:\e[0;0m Ports mapped: %d\n", g_value_get_uint(value));
 
-        discovery_mapped_ports_list(router);
+        /* our own add/delete is read back by itself, any other change
+         * (even one keeping the count) needs the table again */
+        if(router->own_mapping_changes > 0) {
+            router->own_mapping_changes--;
+        }
+        else {
+            discovery_mapped_ports_list(router);
+            urc_scheduler_touch(router->scheduler, URC_POLL_MAPPINGS);
+        }
     }
     /* Got external IP */
     else if(g_strcmp0("ExternalIPAddress", variable) == 0)
@@ -795,19 +1514,26 @@ service_proxy_event_cb (GUPnPServiceProxy *proxy,
 
         // check if IP is really null (workaround for Netgear DG834)
         if(g_strcmp0(router->external_ip, "0.0.0.0") == 0)
-            get_external_ip(router);
-        else
-            gui_set_ext_ip (router->external_ip);
+            urc_scheduler_run_now(router->scheduler, URC_POLL_EXTERNAL_IP);
+        else {
+            urc_sink->set_ext_ip (router, router->external_ip);
+            urc_scheduler_touch(router->scheduler, URC_POLL_EXTERNAL_IP);
+        }
     }
     /* WAN connection status changed */
     else if(g_strcmp0("ConnectionStatus", variable) == 0)
     {
-        gui_set_conn_status (g_value_get_string(value));
+        g_free(router->conn_status);
+        router->conn_status = g_value_dup_string(value);
+
+        urc_sink->set_conn_status (router, router->conn_status);
 
         if(g_strcmp0("Connected", g_value_get_string(value)) == 0)
             router->connected = TRUE;
         else
             router->connected = FALSE;
+        urc_metrics_set_connection(router->udn, router->connected, FALSE, 0);
+        urc_scheduler_touch(router->scheduler, URC_POLL_STATUS);
         g_print("\e[33mEvent:\e[0;0m Connection status: %s\n", g_value_get_string(value) );
     }
     else
@@ -815,6 +1541,72 @@ service_proxy_event_cb (GUPnPServiceProxy *proxy,
         g_print("\e[33mEvent:\e[0;0m %s [Not managed]", variable);
 }
 
+static void
+event_value_free (GValue *value)
+{
+    g_value_unset (value);
+    g_free (value);
+}
+
+/* The burst settled, apply the last value of each variable */
+static gboolean
+service_events_flush (gpointer data)
+{
+    RouterInfo *router = (RouterInfo *) data;
+    GHashTable *events;
+    GHashTableIter iter;
+    const gchar *variable;
+    const GValue *value;
+
+    router->event_timer = 0;
+
+    /* applying may start requests, the next burst gets a new table */
+    events = router->pending_events;
+    router->pending_events = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) event_value_free);
+
+    g_hash_table_iter_init (&iter, events);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &variable, (gpointer *) &value))
+        service_event_apply (router, variable, value);
+
+    g_hash_table_unref (events);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Service event callback, the events are held until the burst settles */
+static void
+service_proxy_event_cb (GUPnPServiceProxy *proxy,
+                        const char *variable,
+                        GValue *value,
+                        gpointer data)
+{
+    RouterInfo *router = (RouterInfo *) data;
+    GValue *copy;
+    gint64 now, waited;
+    guint delay = URC_EVENT_SETTLE_MS;
+
+    copy = g_new0 (GValue, 1);
+    g_value_init (copy, G_VALUE_TYPE (value));
+    g_value_copy (value, copy);
+
+    /* a newer value replaces the one still waiting */
+    g_hash_table_replace (router->pending_events, g_strdup (variable), copy);
+
+    now = g_get_monotonic_time ();
+
+    if (router->event_timer == 0)
+        router->event_burst_start = now;
+    else
+        urc_worker_source_remove (router->event_timer);
+
+    waited = (now - router->event_burst_start) / 1000;
+
+    if (waited + delay > URC_EVENT_MAX_DELAY_MS)
+        delay = waited < URC_EVENT_MAX_DELAY_MS ? URC_EVENT_MAX_DELAY_MS - waited : 0;
+
+    router->event_timer = urc_worker_timeout_add (delay, service_events_flush, router);
+}
+
 static gchar*
 parse_presentation_url(gchar *presentation_url, const gchar *device_location)
 {
@@ -887,6 +1679,21 @@ device_service_cmp(const char *devserv1, const char *devserv2, int ver2)
     return -1;
 }
 
+/* returns the version of a UPnP device/service string, or 0 if
+ * it's not of the given type */
+static int
+device_service_version(const char *devserv, const char *type)
+{
+    size_t len;
+
+    if(devserv == NULL || type == NULL)
+        return 0;
+    len = strlen(type);
+    if(strncmp(devserv, type, len) != 0)
+        return 0;
+    return atoi(devserv+len);
+}
+
 static void
 urc_set_main_device(GUPnPServiceProxy *proxy,
                     RouterInfo        *router,
@@ -910,9 +1717,9 @@ urc_set_main_device(GUPnPServiceProxy *proxy,
     router->model_name = gupnp_device_info_get_model_name (GUPNP_DEVICE_INFO (proxy));
     router->model_number = gupnp_device_info_get_model_number (GUPNP_DEVICE_INFO (proxy));
     router->upc = gupnp_device_info_get_upc (GUPNP_DEVICE_INFO (proxy));
-    router->udn = gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (proxy));
+    g_free (router->udn);
+    router->udn = g_strdup (gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (proxy)));
     router->device_descriptor = gupnp_device_info_get_location(GUPNP_DEVICE_INFO (proxy));
-    router->data_rate_timer = 0;
 
     url_base = gupnp_device_info_get_url_base (GUPNP_DEVICE_INFO (proxy));
     router->device_ip = url_base->host;
@@ -943,62 +1750,58 @@ urc_set_main_device(GUPnPServiceProxy *proxy,
             router->friendly_name = g_strdup (router->model_name);
     }
 
-    gui_set_router_info (router);
+    /* a router found again through another network is already known */
+    if (!g_hash_table_contains (routers, router->root_udn)) {
+        urc_sink->add_router (router);
+        urc_metrics_set_router (router->udn, router->friendly_name);
+    }
 }
 
+/* The SCPD of a service of "router", cached on disk, dropped when the
+ * router is unbound */
 static void
-urc_gupnp_introspection_callback (GUPnPServiceInfo *info,
-                                  GUPnPServiceIntrospection *introspection,
-                                  const GError *error,
-                                  gpointer user_data)
+service_scpd_fetch (RouterInfo        *router,
+                    GUPnPServiceProxy *service,
+                    UrcScpdCallback    callback)
 {
+    GUPnPServiceInfo *info = GUPNP_SERVICE_INFO (service);
+    gchar *url;
 
-    const GList *actions_list;
-    actions_list = gupnp_service_introspection_list_action_names (introspection);
+    url = gupnp_service_info_get_scpd_url (info);
 
-    if(actions_list != NULL) {
-        do {
-            g_print("               > %s\n", (gchar*) actions_list->data);
+    urc_scpd_fetch (gupnp_context_get_session (gupnp_service_info_get_context (info)),
+                    url, router->root_udn, router->cancellable, callback, router);
 
-        } while ((actions_list = actions_list->next));
-    }
+    g_free (url);
 }
 
+/* Look for the IGD in a device and its sub-devices, and start managing
+ * its services */
 static void
-device_proxy_available_cb (GUPnPControlPoint *cp,
-                           GUPnPServiceProxy *proxy,
-                           RouterInfo        *router)
+router_enum_device (GUPnPServiceProxy *proxy,
+                    RouterInfo        *router)
 {
     GList *services;
     GList *subdevices;
 
-    static char *connect_service = NULL;
     const char *service_type = NULL;
     const char *service_id = NULL;
     const char *device_type = NULL;
 
     static int level = 0;
 
-    if(level == 0) {
-
-        g_print ("==> Device Available: \e[31m%s\e[0;0m\n",
-                gupnp_device_info_get_friendly_name (GUPNP_DEVICE_INFO (proxy)));
-    }
-    
-    /* do nothing if there is already a device stored (and it's not a subdevice) */
-    if(router->main_device != NULL && level == 0)
-        return;
-
     device_type = gupnp_device_info_get_device_type (GUPNP_DEVICE_INFO (proxy));
 
     /* Is an IGD device? */
-    if(device_service_cmp (device_type, "urn:schemas-upnp-org:device:InternetGatewayDevice:", 1) == 0)
+    if(router->main_device == NULL &&
+       device_service_cmp (device_type, "urn:schemas-upnp-org:device:InternetGatewayDevice:", 1) == 0)
     {
         urc_set_main_device(proxy, router, TRUE);
 
     }
     /* There is only a WANConnectionDevice as root device? */
-    else if(device_service_cmp (device_type, "urn:schemas-upnp-org:device:WANConnectionDevice:", 1) == 0 && level == 0 )
+    else if(router->main_device == NULL &&
+            device_service_cmp (device_type, "urn:schemas-upnp-org:device:WANConnectionDevice:", 1) == 0 && level == 0 )
     {
         urc_set_main_device(proxy, router, FALSE);
     }
@@ -1029,36 +1832,30 @@ device_proxy_available_cb (GUPnPControlPoint *cp,
 
                 print_indent (level);
                 g_print("         Type: %s\n", service_type );
-
-
-                /* Introspect current service */
-                gupnp_service_info_get_introspection_async (services->data, urc_gupnp_introspection_callback, &level);
-
             }
 
             /* Is a IP forwarding service? */
             if( (device_service_cmp (service_type, "urn:schemas-upnp-org:service:Layer3Forwarding:", 1) == 0) ||
                 (device_service_cmp (service_type, "urn:schemas-upnp-org:service:L3Forwarding:", 1) == 0) )
             {
+                get_default_connection_service (services->data, router, level);
 
-                if(connect_service != NULL)
-                    g_free (connect_service);
-
-                connect_service = get_default_connection_service (services->data, level);
-
+                g_object_unref (services->data);
             }
             /* Is a WAN IFC service? */
             else if(device_service_cmp (service_type, "urn:schemas-upnp-org:service:WANCommonInterfaceConfig:", 1) == 0)
             {
                 router->wan_common_ifc = services->data;
+                urc_health_watch (router->health, router->wan_common_ifc);
 
-                /* Get common WAN link properties */
-                get_wan_link_properties (router);
+                /* Restore the past traffic */
+                if (router->traffic_log == NULL)
+                    traffic_log_load (router);
 
-                /* Start data rate timer */
-                update_data_rate_cb (router);
+                /* Pick the capabilities and counters, then start the data rate timer */
+                service_scpd_fetch (router, router->wan_common_ifc, wan_common_ifc_scpd_cb);
                 
-                urc_enable_graph ();
+                urc_sink->enable_graph (router);
 
             }
             /* Is a WAN IP Connection service or other? */
@@ -1066,7 +1863,14 @@ device_proxy_available_cb (GUPnPControlPoint *cp,
             {
 
                 router->wan_conn_service = services->data;
-                gui_activate_buttons();
+                urc_health_watch (router->health, router->wan_conn_service);
+                router->wan_conn_version = device_service_version (service_type, "urn:schemas-upnp-org:service:WANIPConnection:");
+                urc_sink->enable_port_mapping(router);
+
+                if(opt_debug) {
+                    print_indent (level);
+                    g_print ("      \e[32m** WANIPConnection version %u\e[0m\n", router->wan_conn_version);
+                }
 
                 if(opt_debug) {
                     print_indent (level);
@@ -1078,14 +1882,8 @@ device_proxy_available_cb (GUPnPControlPoint *cp,
                     g_strfreev (str);
                 }
 
-                /* Get external IP */
-                get_external_ip (router);
-                /* Get connection status info */
-                get_conn_status (router);
-                /* Get RSIP and NAT status */
-                get_nat_rsip_status (router);
-                /* Gets mapped port list */
-                discovery_mapped_ports_list(router);
+                /* Pick the capabilities, then get the connection state */
+                service_scpd_fetch (router, router->wan_conn_service, wan_conn_scpd_cb);
 
                 /* Subscribe to events */
                 gupnp_service_proxy_set_subscribed (services->data, TRUE);
@@ -1105,12 +1903,6 @@ device_proxy_available_cb (GUPnPControlPoint *cp,
                                                 G_TYPE_STRING,
                                                 service_proxy_event_cb,
                                                 router);
-
-                /**
-                 * Because some routers are not notify about changes,
-                 * let's polling the data every 5 minutes.
-                 */
-                router->refresh_timeout = g_timeout_add_seconds (300, urc_upnp_refresh_data_timeout, router);
             }
             else
                 g_object_unref (services->data);
@@ -1139,7 +1931,7 @@ device_proxy_available_cb (GUPnPControlPoint *cp,
         level = level + 1;
 
         /* Recursive pass */
-        device_proxy_available_cb (NULL, subdevices->data, router);
+        router_enum_device (subdevices->data, router);
 
         level = level - 1;
 
@@ -1149,43 +1941,642 @@ device_proxy_available_cb (GUPnPControlPoint *cp,
 
 }
 
+/* One network a router was seen on: the control point of the network
+ * and the root device proxy it announced */
+typedef struct
+{
+    GUPnPControlPoint *control_point;
+    GUPnPServiceProxy *proxy;
+
+    /* the higher, the better to poll through */
+    gint rank;
+
+    /* built from the cached location at startup, the control point
+     * doesn't own the proxy: replaced by the one it announces, dropped
+     * on the first failure */
+    gboolean provisional;
+
+} RouterPath;
+
+/* How good a network is to reach a device: on the same subnet there is
+ * no other hop in between, and IPv4 avoids link-local scope issues */
+static gint
+router_path_rank (GUPnPControlPoint *cp, GUPnPServiceProxy *proxy)
+{
+    GSSDPClient *client;
+    const SoupURI *url_base;
+    GInetAddress *device_address;
+    GInetAddressMask *mask;
+    gint rank = 0;
+
+    client = GSSDP_CLIENT (gupnp_control_point_get_context (cp));
+    url_base = gupnp_device_info_get_url_base (GUPNP_DEVICE_INFO (proxy));
+
+    device_address = g_inet_address_new_from_string (url_base->host);
+    if (device_address == NULL)
+        return rank;
+
+    mask = gssdp_client_get_address_mask (client);
+    if (mask != NULL) {
+        if (g_inet_address_mask_matches (mask, device_address))
+            rank += 2;
+
+        g_object_unref (mask);
+    }
+
+    if (g_inet_address_get_family (device_address) == G_SOCKET_FAMILY_IPV4)
+        rank += 1;
+
+    g_object_unref (device_address);
+
+    return rank;
+}
+
 static void
-device_proxy_unavailable_cb (GUPnPControlPoint *cp,
-                             GUPnPServiceProxy *proxy,
-                             RouterInfo        *router)
+router_path_free (RouterPath *path)
 {
-    g_print ("==> Device Unavailable: \e[31m%s\e[0;0m\n",
-            gupnp_device_info_get_friendly_name (GUPNP_DEVICE_INFO (proxy)));
+    g_object_unref (path->proxy);
+    g_free (path);
+}
+
+static const gchar*
+router_path_interface (const RouterPath *path)
+{
+    return gssdp_client_get_interface (GSSDP_CLIENT (gupnp_control_point_get_context (path->control_point)));
+}
+
+static RouterPath*
+router_find_path (RouterInfo *router, GUPnPControlPoint *cp)
+{
+    guint i;
+
+    for (i = 0; i < router->paths->len; i++) {
+        RouterPath *path = g_ptr_array_index (router->paths, i);
+
+        if (path->control_point == cp)
+            return path;
+    }
+
+    return NULL;
+}
+
+static RouterPath*
+router_best_path (RouterInfo *router)
+{
+    RouterPath *best = NULL;
+    guint i;
+
+    for (i = 0; i < router->paths->len; i++) {
+        RouterPath *path = g_ptr_array_index (router->paths, i);
+
+        if (best == NULL || path->rank > best->rank)
+            best = path;
+    }
+
+    return best;
+}
+
+static RouterPath*
+router_add_path (RouterInfo *router, GUPnPControlPoint *cp, GUPnPServiceProxy *proxy, gboolean provisional)
+{
+    RouterPath *path;
+
+    path = g_new0 (RouterPath, 1);
+    path->control_point = cp;
+    path->proxy = g_object_ref (proxy);
+    path->rank = router_path_rank (cp, proxy);
+    path->provisional = provisional;
+
+    g_ptr_array_add (router->paths, path);
+
+    if (opt_debug)
+        g_print ("\e[34m%s reachable through %s (rank %d)\e[0m\n",
+                 gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (proxy)),
+                 router_path_interface (path), path->rank);
+
+    return path;
+}
+
+static void router_path_failed (UrcHealth *health, UrcHealthState state, gpointer user_data);
+
+static RouterInfo*
+router_new (const gchar *root_udn)
+{
+    RouterInfo *router;
+    guint i;
+
+    router = g_malloc0( sizeof(RouterInfo) );
+    router->root_udn = g_strdup (root_udn);
+    router->paths = g_ptr_array_new_with_free_func ((GDestroyNotify) router_path_free);
+    router->cancellable = g_cancellable_new ();
+    router->scheduler = urc_scheduler_new (URC_POLL_N_ITEMS, router);
+    router->health = urc_health_new (router_health_changed, router);
+    urc_health_set_failure_func (router->health, router_path_failed);
+    router->pending_events = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) event_value_free);
+    router->port_mappings = urc_mapping_store_new ();
+    router->down_history = urc_history_new ();
+    router->up_history = urc_history_new ();
+
+    for (i = 0; i < URC_POLL_N_ITEMS; i++)
+        urc_scheduler_set_item (router->scheduler, i,
+                                poll_items[i].name,
+                                poll_items[i].interval_ms,
+                                poll_items[i].jitter,
+                                poll_items[i].priority,
+                                poll_items[i].func);
+
+    return router;
+}
+
+/* Stop using the services of the current network: pending requests,
+ * timers and event subscriptions. The mappings, histories and traffic
+ * log are kept. */
+static void
+router_unbind (RouterInfo *router)
+{
+    /* Drop the pending requests, their replies must not reach
+     * the RouterInfo any more */
+    g_cancellable_cancel (router->cancellable);
+    g_object_unref (router->cancellable);
+    router->cancellable = g_cancellable_new ();
+
+    urc_scheduler_stop_all (router->scheduler);
+    urc_scheduler_set_paused (router->scheduler, FALSE);
+    router->data_rate_busy = FALSE;
+
+    if (router->event_timer > 0) {
+        urc_worker_source_remove (router->event_timer);
+        router->event_timer = 0;
+    }
+
+    g_hash_table_remove_all (router->pending_events);
+
+    if (router->mapping_cancellable != NULL) {
+        g_cancellable_cancel (router->mapping_cancellable);
+        g_clear_object (&router->mapping_cancellable);
+    }
+
+    if (router->wan_conn_service != NULL) {
+        gupnp_service_proxy_remove_notify (router->wan_conn_service, "PortMappingNumberOfEntries",
+                                           service_proxy_event_cb, router);
+        gupnp_service_proxy_remove_notify (router->wan_conn_service, "ExternalIPAddress",
+                                           service_proxy_event_cb, router);
+        gupnp_service_proxy_remove_notify (router->wan_conn_service, "ConnectionStatus",
+                                           service_proxy_event_cb, router);
+        gupnp_service_proxy_set_subscribed (router->wan_conn_service, FALSE);
+        urc_health_unwatch (router->wan_conn_service);
+    }
+
+    if (router->wan_common_ifc != NULL)
+        urc_health_unwatch (router->wan_common_ifc);
+
+    g_clear_object (&router->wan_conn_service);
+    g_clear_object (&router->wan_common_ifc);
+
+    router->main_device = NULL;
+    router->control_point = NULL;
+    router->caps = 0;
+    router->device_descriptor = NULL;
+    router->device_ip = NULL;
+
+    g_clear_pointer (&router->upc, g_free);
+    g_clear_pointer (&router->friendly_name, g_free);
+    g_clear_pointer (&router->brand, g_free);
+    g_clear_pointer (&router->http_address, g_free);
+    g_clear_pointer (&router->brand_website, g_free);
+    g_clear_pointer (&router->model_description, g_free);
+    g_clear_pointer (&router->model_name, g_free);
+    g_clear_pointer (&router->model_number, g_free);
+}
+
+/* Poll the router through "path" */
+static void
+router_bind (RouterInfo *router, RouterPath *path)
+{
+    router->control_point = path->control_point;
+
+    /* a new network, give it a fresh start */
+    if (urc_health_get_state (router->health) != URC_HEALTH_UP) {
+        urc_health_reset (router->health);
+        urc_sink->set_health (router);
+    }
+
+    router_enum_device (path->proxy, router);
+}
+
+static void
+router_free (RouterInfo *router)
+{
+    router_unbind (router);
+    g_object_unref (router->cancellable);
+    g_hash_table_unref (router->pending_events);
+    urc_scheduler_free (router->scheduler);
+    urc_health_free (router->health);
+
+    if (router->path_drop > 0)
+        urc_worker_source_remove (router->path_drop);
+
+    urc_mapping_store_free (router->port_mappings);
+    urc_history_free (router->down_history);
+    urc_history_free (router->up_history);
+
+    if (router->traffic_log != NULL) {
+        traffic_log_checkpoint (router);
+        urc_traffic_log_close (router->traffic_log);
+    }
+
+    g_ptr_array_unref (router->paths);
+
+    g_free (router->root_udn);
+    g_free (router->udn);
+    g_free (router->external_ip);
+    g_free (router->conn_status);
+    g_free (router);
+}
+
+/* The router went away, the caller already took it out of "routers" */
+static void
+router_remove (RouterInfo *router)
+{
+    urc_sink->remove_router (router);
+    urc_metrics_clear_router (router->udn);
+
+    router_free (router);
+}
+
+/* The router can't be reached through "cp" any more. Move to the best
+ * network left, if any, otherwise drop it. The paths left behind are
+ * gone from the router, a later failover can't pick them again. */
+static void
+router_lose_path (RouterInfo *router, GUPnPControlPoint *cp)
+{
+    RouterPath *path, *best;
+
+    path = router_find_path (router, cp);
+    if (path == NULL)
+        return;
+
+    if (router->control_point != cp) {
+        g_ptr_array_remove (router->paths, path);
+        return;
+    }
+
+    router_unbind (router);
+    g_ptr_array_remove (router->paths, path);
+
+    while ((best = router_best_path (router)) != NULL) {
+        g_print ("* %s: switching to %s\n", router->root_udn, router_path_interface (best));
+        router_bind (router, best);
+
+        if (router->main_device != NULL)
+            break;
 
-    if(g_strcmp0(router->udn, gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (proxy))) == 0 ) {
+        /* the device on that network is different */
+        router_unbind (router);
+        g_ptr_array_remove (router->paths, best);
+    }
+
+    /* nothing left */
+    if (router->main_device == NULL) {
+        g_hash_table_remove (routers, router->root_udn);
+        router_remove (router);
+    }
+}
+
+static gboolean
+router_path_drop_cb (gpointer data)
+{
+    RouterInfo *router = (RouterInfo *) data;
+    RouterPath *path;
+
+    router->path_drop = 0;
+
+    path = router_find_path (router, router->control_point);
+
+    if (path != NULL && path->provisional) {
+        g_print ("* %s: not answering at its cached location\n", router->root_udn);
+        router_lose_path (router, router->control_point);
+    }
 
-        g_source_remove (router->refresh_timeout);
-        if (router->data_rate_timer > 0) {
-          g_source_remove (router->data_rate_timer);
+    return G_SOURCE_REMOVE;
+}
+
+/* A request failed: a provisional path isn't trusted any further. Left
+ * to an idle, the request is still completing. */
+static void
+router_path_failed (UrcHealth      *health,
+                    UrcHealthState  state,
+                    gpointer        user_data)
+{
+    RouterInfo *router = (RouterInfo *) user_data;
+    RouterPath *path;
+
+    path = router_find_path (router, router->control_point);
+
+    if (path != NULL && path->provisional && router->path_drop == 0)
+        router->path_drop = urc_worker_timeout_add (0, router_path_drop_cb, router);
+}
+
+RouterInfo*
+urc_upnp_lookup_router (const gchar *root_udn)
+{
+    return g_hash_table_lookup (routers, root_udn);
+}
+
+/* Replace the proxy of a provisional path by the one the control point
+ * announced */
+static void
+router_confirm_path (RouterInfo *router, RouterPath *path, GUPnPServiceProxy *proxy)
+{
+    gboolean bound = router->control_point == path->control_point;
+
+    if (opt_debug)
+        g_print ("\e[34m%s announced through %s\e[0m\n", router->root_udn, router_path_interface (path));
+
+    if (bound)
+        router_unbind (router);
+
+    g_object_unref (path->proxy);
+    path->proxy = g_object_ref (proxy);
+    path->rank = router_path_rank (path->control_point, proxy);
+    path->provisional = FALSE;
+
+    if (bound)
+        router_bind (router, path);
+}
+
+/* "proxy" was announced on "cp", or built from the cached location when
+ * "provisional" */
+static void
+router_found (GUPnPControlPoint *cp,
+              GUPnPServiceProxy *proxy,
+              gboolean           provisional)
+{
+    RouterInfo *router;
+    RouterPath *path, *current;
+    const gchar *root_udn;
+
+    root_udn = gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (proxy));
+    router = g_hash_table_lookup (routers, root_udn);
+
+    /* already managed, seen from another network: poll it through the
+     * better of the two */
+    if (router != NULL) {
+        path = router_find_path (router, cp);
+
+        if (path != NULL) {
+            if (path->provisional && !provisional)
+                router_confirm_path (router, path, proxy);
+
+            return;
         }
 
-        gui_disable ();
+        path = router_add_path (router, cp, proxy, provisional);
+        current = router_find_path (router, router->control_point);
+
+        if (current == NULL || path->rank > current->rank) {
+            g_print ("* %s: switching to %s\n", root_udn, router_path_interface (path));
+
+            router_unbind (router);
+            router_bind (router, path);
 
-        router->main_device = NULL;
+            /* not the same device after all, back to the previous
+             * network and forget this one */
+            if (router->main_device == NULL) {
+                router_unbind (router);
+                g_ptr_array_remove (router->paths, path);
 
-        if(router->external_ip != NULL) {
-            g_free (router->external_ip);
-            router->external_ip = NULL;
+                if (current != NULL)
+                    router_bind (router, current);
+            }
         }
 
-        if(router->upc != NULL)
-            g_free (router->upc);
+        return;
+    }
+
+    router = router_new (root_udn);
+    path = router_add_path (router, cp, proxy, provisional);
+
+    router_bind (router, path);
+
+    /* not a gateway */
+    if (router->main_device == NULL) {
+        router_free (router);
+        return;
+    }
+
+    g_hash_table_insert (routers, router->root_udn, router);
+
+    urc_router_cache_save (root_udn, gupnp_device_info_get_location (GUPNP_DEVICE_INFO (proxy)));
+
+    if (opt_debug)
+        g_print ("\e[34mManaging %u router(s)\e[0m\n", g_hash_table_size (routers));
+}
+
+static void
+device_proxy_available_cb (GUPnPControlPoint *cp,
+                           GUPnPServiceProxy *proxy,
+                           gpointer           user_data)
+{
+    g_print ("==> Device Available: \e[31m%s\e[0;0m\n",
+            gupnp_device_info_get_friendly_name (GUPNP_DEVICE_INFO (proxy)));
+
+    router_found (cp, proxy, FALSE);
+}
+
+/* A description fetched from the cached location of a router, or read
+ * from the document cache */
+typedef struct
+{
+    /* weak, NULL once the network went away */
+    GUPnPControlPoint *control_point;
+    gchar *root_udn;
+    SoupURI *uri;
+
+    /* cached description */
+    gchar *data;
+    gsize length;
+
+} WarmStart;
+
+static void
+warm_start_free (WarmStart *warm)
+{
+    if (warm->control_point != NULL)
+        g_object_remove_weak_pointer (G_OBJECT (warm->control_point), (gpointer *) &warm->control_point);
+
+    soup_uri_free (warm->uri);
+    g_free (warm->root_udn);
+    g_free (warm->data);
+    g_free (warm);
+}
+
+static xmlNode*
+warm_start_find_device (xmlDoc *xml_doc)
+{
+    xmlNode *node;
+
+    node = xmlDocGetRootElement (xml_doc);
+    if (node == NULL)
+        return NULL;
+
+    for (node = node->children; node != NULL; node = node->next) {
+        if (node->type == XML_ELEMENT_NODE && strcmp ((const char *) node->name, "device") == 0)
+            return node;
+    }
+
+    return NULL;
+}
+
+/* Build the device proxy from the description as the control point
+ * would after a SSDP answer. Any failure is left to the discovery.
+ * Returns TRUE when the description is the one of the router. */
+static gboolean
+warm_start_build (WarmStart *warm, const gchar *data, gsize length)
+{
+    GUPnPControlPoint *cp = warm->control_point;
+    GUPnPResourceFactory *factory;
+    GUPnPDeviceProxy *proxy;
+    GUPnPXMLDoc *doc;
+    xmlDoc *xml_doc;
+    xmlNode *element;
+    gchar *location;
+    gboolean found = FALSE;
+
+    xml_doc = xmlRecoverMemory (data, length);
+    element = xml_doc != NULL ? warm_start_find_device (xml_doc) : NULL;
+
+    if (element == NULL) {
+        if (xml_doc != NULL)
+            xmlFreeDoc (xml_doc);
+
+        return FALSE;
+    }
+
+    location = soup_uri_to_string (warm->uri, FALSE);
+
+    doc = gupnp_xml_doc_new (xml_doc);
+    factory = gupnp_control_point_get_resource_factory (cp);
 
-        g_free (router->friendly_name);
-        g_free (router->brand);
-        g_free (router->http_address);
-        g_free (router->brand_website);
-        g_free (router->model_description);
-        g_free (router->model_name);
-        g_free (router->model_number);
-        g_free (router);
+    proxy = gupnp_resource_factory_create_device_proxy (factory,
+                                                        gupnp_control_point_get_context (cp),
+                                                        doc,
+                                                        element,
+                                                        warm->root_udn,
+                                                        location,
+                                                        warm->uri);
+
+    /* another device took the address */
+    if (g_strcmp0 (gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (proxy)), warm->root_udn) != 0) {
+        urc_router_cache_forget (warm->root_udn);
+    } else {
+        if (opt_debug)
+            g_print ("\e[34mWarm start of %s from %s\e[0m\n", warm->root_udn, location);
+
+        router_found (cp, (GUPnPServiceProxy *) proxy, TRUE);
+        found = TRUE;
     }
 
+    g_object_unref (proxy);
+    g_object_unref (doc);
+    g_free (location);
+
+    return found;
+}
+
+static void
+warm_start_cb (SoupSession *session,
+               SoupMessage *msg,
+               gpointer     user_data)
+{
+    WarmStart *warm = user_data;
+
+    if (warm->control_point == NULL || msg->status_code == SOUP_STATUS_CANCELLED)
+        goto out;
+
+    if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code)) {
+        if (opt_debug)
+            g_print ("\e[34mCached router %s not answering: %s\e[0m\n", warm->root_udn, msg->reason_phrase);
+
+        if (!g_hash_table_contains (routers, warm->root_udn))
+            urc_router_cache_forget (warm->root_udn);
+
+        goto out;
+    }
+
+    if (warm_start_build (warm, msg->response_body->data, msg->response_body->length))
+        urc_doc_cache_store (warm->uri, warm->root_udn, msg->response_body->data, msg->response_body->length);
+
+out:
+    warm_start_free (warm);
+}
+
+static gboolean
+warm_start_cached_cb (gpointer user_data)
+{
+    WarmStart *warm = user_data;
+
+    /* discovered meanwhile */
+    if (warm->control_point != NULL && !g_hash_table_contains (routers, warm->root_udn))
+        warm_start_build (warm, warm->data, warm->length);
+
+    warm_start_free (warm);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Fetch the description of a cached router while the SSDP search runs,
+ * unless the document cache still has it */
+static void
+warm_start (const gchar *root_udn,
+            const gchar *location,
+            gpointer     user_data)
+{
+    GUPnPControlPoint *cp = user_data;
+    WarmStart *warm;
+    SoupMessage *msg;
+    SoupURI *uri;
+
+    /* already polled, the discovery will tell about this network */
+    if (g_hash_table_contains (routers, root_udn))
+        return;
+
+    uri = soup_uri_new (location);
+    if (uri == NULL)
+        return;
+
+    warm = g_new0 (WarmStart, 1);
+    warm->control_point = cp;
+    warm->root_udn = g_strdup (root_udn);
+    warm->uri = uri;
+    g_object_add_weak_pointer (G_OBJECT (cp), (gpointer *) &warm->control_point);
+
+    /* built from an idle, the router cache is being walked */
+    if (urc_doc_cache_lookup (uri, root_udn, &warm->data, &warm->length)) {
+        urc_worker_timeout_add (0, warm_start_cached_cb, warm);
+        return;
+    }
+
+    msg = soup_message_new_from_uri (SOUP_METHOD_GET, uri);
+
+    soup_session_queue_message (gupnp_context_get_session (gupnp_control_point_get_context (cp)),
+                                msg, warm_start_cb, warm);
+}
+
+static void
+device_proxy_unavailable_cb (GUPnPControlPoint *cp,
+                             GUPnPServiceProxy *proxy,
+                             gpointer           user_data)
+{
+    RouterInfo *router;
+
+    g_print ("==> Device Unavailable: \e[31m%s\e[0;0m\n",
+            gupnp_device_info_get_friendly_name (GUPNP_DEVICE_INFO (proxy)));
+
+    router = g_hash_table_lookup (routers, gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (proxy)));
+
+    if (router != NULL)
+        router_lose_path (router, cp);
 }
 
 static void
@@ -1194,33 +2585,34 @@ on_context_available (GUPnPContextManager *context_manager,
                       gpointer user_data)
 {
     GUPnPControlPoint *cp;
-    RouterInfo* router;
 
     g_print ("* Starting UPnP Resource discovery... ");
     
+    urc_http_setup_session (gupnp_context_get_session (context));
+    urc_doc_cache_watch (GSSDP_CLIENT (context));
+
     /* Create a Control Point targeting RootDevice */
     cp = gupnp_control_point_new (context, "upnp:rootdevice");
 
-    router = g_malloc( sizeof(RouterInfo) );
-    router->main_device = NULL;
-    router->external_ip = NULL;
-
     /* The service-proxy-available signal is emitted when any services which match
      * our target are found, so connect to it */
     g_signal_connect (cp,
             "device-proxy-available",
             G_CALLBACK (device_proxy_available_cb),
-            router);
+            NULL);
 
     g_signal_connect (cp,
             "device-proxy-unavailable",
             G_CALLBACK (device_proxy_unavailable_cb),
-            router);
+            NULL);
 
     /* Tell the Control Point to start searching */
     gssdp_resource_browser_set_active (GSSDP_RESOURCE_BROWSER (cp), TRUE);
     gupnp_context_manager_manage_control_point(context_manager, cp);
 
+    /* Reach the known routers directly, the discovery takes seconds */
+    urc_router_cache_foreach (warm_start, cp);
+
     client_ip = gssdp_client_get_host_ip (GSSDP_CLIENT(context));
 
     g_print ("\e[1;37m%s:\e[0;0m host IP %s network %s\n",
@@ -1237,7 +2629,29 @@ on_context_unavailable (GUPnPContextManager *context_manager,
                         GUPnPContext *context,
                         gpointer user_data)
 {
+    GList *list, *l;
+    guint i;
+
     g_print ("* Detected network unavailable, trying to reconnect...\n");
+
+    /* the routers seen on this network fail over to another one, or go
+     * away; router_lose_path() may change "routers" */
+    list = g_hash_table_get_values (routers);
+
+    for (l = list; l != NULL; l = l->next) {
+        RouterInfo *router = l->data;
+
+        for (i = 0; i < router->paths->len; i++) {
+            RouterPath *path = g_ptr_array_index (router->paths, i);
+
+            if (gupnp_control_point_get_context (path->control_point) == context) {
+                router_lose_path (router, path->control_point);
+                break;
+            }
+        }
+    }
+
+    g_list_free (list);
 }
 
 
@@ -1245,6 +2659,14 @@ gboolean
 upnp_init()
 {
     GUPnPWhiteList *white_list;
+    GError *error = NULL;
+
+    if (opt_metrics_port > 0 && !urc_metrics_start (opt_metrics_port, &error)) {
+        g_printerr ("\e[31m[EE]\e[0m Unable to serve the metrics on port %u: %s\n", opt_metrics_port, error->message);
+        g_error_free (error);
+    }
+
+    routers = g_hash_table_new (g_str_hash, g_str_equal);
 
     /* Create a new GUPnP Context. */
     context_mngr = gupnp_context_manager_create (opt_bindport);
@@ -1267,3 +2689,26 @@ upnp_init()
 
     return TRUE;
 }
+
+/* Exiting: save the histories and write the open block of each traffic
+ * log, the routers are left as they are */
+void
+urc_upnp_shutdown (void)
+{
+    GHashTableIter iter;
+    RouterInfo *router;
+
+    if (routers == NULL)
+        return;
+
+    g_hash_table_iter_init (&iter, routers);
+
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &router)) {
+        if (router->traffic_log == NULL)
+            continue;
+
+        traffic_log_checkpoint (router);
+        urc_traffic_log_close (router->traffic_log);
+        router->traffic_log = NULL;
+    }
+}
@@ -25,6 +25,13 @@
 #include <glib.h>
 #include <libgupnp/gupnp-control-point.h>
 
+#include "urc-history.h"
+#include "urc-traffic-log.h"
+#include "urc-counter.h"
+#include "urc-health.h"
+#include "urc-rate.h"
+#include "urc-scheduler.h"
+
 typedef struct
 {
     gboolean enabled;
@@ -38,8 +45,63 @@ typedef struct
 
 } PortForwardInfo;
 
+/* GENA events of a variable arriving closer than this are merged, only
+ * the last value is applied once they stop */
+#define URC_EVENT_SETTLE_MS     250
+
+/* A burst that doesn't stop is still applied this often */
+#define URC_EVENT_MAX_DELAY_MS  2000
+
+/* The histories are saved next to the traffic log this often, a restart
+ * reads the samples logged since */
+#define URC_TRAFFIC_CHECKPOINT_INTERVAL (60 * G_USEC_PER_SEC)
+
+/* Data polled on a router, the items of its scheduler */
+typedef enum
+{
+    URC_POLL_COUNTERS,
+    URC_POLL_STATUS,
+    URC_POLL_EXTERNAL_IP,
+    URC_POLL_NAT_RSIP,
+    URC_POLL_MAPPINGS,
+    URC_POLL_N_ITEMS
+} UrcPollItem;
+
+/* Where the WAN byte counters are read from */
+typedef enum
+{
+    URC_COUNTERS_32,    /* GetTotalBytesReceived/Sent, ui4 */
+    URC_COUNTERS_UI8,   /* GetTotalBytesReceived/Sent, ui8 */
+    URC_COUNTERS_AVM    /* GetAddonInfos 64 bit counters */
+} UrcCounterSource;
+
+/* Actions and state variables found in the service descriptions, the
+ * requests a router doesn't support are never sent */
+typedef enum
+{
+    URC_CAP_EXTERNAL_IP            = 1 << 0,  /* GetExternalIPAddress */
+    URC_CAP_STATUS_INFO            = 1 << 1,  /* GetStatusInfo */
+    URC_CAP_NAT_RSIP_STATUS        = 1 << 2,  /* GetNATRSIPStatus */
+    URC_CAP_GENERIC_MAPPING        = 1 << 3,  /* GetGenericPortMappingEntry */
+    URC_CAP_LIST_OF_MAPPINGS       = 1 << 4,  /* GetListOfPortMappings */
+    URC_CAP_COMMON_LINK_PROPERTIES = 1 << 5,  /* GetCommonLinkProperties */
+    URC_CAP_TOTAL_BYTES            = 1 << 6,  /* GetTotalBytesReceived/Sent */
+    URC_CAP_TOTAL_PACKETS          = 1 << 7,  /* GetTotalPacketsReceived/Sent */
+    URC_CAP_ADDON_INFOS            = 1 << 8,  /* GetAddonInfos with the AVM 64 bit counters */
+    URC_CAP_TOTAL_BYTES_UI8        = 1 << 9   /* TotalBytesReceived/Sent are ui8 */
+} UrcCaps;
+
 typedef struct
 {
+    /* UDN of the root device announced, the key of the router */
+    gchar *root_udn;
+
+    /* control point of the network it is polled through, not referenced */
+    GUPnPControlPoint *control_point;
+
+    /* every network it was seen on, see RouterPath in urc-upnp.c */
+    GPtrArray *paths;
+
     GUPnPDeviceInfo *main_device;
     gchar* friendly_name;
     gchar* brand;
@@ -49,26 +111,92 @@ typedef struct
     gchar* model_number;
     gchar* http_address;
     gchar* upc;
-    const gchar* udn;
+    /* kept across a switch of network, the key of the metrics */
+    gchar* udn;
     const gchar* device_descriptor;
     const gchar* device_ip;
 
     gchar* external_ip;
+    gchar* conn_status;
 
     gboolean rsip_available;
     gboolean nat_enabled;
     gboolean connected;
 
-    /* no-event refresh timer */
-    guint refresh_timeout;
+    /* polls of the data, pushed back by the events */
+    UrcScheduler *scheduler;
+
+    /* whether it answers, the polls are held while it doesn't */
+    UrcHealth *health;
+
+    /* drops a provisional path that failed, see router_path_failed() */
+    guint path_drop;
 
-    guint data_rate_timer;
+    /* events waiting for their burst to settle, variable -> GValue */
+    GHashTable *pending_events;
+    guint event_timer;
+    gint64 event_burst_start;
+
+    /* a data rate sample is waiting for its replies */
+    gboolean data_rate_busy;
 
     GUPnPServiceProxy *wan_conn_service;
     GUPnPServiceProxy *wan_common_ifc;
 
+    /* WANIPConnection version, 2 supports GetListOfPortMappings */
+    guint wan_conn_version;
+
+    /* UrcCaps of the services, an action failing with 401 or 602 is
+     * removed too */
+    guint caps;
+
+    /* throughput history, KiB/s */
+    UrcHistory *down_history;
+    UrcHistory *up_history;
+
+    /* counters log on disk, NULL if it can't be opened */
+    UrcTrafficLog *traffic_log;
+
+    /* last sample logged, and the one of the last checkpoint of the
+     * histories, see traffic_log_checkpoint() */
+    gint64 traffic_log_time;
+    gint64 traffic_checkpoint_time;
+
+    /* WAN byte counters */
+    UrcCounterSource counter_source;
+    UrcCounter received_counter;
+    UrcCounter sent_counter;
+
+    /* GetTotalPacketsReceived/Sent, optional */
+    UrcCounter packets_received_counter;
+    UrcCounter packets_sent_counter;
+
+    /* rate estimators of the counters above */
+    UrcRate received_rate;
+    UrcRate sent_rate;
+    UrcRate packets_received_rate;
+    UrcRate packets_sent_rate;
+
+    /* known port mappings, see urc-mapping-store.h */
+    struct _UrcMappingStore *port_mappings;
+
+    /* our adds and deletes whose PortMappingNumberOfEntries event is
+     * still to come, see service_event_apply() */
+    guint own_mapping_changes;
+
+    /* cancelled when the router goes away, drops the pending requests */
+    GCancellable *cancellable;
+
+    /* the running mapping table read, cancelled by a newer one */
+    GCancellable *mapping_cancellable;
+
 } RouterInfo;
 
+/* Result of an add/delete port mapping request, "error" is NULL on success */
+typedef void (*UrcPortMappingCallback) (PortForwardInfo *port_info,
+                                        const GError    *error,
+                                        gpointer         user_data);
+
 /* Functions */
 const gchar*
 get_client_ip();
@@ -76,11 +204,23 @@ get_client_ip();
 gboolean
 upnp_init();
 
-gboolean
-delete_port_mapped(GUPnPServiceProxy *wan_service, const gchar *protocol, const guint external_port, const gchar *remote_host, GError **error);
+void
+urc_upnp_shutdown (void);
 
-gboolean
-add_port_mapping(GUPnPServiceProxy *wan_service, PortForwardInfo *port_info, GError **error);
+RouterInfo*
+urc_upnp_lookup_router (const gchar *root_udn);
+
+PortForwardInfo*
+port_forward_info_copy(const PortForwardInfo *port_info);
+
+void
+port_forward_info_free(PortForwardInfo *port_info);
+
+void
+delete_port_mapped(RouterInfo *router, const gchar *protocol, const guint external_port, const gchar *remote_host, UrcPortMappingCallback callback, gpointer user_data);
+
+void
+add_port_mapping(RouterInfo *router, PortForwardInfo *port_info, UrcPortMappingCallback callback, gpointer user_data);
 
 void
 urc_upnp_refresh_data (RouterInfo *router);
@@ -0,0 +1,634 @@
+/* urc-worker.c
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+#include "urc-worker.h"
+
+static struct
+{
+    GMainContext *context;
+    GThread *thread;
+
+    /* cleared by urc_worker_stop(), on the UPnP thread */
+    gboolean running;
+
+    /* set once the UPnP thread let everything go */
+    gint stopped;
+
+    /* held by the UPnP thread, except while it sleeps in poll() */
+    GRecMutex lock;
+
+} worker;
+
+/* times the calling thread holds the lock */
+static GPrivate lock_depth = G_PRIVATE_INIT (NULL);
+
+void
+urc_worker_lock (void)
+{
+    g_rec_mutex_lock (&worker.lock);
+    g_private_set (&lock_depth, GUINT_TO_POINTER (GPOINTER_TO_UINT (g_private_get (&lock_depth)) + 1));
+}
+
+void
+urc_worker_unlock (void)
+{
+    g_private_set (&lock_depth, GUINT_TO_POINTER (GPOINTER_TO_UINT (g_private_get (&lock_depth)) - 1));
+    g_rec_mutex_unlock (&worker.lock);
+}
+
+/* Let the other thread in whatever the nesting, returns the depth to
+ * give to worker_reacquire() */
+static guint
+worker_release (void)
+{
+    guint depth, i;
+
+    depth = GPOINTER_TO_UINT (g_private_get (&lock_depth));
+
+    for (i = 0; i < depth; i++)
+        urc_worker_unlock ();
+
+    return depth;
+}
+
+static void
+worker_reacquire (guint depth)
+{
+    guint i;
+
+    for (i = 0; i < depth; i++)
+        urc_worker_lock ();
+}
+
+/* The UI thread can read the routers while this one sleeps */
+static gint
+worker_poll (GPollFD *fds, guint nfds, gint timeout)
+{
+    gint ret;
+
+    urc_worker_unlock ();
+    ret = g_poll (fds, nfds, timeout);
+    urc_worker_lock ();
+
+    return ret;
+}
+
+static gpointer
+worker_thread (gpointer data)
+{
+    /* GSSDP, GUPnP, libsoup and GTask pick the thread default context */
+    g_main_context_push_thread_default (worker.context);
+
+    urc_worker_lock ();
+
+    while (worker.running)
+        g_main_context_iteration (worker.context, TRUE);
+
+    urc_worker_unlock ();
+
+    g_main_context_pop_thread_default (worker.context);
+
+    g_atomic_int_set (&worker.stopped, TRUE);
+    g_main_context_wakeup (g_main_context_default ());
+
+    return NULL;
+}
+
+void
+urc_worker_start (void)
+{
+    g_return_if_fail (worker.thread == NULL);
+
+    worker.context = g_main_context_new ();
+    g_main_context_set_poll_func (worker.context, worker_poll);
+
+    worker.running = TRUE;
+    worker.stopped = FALSE;
+    worker.thread = g_thread_new ("urc-upnp", worker_thread, NULL);
+}
+
+typedef struct
+{
+    GSourceFunc func;
+    gpointer data;
+
+} WorkerStop;
+
+static gboolean
+worker_stop_cb (gpointer user_data)
+{
+    WorkerStop *stop = (WorkerStop *) user_data;
+
+    if (stop->func != NULL)
+        stop->func (stop->data);
+
+    worker.running = FALSE;
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Run "func" on the UPnP thread, as the last thing it does, and wait
+ * for the thread to end. Called on the UI thread, which keeps delivering
+ * the sink calls meanwhile. */
+void
+urc_worker_stop (GSourceFunc func,
+                 gpointer    data)
+{
+    WorkerStop stop = { func, data };
+
+    if (worker.thread == NULL)
+        return;
+
+    urc_worker_invoke (worker_stop_cb, &stop, NULL);
+
+    /* the UPnP thread may be waiting for a remove_router() */
+    while (!g_atomic_int_get (&worker.stopped))
+        g_main_context_iteration (NULL, TRUE);
+
+    g_thread_join (worker.thread);
+    worker.thread = NULL;
+}
+
+GMainContext*
+urc_worker_get_context (void)
+{
+    return worker.context;
+}
+
+static guint
+worker_attach (GSource        *source,
+               GMainContext   *context,
+               GSourceFunc     func,
+               gpointer        data,
+               GDestroyNotify  notify)
+{
+    guint id;
+
+    g_source_set_callback (source, func, data, notify);
+    id = g_source_attach (source, context);
+    g_source_unref (source);
+
+    return id;
+}
+
+void
+urc_worker_invoke (GSourceFunc    func,
+                   gpointer       data,
+                   GDestroyNotify notify)
+{
+    GSource *source;
+
+    /* never in place: between two iterations the caller could acquire
+     * the context and run without the lock */
+    source = g_idle_source_new ();
+    g_source_set_priority (source, G_PRIORITY_DEFAULT);
+
+    worker_attach (source, worker.context, func, data, notify);
+}
+
+void
+urc_worker_invoke_ui (GSourceFunc    func,
+                      gpointer       data,
+                      GDestroyNotify notify)
+{
+    /* never run in place, even if the UI thread is between iterations */
+    worker_attach (g_idle_source_new (), g_main_context_default (), func, data, notify);
+}
+
+guint
+urc_worker_timeout_add (guint       interval,
+                        GSourceFunc func,
+                        gpointer    data)
+{
+    return worker_attach (g_timeout_source_new (interval), worker.context, func, data, NULL);
+}
+
+guint
+urc_worker_timeout_add_seconds (guint       interval,
+                                GSourceFunc func,
+                                gpointer    data)
+{
+    return worker_attach (g_timeout_source_new_seconds (interval), worker.context, func, data, NULL);
+}
+
+void
+urc_worker_source_remove (guint id)
+{
+    GSource *source;
+
+    source = g_main_context_find_source_by_id (worker.context, id);
+    if (source != NULL)
+        g_source_destroy (source);
+}
+
+/* Sink queue: the calls of the UPnP thread wait here for the UI thread,
+ * the arguments are copied. */
+
+typedef enum
+{
+    CALL_ROUTER,    /* (router) */
+    CALL_STRING,    /* (router, const gchar*) */
+    CALL_TOTAL,     /* (router, guint64) */
+    CALL_RATE,      /* (router, gdouble) */
+    CALL_PACKETS,   /* (router, gdouble, gdouble) */
+    CALL_PORT       /* (router, const PortForwardInfo*) */
+} QueueCallKind;
+
+typedef struct
+{
+    QueueCallKind kind;
+    GCallback func;
+    RouterInfo *router;
+
+    gchar *string;
+    guint64 total;
+    gdouble value;
+    gdouble value2;
+    PortForwardInfo *port_info;
+
+    /* the caller waits for the delivery and frees the item */
+    gboolean wait;
+    gboolean delivered;
+
+} QueueItem;
+
+static struct
+{
+    const UrcSink *target;
+
+    GMutex mutex;
+    GCond delivered;
+    GQueue items;
+    gboolean scheduled;
+
+} queue;
+
+static QueueItem*
+queue_item_new (QueueCallKind kind, GCallback func, RouterInfo *router)
+{
+    QueueItem *item;
+
+    item = g_new0 (QueueItem, 1);
+    item->kind = kind;
+    item->func = func;
+    item->router = router;
+
+    return item;
+}
+
+static void
+queue_item_free (QueueItem *item)
+{
+    g_free (item->string);
+
+    if (item->port_info != NULL)
+        port_forward_info_free (item->port_info);
+
+    g_free (item);
+}
+
+static void
+queue_item_deliver (const QueueItem *item)
+{
+    switch (item->kind) {
+        case CALL_ROUTER:
+            ((void (*) (RouterInfo *)) item->func) (item->router);
+            break;
+        case CALL_STRING:
+            ((void (*) (RouterInfo *, const gchar *)) item->func) (item->router, item->string);
+            break;
+        case CALL_TOTAL:
+            ((void (*) (RouterInfo *, guint64)) item->func) (item->router, item->total);
+            break;
+        case CALL_RATE:
+            ((void (*) (RouterInfo *, gdouble)) item->func) (item->router, item->value);
+            break;
+        case CALL_PACKETS:
+            ((void (*) (RouterInfo *, gdouble, gdouble)) item->func) (item->router, item->value, item->value2);
+            break;
+        case CALL_PORT:
+            ((void (*) (RouterInfo *, const PortForwardInfo *)) item->func) (item->router, item->port_info);
+            break;
+    }
+}
+
+/* Deliver everything queued so far, in order, after the redraws */
+static gboolean
+queue_drain_cb (gpointer user_data)
+{
+    GQueue items;
+    QueueItem *item;
+
+    g_mutex_lock (&queue.mutex);
+    items = queue.items;
+    g_queue_init (&queue.items);
+    queue.scheduled = FALSE;
+    g_mutex_unlock (&queue.mutex);
+
+    urc_worker_lock ();
+
+    while ((item = g_queue_pop_head (&items)) != NULL) {
+        queue_item_deliver (item);
+
+        if (item->wait) {
+            g_mutex_lock (&queue.mutex);
+            item->delivered = TRUE;
+            g_cond_broadcast (&queue.delivered);
+            g_mutex_unlock (&queue.mutex);
+        }
+        else
+            queue_item_free (item);
+    }
+
+    urc_worker_unlock ();
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Called on the UPnP thread, with the lock held */
+static void
+queue_push (QueueItem *item)
+{
+    GSource *source;
+    guint depth;
+
+    g_mutex_lock (&queue.mutex);
+
+    g_queue_push_tail (&queue.items, item);
+
+    if (!queue.scheduled) {
+        source = g_idle_source_new ();
+        g_source_set_callback (source, queue_drain_cb, NULL, NULL);
+        g_source_attach (source, g_main_context_default ());
+        g_source_unref (source);
+
+        queue.scheduled = TRUE;
+    }
+
+    if (!item->wait) {
+        g_mutex_unlock (&queue.mutex);
+        return;
+    }
+
+    /* the delivery needs the lock, whatever the callers took */
+    depth = worker_release ();
+
+    while (!item->delivered)
+        g_cond_wait (&queue.delivered, &queue.mutex);
+
+    g_mutex_unlock (&queue.mutex);
+
+    worker_reacquire (depth);
+
+    queue_item_free (item);
+}
+
+static void
+queue_call_router (GCallback func, RouterInfo *router)
+{
+    queue_push (queue_item_new (CALL_ROUTER, func, router));
+}
+
+static void
+queue_call_string (GCallback func, RouterInfo *router, const gchar *string)
+{
+    QueueItem *item = queue_item_new (CALL_STRING, func, router);
+
+    item->string = g_strdup (string);
+    queue_push (item);
+}
+
+static void
+queue_call_total (GCallback func, RouterInfo *router, guint64 total)
+{
+    QueueItem *item = queue_item_new (CALL_TOTAL, func, router);
+
+    item->total = total;
+    queue_push (item);
+}
+
+static void
+queue_call_rate (GCallback func, RouterInfo *router, gdouble rate)
+{
+    QueueItem *item = queue_item_new (CALL_RATE, func, router);
+
+    item->value = rate;
+    queue_push (item);
+}
+
+static void
+queue_call_packets (GCallback func, RouterInfo *router, gdouble packet_rate, gdouble avg_packet_size)
+{
+    QueueItem *item = queue_item_new (CALL_PACKETS, func, router);
+
+    item->value = packet_rate;
+    item->value2 = avg_packet_size;
+    queue_push (item);
+}
+
+static void
+queue_call_port (GCallback func, RouterInfo *router, const PortForwardInfo *port_info)
+{
+    QueueItem *item = queue_item_new (CALL_PORT, func, router);
+
+    item->port_info = port_forward_info_copy (port_info);
+    queue_push (item);
+}
+
+static void
+queue_add_router (RouterInfo *router)
+{
+    queue_call_router (G_CALLBACK (queue.target->add_router), router);
+}
+
+static void
+queue_remove_router (RouterInfo *router)
+{
+    QueueItem *item = queue_item_new (CALL_ROUTER, G_CALLBACK (queue.target->remove_router), router);
+
+    /* the router is freed on return */
+    item->wait = TRUE;
+    queue_push (item);
+}
+
+static void
+queue_set_health (RouterInfo *router)
+{
+    queue_call_router (G_CALLBACK (queue.target->set_health), router);
+}
+
+static void
+queue_enable_port_mapping (RouterInfo *router)
+{
+    queue_call_router (G_CALLBACK (queue.target->enable_port_mapping), router);
+}
+
+static void
+queue_set_ext_ip (RouterInfo *router, const gchar *ip)
+{
+    queue_call_string (G_CALLBACK (queue.target->set_ext_ip), router, ip);
+}
+
+static void
+queue_disable_ext_ip (RouterInfo *router)
+{
+    queue_call_router (G_CALLBACK (queue.target->disable_ext_ip), router);
+}
+
+static void
+queue_set_conn_status (RouterInfo *router, const gchar *state)
+{
+    queue_call_string (G_CALLBACK (queue.target->set_conn_status), router, state);
+}
+
+static void
+queue_disable_conn_status (RouterInfo *router)
+{
+    queue_call_router (G_CALLBACK (queue.target->disable_conn_status), router);
+}
+
+static void
+queue_set_total_received (RouterInfo *router, guint64 total)
+{
+    queue_call_total (G_CALLBACK (queue.target->set_total_received), router, total);
+}
+
+static void
+queue_disable_total_received (RouterInfo *router)
+{
+    queue_call_router (G_CALLBACK (queue.target->disable_total_received), router);
+}
+
+static void
+queue_set_total_sent (RouterInfo *router, guint64 total)
+{
+    queue_call_total (G_CALLBACK (queue.target->set_total_sent), router, total);
+}
+
+static void
+queue_disable_total_sent (RouterInfo *router)
+{
+    queue_call_router (G_CALLBACK (queue.target->disable_total_sent), router);
+}
+
+static void
+queue_set_download_speed (RouterInfo *router, const gdouble down_speed)
+{
+    queue_call_rate (G_CALLBACK (queue.target->set_download_speed), router, down_speed);
+}
+
+static void
+queue_disable_download_speed (RouterInfo *router)
+{
+    queue_call_router (G_CALLBACK (queue.target->disable_download_speed), router);
+}
+
+static void
+queue_set_upload_speed (RouterInfo *router, const gdouble up_speed)
+{
+    queue_call_rate (G_CALLBACK (queue.target->set_upload_speed), router, up_speed);
+}
+
+static void
+queue_disable_upload_speed (RouterInfo *router)
+{
+    queue_call_router (G_CALLBACK (queue.target->disable_upload_speed), router);
+}
+
+static void
+queue_set_download_packets (RouterInfo *router, const gdouble packet_rate, const gdouble avg_packet_size)
+{
+    queue_call_packets (G_CALLBACK (queue.target->set_download_packets), router, packet_rate, avg_packet_size);
+}
+
+static void
+queue_set_upload_packets (RouterInfo *router, const gdouble packet_rate, const gdouble avg_packet_size)
+{
+    queue_call_packets (G_CALLBACK (queue.target->set_upload_packets), router, packet_rate, avg_packet_size);
+}
+
+static void
+queue_add_mapped_port (RouterInfo *router, const PortForwardInfo *port_info)
+{
+    queue_call_port (G_CALLBACK (queue.target->add_mapped_port), router, port_info);
+}
+
+static void
+queue_update_mapped_port (RouterInfo *router, const PortForwardInfo *port_info)
+{
+    queue_call_port (G_CALLBACK (queue.target->update_mapped_port), router, port_info);
+}
+
+static void
+queue_remove_mapped_port (RouterInfo *router, const PortForwardInfo *port_info)
+{
+    queue_call_port (G_CALLBACK (queue.target->remove_mapped_port), router, port_info);
+}
+
+static void
+queue_enable_graph (RouterInfo *router)
+{
+    queue_call_router (G_CALLBACK (queue.target->enable_graph), router);
+}
+
+static void
+queue_update_graph (RouterInfo *router)
+{
+    queue_call_router (G_CALLBACK (queue.target->update_graph), router);
+}
+
+static const UrcSink queue_sink =
+{
+    .add_router = queue_add_router,
+    .remove_router = queue_remove_router,
+    .set_health = queue_set_health,
+    .enable_port_mapping = queue_enable_port_mapping,
+    .set_ext_ip = queue_set_ext_ip,
+    .disable_ext_ip = queue_disable_ext_ip,
+    .set_conn_status = queue_set_conn_status,
+    .disable_conn_status = queue_disable_conn_status,
+    .set_total_received = queue_set_total_received,
+    .disable_total_received = queue_disable_total_received,
+    .set_total_sent = queue_set_total_sent,
+    .disable_total_sent = queue_disable_total_sent,
+    .set_download_speed = queue_set_download_speed,
+    .disable_download_speed = queue_disable_download_speed,
+    .set_upload_speed = queue_set_upload_speed,
+    .disable_upload_speed = queue_disable_upload_speed,
+    .set_download_packets = queue_set_download_packets,
+    .set_upload_packets = queue_set_upload_packets,
+    .add_mapped_port = queue_add_mapped_port,
+    .update_mapped_port = queue_update_mapped_port,
+    .remove_mapped_port = queue_remove_mapped_port,
+    .enable_graph = queue_enable_graph,
+    .update_graph = queue_update_graph,
+};
+
+const UrcSink*
+urc_worker_queue_sink (const UrcSink *sink)
+{
+    queue.target = sink;
+
+    return &queue_sink;
+}
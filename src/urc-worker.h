@@ -0,0 +1,86 @@
+/* urc-worker.h
+ *
+ * Copyright 2021 Daniele Napolitano <dnax88@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __URC_WORKER_H__
+#define __URC_WORKER_H__
+
+#include <glib.h>
+
+#include "urc-sink.h"
+
+/* The UPnP side (context manager, control points, polls and their
+ * timers) runs on a thread of its own, with its own GMainContext, so
+ * discovery and the replies never hold up the GTK drawing.
+ *
+ * Its callbacks run with the worker lock held. The UI thread takes the
+ * lock to read a RouterInfo, and never calls into urc-upnp.c otherwise:
+ * requests go through urc_worker_invoke(). The lock is recursive. */
+
+void
+urc_worker_start (void);
+
+void
+urc_worker_stop (GSourceFunc func,
+                 gpointer    data);
+
+void
+urc_worker_lock (void);
+
+void
+urc_worker_unlock (void);
+
+/* Run "func" on the UPnP thread, with the lock held */
+void
+urc_worker_invoke (GSourceFunc    func,
+                   gpointer       data,
+                   GDestroyNotify notify);
+
+/* Run "func" on the UI thread, without the lock: "data" must not point
+ * into a RouterInfo */
+void
+urc_worker_invoke_ui (GSourceFunc    func,
+                      gpointer       data,
+                      GDestroyNotify notify);
+
+/* g_timeout_add() and g_source_remove() on the context of the UPnP thread */
+guint
+urc_worker_timeout_add (guint       interval,
+                        GSourceFunc func,
+                        gpointer    data);
+
+guint
+urc_worker_timeout_add_seconds (guint       interval,
+                                GSourceFunc func,
+                                gpointer    data);
+
+void
+urc_worker_source_remove (guint id);
+
+GMainContext*
+urc_worker_get_context (void);
+
+/* A sink handing the calls of the UPnP thread to "sink" on the UI
+ * thread, queued and delivered together by an idle handler with the
+ * lock held. remove_router waits for the delivery, the router is freed
+ * after it; the lock is let go meanwhile, however deep it is held. */
+const UrcSink*
+urc_worker_queue_sink (const UrcSink *sink);
+
+#endif /* __URC_WORKER_H__ */